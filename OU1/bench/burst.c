@@ -0,0 +1,78 @@
+/**
+ * Bursty consumer for the pipe benchmark. Reads stdin in chunks, each read
+ * in full before it is worked on for a fixed time, like a filter that
+ * processes records in batches. At the end it prints the bytes read, the
+ * size of the pipe it read from and the number of times it had to wait for
+ * data.
+ *
+ * Usage: burst CHUNK USEC
+ *
+ * @file burst.c
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+static void spin(long usec);
+
+int main(int argc, char *argv[]) {
+  long chunk = argc == 3 ? atol(argv[1]) : 0;
+  long usec = argc == 3 ? atol(argv[2]) : -1;
+
+  if (chunk <= 0 || usec < 0) {
+    fprintf(stderr, "Usage: %s CHUNK USEC\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  char *buf = malloc(chunk);
+  if (!buf) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+
+  long long total = 0;
+  ssize_t n = 1;
+  while (n > 0) {
+    long len = 0;
+    while (len < chunk &&
+           (n = read(STDIN_FILENO, buf + len, chunk - len)) > 0) {
+      len += n;
+    }
+    if (n == -1) {
+      perror("read");
+      return EXIT_FAILURE;
+    }
+    total += len;
+    spin(usec);
+  }
+
+  // The pipe size is read at the end, after any growth
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%lld %d %ld\n", total, fcntl(STDIN_FILENO, F_GETPIPE_SZ),
+         ru.ru_nvcsw);
+
+  free(buf);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * spin - Keeps the processor busy for a while
+ *
+ * @param usec  Microseconds to spin
+ * */
+static void spin(long usec) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000000L +
+               (now.tv_nsec - start.tv_nsec) / 1000 <
+           usec);
+}
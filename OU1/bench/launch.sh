@@ -0,0 +1,46 @@
+#!/bin/bash
+# Benchmark of how long mexec takes to start and finish a pipeline of STAGES
+# cat commands reading /dev/null, for several stage counts, with the
+# processes started by posix_spawnp and by fork and execvp [-F]. Each result
+# is the median over RUNS batches of BATCH runs, in microseconds per
+# pipeline.
+#
+# Usage: bench/launch.sh [MEXEC] [RUNS] [BATCH]
+
+MEXEC=$(realpath "${1:-./mexec}")
+RUNS=${2:-5}
+BATCH=${3:-200}
+STAGES="1 2 4 8 16 32"
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# batch_us FILE [OPTION] - Runs mexec BATCH times and prints the mean wall
+# time of one run in microseconds
+batch_us() {
+    local file=$1 start end
+    shift
+    start=$(date +%s%N)
+    for ((i = 0; i < BATCH; i++)); do
+        "$MEXEC" "$@" "$file" </dev/null >/dev/null || exit 1
+    done
+    end=$(date +%s%N)
+    echo $(((end - start) / BATCH / 1000))
+}
+
+# median - Prints the median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+echo "Stages | fork (us) | posix_spawn (us)"
+for s in $STAGES; do
+    file="$DIR/pipeline$s"
+    for ((i = 0; i < s; i++)); do
+        echo cat
+    done >"$file"
+
+    fork=$(for ((r = 0; r < RUNS; r++)); do batch_us "$file" -F; done | median)
+    spawn=$(for ((r = 0; r < RUNS; r++)); do batch_us "$file"; done | median)
+    echo "$s | $fork | $spawn"
+done
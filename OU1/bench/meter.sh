@@ -0,0 +1,47 @@
+#!/bin/bash
+# Overhead of --meter. mexec runs head writing BYTES of zeros through
+# STAGES cat commands into wc -c, with the commands connected directly and
+# with the data moved by mexec. For each it prints the median over RUNS
+# runs of the bytes through the pipeline per second of wall time.
+#
+# Usage: bench/meter.sh [MEXEC] [RUNS] [BYTES] [STAGES]
+
+MEXEC=$(realpath "${1:-./mexec}")
+RUNS=${2:-3}
+BYTES=${3:-2G}
+STAGES=${4:-2}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+{
+    echo "head -c $BYTES /dev/zero"
+    for ((i = 0; i < STAGES; i++)); do
+        echo cat
+    done
+    echo "wc -c"
+} >"$DIR/pipeline"
+
+# run [OPTION] - Runs the pipeline once and prints its MB/s
+run() {
+    local start end bytes
+    start=$(date +%s%N)
+    bytes=$("$MEXEC" "$@" "$DIR/pipeline" 2>/dev/null) || exit 1
+    end=$(date +%s%N)
+    awk -v b="$bytes" -v ns=$((end - start)) \
+        'BEGIN { printf "%.0f\n", b / 1e6 / (ns / 1e9) }'
+}
+
+# median - Prints the median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+direct=$(for ((r = 0; r < RUNS; r++)); do run; done | median)
+meter=$(for ((r = 0; r < RUNS; r++)); do run --meter; done | median)
+
+echo "Pipes | MB/s"
+echo "direct | $direct"
+echo "meter | $meter"
+awk -v d="$direct" -v m="$meter" \
+    'BEGIN { printf "overhead | %.1f%%\n", 100 * (d - m) / d }'
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Throughput of replicated stages. mexec runs cat on a file of LINES
+# numbers into a sed that rewrites every digit 1, as a stage that is bound
+# by the processor, into wc -c. The sed stage is run as it is and with
+# @parallel N, in order and with @unordered. Each result is the median over
+# RUNS runs of the input bytes per second of wall time.
+#
+# Usage: bench/parallel.sh [MEXEC] [RUNS] [LINES]
+
+MEXEC=$(realpath "${1:-./mexec}")
+RUNS=${2:-3}
+LINES=${3:-10000000}
+REPLICAS="2 4 8"
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+seq 1 "$LINES" >"$DIR/input"
+BYTES=$(stat -c %s "$DIR/input")
+
+# run ANNOTATIONS - Runs the pipeline once with the sed stage annotated and
+# prints its MB/s
+run() {
+    local start end
+    printf 'cat %s\n%s sed s/1/one/g\nwc -c\n' "$DIR/input" "$1" \
+        >"$DIR/pipeline"
+    start=$(date +%s%N)
+    "$MEXEC" "$DIR/pipeline" >/dev/null || exit 1
+    end=$(date +%s%N)
+    awk -v b="$BYTES" -v ns=$((end - start)) \
+        'BEGIN { printf "%.1f\n", b / 1e6 / (ns / 1e9) }'
+}
+
+# median - Prints the median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+echo "Replicas | ordered MB/s | unordered MB/s"
+single=$(for ((r = 0; r < RUNS; r++)); do run ""; done | median)
+echo "1 | $single | $single"
+for n in $REPLICAS; do
+    ordered=$(for ((r = 0; r < RUNS; r++)); do
+        run "@parallel $n"
+    done | median)
+    unordered=$(for ((r = 0; r < RUNS; r++)); do
+        run "@parallel $n @unordered"
+    done | median)
+    echo "$n | $ordered | $unordered"
+done
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Throughput benchmark of pipe sizes. mexec runs a pipeline where head
+# writes BYTES of zeros as fast as it can into bench/burst, which reads 1 MiB
+# at a time and then works on it for 100 microseconds. For each pipe size
+# it prints the median over RUNS runs of
+#   MB/s     bytes through the pipeline per second of wall time
+#   pipe     size of the pipe at the end, in bytes
+#   waits    times burst blocked waiting for data
+#
+# Usage: bench/pipe.sh [MEXEC] [RUNS] [BYTES]
+
+MEXEC=$(realpath "${1:-./mexec}")
+RUNS=${2:-3}
+BYTES=${3:-2G}
+BURST=$(realpath "$(dirname "$0")/burst")
+SIZES="default 256K 1M auto"
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+printf 'head -c %s /dev/zero\n%s 1048576 100\n' "$BYTES" "$BURST" \
+    >"$DIR/pipeline"
+
+# run SIZE - Runs the pipeline once and prints MB/s, pipe size and waits
+run() {
+    local start end out opts=()
+    [ "$1" != default ] && opts=(-p "$1")
+    start=$(date +%s%N)
+    out=$("$MEXEC" "${opts[@]}" "$DIR/pipeline") || exit 1
+    end=$(date +%s%N)
+    read -r bytes pipe waits <<<"$out"
+    awk -v b="$bytes" -v ns=$((end - start)) -v p="$pipe" -v w="$waits" \
+        'BEGIN { printf "%.0f %d %d\n", b / 1e6 / (ns / 1e9), p, w }'
+}
+
+echo "Pipe | MB/s | pipe | waits"
+for size in $SIZES; do
+    for ((r = 0; r < RUNS; r++)); do
+        run "$size"
+    done | sort -n | awk -v s="$size" '
+        { v[NR] = $0 }
+        END { split(v[int((NR + 1) / 2)], m, " ")
+              printf "%s | %s | %s | %s\n", s, m[1], m[2], m[3] }'
+done
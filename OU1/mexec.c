@@ -6,25 +6,100 @@
  * @version 1.1
  */
 
+#define _GNU_SOURCE
+#include "parallel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 #include <wait.h>
 
 #define MAX_LINE 1024
+
+// Pipe size that grows while the pipe is seen filling up
+#define PIPE_AUTO -1
+// How often pipes of size PIPE_AUTO are checked, in milliseconds
+#define PIPE_CHECK_MS 10
+// Most bytes moved by one splice with [--meter]
+#define METER_CHUNK (1 << 20)
+// Most replicas of a command with [@parallel N]
+#define MAX_REPLICAS 1024
+
+extern char **environ;
+
+// A command of the pipeline with its annotations
+typedef struct stage {
+  char **args;
+  int pipe_size;       // [@pipe SIZE] Size of the pipe it writes to
+  int replicas;        // [@parallel N] Processes run over chunks of input
+  bool unordered;      // [@unordered] Outputs of replicas as they are done
+  bool grep_status;    // [@status grep] Replicas that exit with 1 found
+                       // nothing rather than failed
+  pid_t pid;           // -1 if it was not started
+  double start;        // When it was started, in seconds
+  double end;          // When it was reaped, 0 before
+  int status;          // Status from wait4
+  struct rusage usage; // Resources it used, from wait4
+} stage;
+
+// Formats of the report of [--rusage]
+enum report { REPORT_NONE, REPORT_TABLE, REPORT_JSON };
+
+// A pipe between two commands that mexec moves the data of with [--meter]
+typedef struct meter_link {
+  int in;           // Read end of the pipe from the writer, -1 at the end
+  int out;          // Write end of the pipe to the reader, -1 at the end
+  bool grow;        // Grow out while it is full, for pipe size auto
+  bool wait_out;    // Waiting for the reader rather than the writer
+  long long bytes;  // Bytes moved
+  double since;     // When it started waiting on its current side
+  double waited[2]; // Seconds waited for the writer and for the reader
+  double end;       // When it reached its end, 0 before
+} meter_link;
+
+typedef struct options {
+  bool legacy;        // [-F] Start the commands with fork and execvp
+  int pipe_size;      // [-p SIZE] Size of pipes without an annotation
+  bool meter;         // [--meter] Move the data through mexec
+  double interval;    // [--meter=SECONDS] Seconds between reports
+  enum report report; // [--rusage[=table|json]] Report resources per stage
+} options;
+
 // Functions
 
 /*
- * handleCmdLineArgs - Makes sure program has correct amount of arguments
+ * handleCmdLineArgs - Reads the options and makes sure program has correct
+ * amount of arguments
  *
  * @param argc    number of command arguments
  * @param *argv[] Aarray of command arugments
+ * @param opts    Filled with the options given
  *
  * Returns: FILE * to the opend file or stdin
  *          Returns NULL on error
  * */
-FILE *handle_CmdLine_Args(int argc, char *argv[]);
+FILE *handle_CmdLine_Args(int argc, char *argv[], options *opts);
+
+/*
+ * parse_size - Reads a pipe size, in bytes with an optional K or M suffix,
+ * or "auto"
+ *
+ * @param str   The size
+ *
+ * @return The size, PIPE_AUTO for "auto", 0 if it is not a valid size
+ * */
+int parse_size(const char *str);
 
 /*
  * parse_line - Splits lines into array of arguments
@@ -46,6 +121,17 @@ char **parse_line(char *buffer);
  */
 void free_args(char **args);
 
+/*
+ * parse_annotations - Removes the annotations in front of a command and
+ * stores them in its stage. Exits on an unknown or invalid annotation.
+ *
+ * @param args    Array of string arguments, the command is moved to its start
+ * @param stage   The stage of the command
+ *
+ * @return void
+ * */
+void parse_annotations(char **args, stage *stage);
+
 /*
  * commands_setup - Setups all commands from input file or stdin and stores them
  * in an dynamically allocated array
@@ -54,45 +140,268 @@ void free_args(char **args);
  * @param commands_amount   Pointer to commands_amount that keeps track of
  * amount of commands
  *
- * @return Dynamically allocated array of arguments array
+ * @return Dynamically allocated array of stages
  */
 
-char ***commands_setup(FILE *file, int *commands_amount);
+stage *commands_setup(FILE *file, int *commands_amount);
 
 /*
  * pipes_setup - Setups pipes for communcation between processes through a
- * pipeline
+ * pipeline. The pipes are close-on-exec, so only the ends a command gets as
+ * stdin or stdout stay open in it.
  *
+ * @param commands          Array of commands, a pipe_size of 0 is set to
+ *                          the default
  * @param commands_amount   The amount of commands
+ * @param pipe_size         Default size of the pipes, 0 for the system's
  *
  * @return 2D array of file descriptors
  *
  * */
-int **pipes_setup(int commands_amount);
+int **pipes_setup(stage *commands, int commands_amount, int pipe_size);
+
+/*
+ * pipe_max_size - Reads the largest size an unprivileged process may give a
+ * pipe
+ *
+ * @return The size in bytes
+ * */
+int pipe_max_size(void);
+
+/*
+ * set_pipe_size - Sets the size of a pipe, capped at pipe_max_size. A
+ * failure is reported and the pipe keeps its size.
+ *
+ * @param fd      Either end of the pipe
+ * @param size    Size in bytes
+ *
+ * @return void
+ * */
+void set_pipe_size(int fd, int size);
+
+/*
+ * spawn_setup - Starts each command with posix_spawnp, which does not copy
+ * the address space of mexec, and setups the pipeline with file actions
+ * that redirect the stdin and stdout of the new processes
+ *
+ * @param commands          Array of commands, their pids are set
+ * @param commands_amount   Number of commands
+ * @param pipes             Array of pipes
+ *
+ * @return Number of commands that were started
+ * */
+int spawn_setup(stage *commands, int commands_amount, int **pipes);
 
 /*
  * fork_setup - Forks a new process for each command and setups the pipeline by
- * redirecting the child processes stdin and stdout
+ * redirecting the child processes stdin and stdout. Used with [-F].
  *
- * @param commands          Array of commands
+ * @param commands          Array of commands, their pids are set
  * @param commands_amount   Number of commands
  * @param pipes             Array of pipes
  *
  * Allocates memory which should be freed using the cleanup function.
  *
+ * @return Number of commands that were started
+ * */
+int fork_setup(stage *commands, int commands_amount, int **pipes);
+
+/*
+ * parallel_setup - Starts a command with [@parallel N] as a child process of
+ * mexec that runs the replicas with parallel_run
+ *
+ * @param command   The command
+ * @param in        Descriptor for its stdin, -1 to keep mexec's
+ * @param out       Descriptor for its stdout, -1 to keep mexec's
+ *
+ * @return pid of the child process, -1 if it could not be started
+ * */
+pid_t parallel_setup(stage *command, int in, int out);
+
+/*
+ * close_pipes - Closes the parents copies of the pipes once the commands are
+ * started. The read end of a pipe of size PIPE_AUTO stays open while its
+ * reader runs, so the pipe can be watched.
+ *
+ * @param commands          Array of commands
+ * @param commands_amount   Number of commands
+ * @param pipes             Array of pipes, closed ends are set to -1
+ *
+ * @return true if any pipe is watched
+ * */
+bool close_pipes(stage *commands, int commands_amount, int **pipes);
+
+/*
+ * meter_setup - Puts mexec between the commands for [--meter]. Each pipe
+ * gets a second pipe to its reader, the data is moved from one to the
+ * other by meter_run.
+ *
+ * @param commands          Array of commands, PIPE_AUTO sizes are taken over
+ *                          by the meter and set to 0
+ * @param commands_amount   Number of commands
+ * @param pipes             Array of pipes, the read ends are replaced by the
+ *                          read ends of the new pipes
+ *
+ * @return Array of links, one per pipe
+ * */
+meter_link *meter_setup(stage *commands, int commands_amount, int **pipes);
+
+/*
+ * meter_run - Moves the data of each link with splice until every link has
+ * reached its end, then reports the bytes moved and how long each link
+ * waited for its writer (upstream) and its reader (downstream). A command
+ * whose output link mostly waits upstream is the slow one.
+ *
+ * @param commands          Array of commands
+ * @param commands_amount   Number of commands
+ * @param links             Array of links, closed at their end
+ * @param interval          Seconds between reports while running, 0 to
+ *                          report only at the end
+ *
+ * Child processes that exit meanwhile are reaped, so their end times hold.
+ *
+ * @return Number of child processes reaped
+ * */
+int meter_run(stage *commands, int commands_amount, meter_link *links,
+              double interval);
+
+/*
+ * meter_move - Moves the data a link has until it has to wait, and keeps
+ * account of the side it waits for
+ *
+ * @param link    The link
+ * @param now     Current time in seconds
+ *
+ * @return true if the link reached its end
+ * */
+bool meter_move(meter_link *link, double now);
+
+/*
+ * meter_wait - Switches the side a link waits for, adding the time since
+ * the last switch to the side it waited for
+ *
+ * @param link      The link
+ * @param wait_out  true to wait for the reader, false for the writer
+ * @param now       Current time in seconds
+ *
  * @return void
  * */
-void fork_setup(char ***commands, int commands_amount, int **pipes);
+void meter_wait(meter_link *link, bool wait_out, double now);
 
 /*
- * wait_for_children - Waits for child processes and checks exit status
+ * meter_report - Writes the bytes, throughput and waiting times of the
+ * links to stderr
  *
- * @param commands_amount  Number of commands
+ * @param commands          Array of commands
+ * @param commands_amount   Number of commands
+ * @param links             Array of links
+ * @param start             When the commands were started, in seconds
+ * @param now               Current time in seconds
  *
  * @return void
+ * */
+void meter_report(stage *commands, int commands_amount, meter_link *links,
+                  double start, double now);
+
+/*
+ * now_seconds - Reads the monotonic clock
  *
+ * @return The time in seconds
  * */
-void wait_for_children(int commands_amount);
+double now_seconds(void);
+
+/*
+ * ignore_signal - Handler that only makes a signal interrupt a system call
+ *
+ * @param sig   The signal
+ *
+ * @return void
+ * */
+void ignore_signal(int sig);
+
+/*
+ * reap_child - Reaps a child process with wait4 and stores its status, end
+ * time and resource usage in its stage. Exits on failure.
+ *
+ * @param commands          Array of commands
+ * @param commands_amount   Number of commands
+ * @param flags             0 to wait, WNOHANG to not wait
+ *
+ * @return Index of the stage of the child, -1 if no child had exited or,
+ * with WNOHANG, none is left
+ * */
+int reap_child(stage *commands, int commands_amount, int flags);
+
+/*
+ * wait_for_children - Waits for child processes
+ *
+ * @param commands          Array of commands
+ * @param commands_amount   Number of commands
+ * @param children          Number of child processes
+ *
+ * @return void
+ *
+ * */
+void wait_for_children(stage *commands, int commands_amount, int children);
+
+/*
+ * watch_pipes - Waits for child processes like wait_for_children, and
+ * doubles the size of each watched pipe that is found at least three
+ * quarters full until it reaches pipe_max_size
+ *
+ * @param commands          Array of commands
+ * @param commands_amount   Number of commands
+ * @param pipes             Array of pipes, read ends that are no longer
+ *                          watched are closed and set to -1
+ * @param children          Number of child processes
+ *
+ * @return void
+ * */
+void watch_pipes(stage *commands, int commands_amount, int **pipes,
+                 int children);
+
+/*
+ * grow_pipes - Doubles the size of the watched pipes that are filling up
+ *
+ * @param commands_amount   Number of commands
+ * @param pipes             Array of pipes, read ends that are no longer
+ *                          watched are closed and set to -1
+ *
+ * @return void
+ * */
+void grow_pipes(int commands_amount, int **pipes);
+
+/*
+ * failed - Checks whether a command was not started or did not exit with
+ * status 0
+ *
+ * @param command   The command, reaped
+ *
+ * @return true if it failed
+ * */
+bool failed(const stage *command);
+
+/*
+ * rusage_report - Writes the exit status, wall time, CPU time, largest
+ * resident set and context switches of each command to stderr
+ *
+ * @param commands          Array of commands, reaped
+ * @param commands_amount   Number of commands
+ * @param format            REPORT_TABLE or REPORT_JSON
+ *
+ * @return void
+ * */
+void rusage_report(stage *commands, int commands_amount, enum report format);
+
+/*
+ * json_string - Writes a string as a JSON string
+ *
+ * @param fp    Where to write
+ * @param str   The string
+ *
+ * @return void
+ * */
+void json_string(FILE *fp, const char *str);
 
 /*
  * cleanup - Cleans up all dynamically allocated memory and closes all files and
@@ -105,41 +414,113 @@ void wait_for_children(int commands_amount);
  *
  * @reutnr void
  * */
-void cleanup(FILE *file, char ***commands, int commands_amount, int **pipes);
+void cleanup(FILE *file, stage *commands, int commands_amount, int **pipes);
 
 int main(int argc, char *argv[]) {
 
-  FILE *file = handle_CmdLine_Args(argc, argv);
+  options opts = {0};
+  FILE *file = handle_CmdLine_Args(argc, argv, &opts);
 
   if (!file)
     return EXIT_FAILURE;
 
   int commands_amount = 0;
 
-  char ***commands = commands_setup(file, &commands_amount);
-  int **pipes = pipes_setup(commands_amount);
-  fork_setup(commands, commands_amount, pipes);
-  wait_for_children(commands_amount);
+  stage *commands = commands_setup(file, &commands_amount);
+  int **pipes = pipes_setup(commands, commands_amount, opts.pipe_size);
+  meter_link *links =
+      opts.meter ? meter_setup(commands, commands_amount, pipes) : NULL;
+  int started = opts.legacy ? fork_setup(commands, commands_amount, pipes)
+                            : spawn_setup(commands, commands_amount, pipes);
+  bool watched = close_pipes(commands, commands_amount, pipes);
+  int children = started;
+  if (links) {
+    children -= meter_run(commands, commands_amount, links, opts.interval);
+  }
+  if (watched) {
+    watch_pipes(commands, commands_amount, pipes, children);
+  } else {
+    wait_for_children(commands, commands_amount, children);
+  }
+
+  if (opts.report != REPORT_NONE)
+    rusage_report(commands, commands_amount, opts.report);
 
+  // A command that could not be started fails the pipeline like one that
+  // exited with an error
+  int ret = EXIT_SUCCESS;
+  for (int i = 0; i < commands_amount; i++) {
+    if (failed(&commands[i]))
+      ret = EXIT_FAILURE;
+  }
+
+  free(links);
   cleanup(file, commands, commands_amount, pipes);
 
-  return EXIT_SUCCESS;
+  return ret;
 }
 
-FILE *handle_CmdLine_Args(int argc, char *argv[]) {
+FILE *handle_CmdLine_Args(int argc, char *argv[], options *opts) {
+  const char *usage = "usage: %s [-F] [-p SIZE|auto] [--meter[=SECONDS]] "
+                      "[--rusage[=table|json]] [file]\n";
+  const struct option long_opts[] = {
+      {"fork", no_argument, NULL, 'F'},
+      {"pipe", required_argument, NULL, 'p'},
+      {"meter", optional_argument, NULL, 'm'},
+      {"rusage", optional_argument, NULL, 'r'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "Fp:", long_opts, NULL)) != -1) {
+    switch (c) {
+    case 'F':
+      opts->legacy = true;
+      break;
+    case 'p':
+      if (!(opts->pipe_size = parse_size(optarg))) {
+        fprintf(stderr, "%s: invalid pipe size '%s'\n", argv[0], optarg);
+        return NULL;
+      }
+      break;
+    case 'm':
+      opts->meter = true;
+      if (optarg) {
+        char *end;
+        opts->interval = strtod(optarg, &end);
+        if (end == optarg || *end != '\0' || !(opts->interval > 0)) {
+          fprintf(stderr, "%s: invalid interval '%s'\n", argv[0], optarg);
+          return NULL;
+        }
+      }
+      break;
+    case 'r':
+      if (!optarg || strcmp(optarg, "table") == 0) {
+        opts->report = REPORT_TABLE;
+      } else if (strcmp(optarg, "json") == 0) {
+        opts->report = REPORT_JSON;
+      } else {
+        fprintf(stderr, "%s: invalid report format '%s'\n", argv[0], optarg);
+        return NULL;
+      }
+      break;
+    default:
+      fprintf(stderr, usage, argv[0]);
+      return NULL;
+    }
+  }
 
-  // More then two arguments print usage message
-  if (argc > 2) {
-    fprintf(stderr, "usage: %s [file]\n", argv[0]);
+  // More then one file print usage message
+  if (argc - optind > 1) {
+    fprintf(stderr, usage, argv[0]);
 
     return NULL;
   }
 
   // if correct amount we should open the file provided in read mode
-  if (argc == 2) {
-    FILE *file = fopen(argv[1], "r");
+  if (argc - optind == 1) {
+    FILE *file = fopen(argv[optind], "r");
     if (!file) {
-      perror(argv[1]);
+      perror(argv[optind]);
       return NULL;
     }
 
@@ -149,6 +530,28 @@ FILE *handle_CmdLine_Args(int argc, char *argv[]) {
   return stdin;
 }
 
+int parse_size(const char *str) {
+  if (strcmp(str, "auto") == 0)
+    return PIPE_AUTO;
+
+  char *end;
+  errno = 0;
+  long size = strtol(str, &end, 10);
+  if (*end == 'K' || *end == 'k') {
+    size = size > INT_MAX / 1024 ? 0 : size * 1024;
+    end++;
+  } else if (*end == 'M' || *end == 'm') {
+    size = size > INT_MAX / (1024 * 1024) ? 0 : size * 1024 * 1024;
+    end++;
+  }
+
+  if (errno != 0 || end == str || *end != '\0' || size <= 0 ||
+      size > INT_MAX)
+    return 0;
+
+  return size;
+}
+
 char **parse_line(char *buffer) {
   int max_args = 30;
   char **args = malloc(sizeof(char *) * max_args);
@@ -187,10 +590,64 @@ void free_args(char **args) {
   free(args);
 }
 
-char ***commands_setup(FILE *file, int *commands_amount) {
+void parse_annotations(char **args, stage *stage) {
+  int first = 0;
+
+  while (args[first] != NULL && args[first][0] == '@') {
+    if (strcmp(args[first], "@pipe") == 0) {
+      if (args[first + 1] == NULL ||
+          !(stage->pipe_size = parse_size(args[first + 1]))) {
+        fprintf(stderr, "mexec: invalid pipe size '%s'\n",
+                args[first + 1] ? args[first + 1] : "");
+        exit(EXIT_FAILURE);
+      }
+      first += 2;
+    } else if (strcmp(args[first], "@parallel") == 0) {
+      char *end = NULL;
+      long n = args[first + 1] ? strtol(args[first + 1], &end, 10) : 0;
+      if (!end || *end != '\0' || n < 1 || n > MAX_REPLICAS) {
+        fprintf(stderr, "mexec: invalid number of replicas '%s'\n",
+                args[first + 1] ? args[first + 1] : "");
+        exit(EXIT_FAILURE);
+      }
+      stage->replicas = n;
+      first += 2;
+    } else if (strcmp(args[first], "@unordered") == 0) {
+      stage->unordered = true;
+      first++;
+    } else if (strcmp(args[first], "@status") == 0) {
+      if (args[first + 1] == NULL || strcmp(args[first + 1], "grep") != 0) {
+        fprintf(stderr, "mexec: invalid status rule '%s'\n",
+                args[first + 1] ? args[first + 1] : "");
+        exit(EXIT_FAILURE);
+      }
+      stage->grep_status = true;
+      first += 2;
+    } else {
+      fprintf(stderr, "mexec: unknown annotation '%s'\n", args[first]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (args[first] == NULL) {
+    fprintf(stderr, "mexec: annotation without a command\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // free the annotations and move the command to the start
+  for (int i = 0; i < first; i++) {
+    free(args[i]);
+  }
+  int i = 0;
+  do {
+    args[i] = args[first + i];
+  } while (args[i++] != NULL);
+}
+
+stage *commands_setup(FILE *file, int *commands_amount) {
   char line[MAX_LINE];
   int amount = 0;
-  char ***commands = NULL;
+  stage *commands = NULL;
 
   // read entire file or stdin
   while (fgets(line, MAX_LINE, file) != NULL) {
@@ -206,7 +663,7 @@ char ***commands_setup(FILE *file, int *commands_amount) {
     }
 
     // resize commands to be able to store more args
-    commands = realloc(commands, sizeof(char **) * (amount + 1));
+    commands = realloc(commands, sizeof(stage) * (amount + 1));
 
     // check realloc
     if (!commands) {
@@ -215,7 +672,9 @@ char ***commands_setup(FILE *file, int *commands_amount) {
     }
 
     // save the args after reallocaing
-    commands[amount] = args;
+    commands[amount] =
+        (stage){.args = args, .pipe_size = 0, .replicas = 1, .pid = -1};
+    parse_annotations(args, &commands[amount]);
     amount++;
   }
   // updates the commands_amount by pointer
@@ -224,7 +683,7 @@ char ***commands_setup(FILE *file, int *commands_amount) {
   return commands;
 }
 
-int **pipes_setup(int commands_amount) {
+int **pipes_setup(stage *commands, int commands_amount, int pipe_size) {
   int pipes_amount = commands_amount - 1;
 
   // Allocate memory for array of pipes
@@ -243,21 +702,107 @@ int **pipes_setup(int commands_amount) {
       perror("malloc");
       exit(EXIT_FAILURE);
     }
-    // run pipe on each FD and check that it works
-    if (pipe(pipes[i]) == -1) {
-      perror("pipe");
+    // run pipe2 on each FD and check that it works, close-on-exec so no
+    // command inherits the pipes of the others
+    if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+      perror("pipe2");
       exit(EXIT_FAILURE);
     }
+
+    // the annotation of the writing command wins over the option, pipes of
+    // size PIPE_AUTO start small and grow in watch_pipes
+    if (commands[i].pipe_size == 0)
+      commands[i].pipe_size = pipe_size;
+    if (commands[i].pipe_size > 0)
+      set_pipe_size(pipes[i][1], commands[i].pipe_size);
   }
 
   return pipes;
 }
 
-void fork_setup(char ***commands, int commands_amount, int **pipes) {
+int pipe_max_size(void) {
+  static int max_size = 0;
+
+  if (max_size == 0) {
+    // the kernels default if the limit can not be read
+    max_size = 1024 * 1024;
+    FILE *fp = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (fp) {
+      int size;
+      if (fscanf(fp, "%d", &size) == 1 && size > 0)
+        max_size = size;
+      fclose(fp);
+    }
+  }
+
+  return max_size;
+}
+
+void set_pipe_size(int fd, int size) {
+  if (size > pipe_max_size())
+    size = pipe_max_size();
+
+  if (fcntl(fd, F_SETPIPE_SZ, size) == -1)
+    fprintf(stderr, "mexec: pipe size %d: %s\n", size, strerror(errno));
+}
+
+int spawn_setup(stage *commands, int commands_amount, int **pipes) {
+  int started = 0;
+
+  for (int i = 0; i < commands_amount; i++) {
+    if (commands[i].replicas > 1) {
+      commands[i].start = now_seconds();
+      commands[i].pid =
+          parallel_setup(&commands[i], i > 0 ? pipes[i - 1][0] : -1,
+                         i < commands_amount - 1 ? pipes[i][1] : -1);
+      started += commands[i].pid != -1;
+      continue;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    // dup2 clears close-on-exec on the copy, the originals close at exec
+    if (i > 0) {
+      posix_spawn_file_actions_adddup2(&actions, pipes[i - 1][0],
+                                       STDIN_FILENO);
+    }
+    if (i < commands_amount - 1) {
+      posix_spawn_file_actions_adddup2(&actions, pipes[i][1], STDOUT_FILENO);
+    }
+
+    commands[i].start = now_seconds();
+    int err = posix_spawnp(&commands[i].pid, commands[i].args[0], &actions,
+                           NULL, commands[i].args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0) {
+      fprintf(stderr, "%s: %s\n", commands[i].args[0], strerror(err));
+      commands[i].pid = -1;
+    } else {
+      started++;
+    }
+  }
+
+  return started;
+}
+
+int fork_setup(stage *commands, int commands_amount, int **pipes) {
   int pipes_amount = commands_amount - 1;
+  int started = 0;
   // loop over all commands
   for (int i = 0; i < commands_amount; i++) {
+    if (commands[i].replicas > 1) {
+      commands[i].start = now_seconds();
+      commands[i].pid =
+          parallel_setup(&commands[i], i > 0 ? pipes[i - 1][0] : -1,
+                         i < commands_amount - 1 ? pipes[i][1] : -1);
+      started += commands[i].pid != -1;
+      continue;
+    }
+
     // fork for each command
+    commands[i].start = now_seconds();
     int pid = fork();
     if (pid == -1) {
       perror("fork");
@@ -287,42 +832,430 @@ void fork_setup(char ***commands, int commands_amount, int **pipes) {
       }
 
       // execute the commands
-      execvp(commands[i][0], commands[i]);
-      perror(commands[i][0]);
+      execvp(commands[i].args[0], commands[i].args);
+      perror(commands[i].args[0]);
       exit(EXIT_FAILURE);
     }
+    commands[i].pid = pid;
+    started++;
+  }
+
+  return started;
+}
+
+pid_t parallel_setup(stage *command, int in, int out) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    return -1;
   }
+  if (pid > 0)
+    return pid;
+
+  if ((in != -1 && dup2(in, STDIN_FILENO) == -1) ||
+      (out != -1 && dup2(out, STDOUT_FILENO) == -1)) {
+    perror("dup2");
+    _exit(EXIT_FAILURE);
+  }
+
+  // the child does not exec, so the pipes of the other commands and the
+  // meter are closed here, or their readers would never see the end
+  close_range(STDERR_FILENO + 1, ~0U, 0);
+  _exit(parallel_run(command->args, command->replicas, !command->unordered,
+                     command->grep_status));
+}
+
+bool close_pipes(stage *commands, int commands_amount, int **pipes) {
+  bool watched = false;
 
   // close the parents copies of pipes
-  for (int i = 0; i < pipes_amount; i++) {
-    close(pipes[i][0]);
+  for (int i = 0; i < commands_amount - 1; i++) {
     close(pipes[i][1]);
+    if (commands[i].pipe_size == PIPE_AUTO && commands[i + 1].pid != -1) {
+      watched = true;
+    } else {
+      close(pipes[i][0]);
+      pipes[i][0] = -1;
+    }
+  }
+
+  return watched;
+}
+
+meter_link *meter_setup(stage *commands, int commands_amount, int **pipes) {
+  meter_link *links = calloc(commands_amount, sizeof(meter_link));
+
+  if (!links) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < commands_amount - 1; i++) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+      perror("pipe2");
+      exit(EXIT_FAILURE);
+    }
+    if (commands[i].pipe_size > 0)
+      set_pipe_size(fds[1], commands[i].pipe_size);
+
+    // the meter grows the pipe to the reader itself, watch_pipes would keep
+    // a read end of it open
+    links[i].grow = commands[i].pipe_size == PIPE_AUTO;
+    if (links[i].grow)
+      commands[i].pipe_size = 0;
+
+    links[i].in = pipes[i][0];
+    links[i].out = fds[1];
+    pipes[i][0] = fds[0];
   }
+
+  return links;
 }
 
-void wait_for_children(int commands_amount) {
+int meter_run(stage *commands, int commands_amount, meter_link *links,
+              double interval) {
+  int links_amount = commands_amount - 1;
+  int reaped = 0;
+  if (links_amount <= 0)
+    return 0;
+
+  struct pollfd *fds = malloc(sizeof(struct pollfd) * links_amount);
+  if (!fds) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  // a reader that is gone must show as EPIPE, not end mexec
+  signal(SIGPIPE, SIG_IGN);
+
+  // SIGCHLD is only let through while in ppoll, where it interrupts it
+  sigset_t set, wait_set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, &wait_set);
+  sigdelset(&wait_set, SIGCHLD);
+  signal(SIGCHLD, ignore_signal);
+
+  double start = now_seconds();
+  double next_report = start + interval;
+  int live = links_amount;
+  for (int i = 0; i < links_amount; i++) {
+    links[i].since = start;
+  }
+
+  while (live > 0) {
+    for (int i = 0; i < links_amount; i++) {
+      fds[i].fd = links[i].in == -1      ? -1
+                  : links[i].wait_out ? links[i].out
+                                      : links[i].in;
+      fds[i].events = links[i].wait_out ? POLLOUT : POLLIN;
+    }
+
+    struct timespec timeout;
+    if (interval > 0) {
+      double left = next_report - now_seconds();
+      left = left > 0 ? left : 0;
+      timeout.tv_sec = (time_t)left;
+      timeout.tv_nsec = (long)((left - timeout.tv_sec) * 1e9);
+    }
+    if (ppoll(fds, links_amount, interval > 0 ? &timeout : NULL,
+              &wait_set) == -1) {
+      if (errno != EINTR) {
+        perror("ppoll");
+        exit(EXIT_FAILURE);
+      }
+      while (reap_child(commands, commands_amount, WNOHANG) != -1) {
+        reaped++;
+      }
+      continue;
+    }
+
+    double now = now_seconds();
+    for (int i = 0; i < links_amount; i++) {
+      if (fds[i].fd != -1 && fds[i].revents != 0 &&
+          meter_move(&links[i], now))
+        live--;
+    }
+
+    if (interval > 0 && now >= next_report && live > 0) {
+      meter_report(commands, commands_amount, links, start, now);
+      next_report += interval;
+    }
+  }
+
+  meter_report(commands, commands_amount, links, start, now_seconds());
+  free(fds);
+  signal(SIGCHLD, SIG_DFL);
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+  return reaped;
+}
+
+bool meter_move(meter_link *link, double now) {
+  while (true) {
+    ssize_t n = splice(link->in, NULL, link->out, NULL, METER_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n > 0)
+      link->bytes += n;
+    if (n == METER_CHUNK)
+      continue;
+
+    // after a short move one of the pipes is most likely empty or full, so
+    // no second splice is spent to find out
+    if (n > 0 || (n == -1 && errno == EAGAIN)) {
+      // data left in the pipe from the writer means the reader is behind
+      int used = 0;
+      ioctl(link->in, FIONREAD, &used);
+      if (used > 0 && link->grow) {
+        int size = fcntl(link->out, F_GETPIPE_SZ);
+        int new_size =
+            size > pipe_max_size() / 2 ? pipe_max_size() : 2 * size;
+        if (size != -1 && new_size > size &&
+            fcntl(link->out, F_SETPIPE_SZ, new_size) != -1)
+          continue;
+        link->grow = false;
+      }
+      meter_wait(link, used > 0, now);
+      return false;
+    }
+
+    // the writer is done or the reader is gone
+    if (n == -1 && errno != EPIPE)
+      perror("splice");
+    meter_wait(link, link->wait_out, now);
+    link->end = now;
+    close(link->in);
+    close(link->out);
+    link->in = -1;
+    link->out = -1;
+    return true;
+  }
+}
+
+void meter_wait(meter_link *link, bool wait_out, double now) {
+  link->waited[link->wait_out] += now - link->since;
+  link->since = now;
+  link->wait_out = wait_out;
+}
+
+void meter_report(stage *commands, int commands_amount, meter_link *links,
+                  double start, double now) {
+  fprintf(stderr, "mexec: meter after %.2f s\n", now - start);
+  fprintf(stderr, "%-30s %14s %10s %9s %11s\n", "link", "bytes", "MB/s",
+          "upstream", "downstream");
+
+  for (int i = 0; i < commands_amount - 1; i++) {
+    meter_link *link = &links[i];
+    double end = link->end > 0 ? link->end : now;
+    double elapsed = end - start > 0 ? end - start : 1e-9;
+
+    // the side a running link waits for now has waited since its switch
+    double waited[2] = {link->waited[0], link->waited[1]};
+    if (link->end == 0)
+      waited[link->wait_out] += now - link->since;
+
+    char name[31];
+    snprintf(name, sizeof(name), "%d %s -> %d %s", i + 1,
+             commands[i].args[0], i + 2, commands[i + 1].args[0]);
+    fprintf(stderr, "%-30s %14lld %10.1f %8.1f%% %10.1f%%\n", name,
+            link->bytes, link->bytes / elapsed / 1e6,
+            100 * waited[0] / elapsed, 100 * waited[1] / elapsed);
+  }
+}
+
+double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void ignore_signal(int sig) { (void)sig; }
+
+int reap_child(stage *commands, int commands_amount, int flags) {
   int status;
-  // waits for all children
+  struct rusage usage;
+  pid_t pid;
+
+  do {
+    pid = wait4(-1, &status, flags, &usage);
+  } while (pid == -1 && errno == EINTR);
+
+  // without waiting, no children left is the same as none exited yet
+  if (pid == -1 && errno == ECHILD && (flags & WNOHANG))
+    return -1;
+  if (pid == -1) {
+    perror("wait4");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0)
+    return -1;
+
   for (int i = 0; i < commands_amount; i++) {
-    if (wait(&status) == -1) {
-      perror("wait");
-      exit(EXIT_FAILURE);
+    if (commands[i].pid == pid) {
+      commands[i].end = now_seconds();
+      commands[i].status = status;
+      commands[i].usage = usage;
+      return i;
     }
-    // checks exitcodes for all children
-    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+  }
+
+  fprintf(stderr, "mexec: unknown child %d\n", (int)pid);
+  exit(EXIT_FAILURE);
+}
+
+void wait_for_children(stage *commands, int commands_amount, int children) {
+  // waits for all children, their exit status is checked once all are done
+  for (int i = 0; i < children; i++) {
+    reap_child(commands, commands_amount, 0);
+  }
+}
+
+void watch_pipes(stage *commands, int commands_amount, int **pipes,
+                 int children) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+
+  struct timespec interval = {.tv_sec = 0,
+                              .tv_nsec = PIPE_CHECK_MS * 1000000L};
+
+  while (children > 0) {
+    int i;
+    while (children > 0 &&
+           (i = reap_child(commands, commands_amount, WNOHANG)) != -1) {
+      children--;
+
+      // once the reader is gone the writer must see the pipe close
+      if (i > 0 && pipes[i - 1][0] != -1) {
+        close(pipes[i - 1][0]);
+        pipes[i - 1][0] = -1;
+      }
+    }
+    if (children == 0)
+      break;
+
+    grow_pipes(commands_amount, pipes);
+
+    // sleeps until a child exits or it is time to check the pipes again
+    if (sigtimedwait(&set, NULL, &interval) == -1 && errno != EAGAIN &&
+        errno != EINTR) {
+      perror("sigtimedwait");
       exit(EXIT_FAILURE);
     }
   }
 }
 
-void cleanup(FILE *file, char ***commands, int commands_amount, int **pipes) {
+void grow_pipes(int commands_amount, int **pipes) {
+  for (int i = 0; i < commands_amount - 1; i++) {
+    if (pipes[i][0] == -1)
+      continue;
+
+    int used;
+    int size = fcntl(pipes[i][0], F_GETPIPE_SZ);
+    if (size == -1 || ioctl(pipes[i][0], FIONREAD, &used) == -1)
+      continue;
+    if (used < size - size / 4)
+      continue;
+
+    // a pipe that can not grow any more is no longer watched
+    int new_size = size > pipe_max_size() / 2 ? pipe_max_size() : 2 * size;
+    if (new_size <= size ||
+        fcntl(pipes[i][0], F_SETPIPE_SZ, new_size) == -1 ||
+        new_size == pipe_max_size()) {
+      close(pipes[i][0]);
+      pipes[i][0] = -1;
+    }
+  }
+}
+
+bool failed(const stage *command) {
+  return command->pid == -1 || !WIFEXITED(command->status) ||
+         WEXITSTATUS(command->status) != 0;
+}
+
+void rusage_report(stage *commands, int commands_amount, enum report format) {
+  if (format == REPORT_TABLE) {
+    fprintf(stderr, "%-5s %-16s %8s %9s %9s %9s %11s %8s %8s\n", "stage",
+            "command", "status", "wall(s)", "user(s)", "sys(s)",
+            "maxrss(KB)", "vcsw", "ivcsw");
+  } else {
+    fprintf(stderr, "{\"stages\": [");
+  }
+
+  for (int i = 0; i < commands_amount; i++) {
+    stage *c = &commands[i];
+    struct rusage *ru = &c->usage;
+    double wall = c->pid != -1 ? c->end - c->start : 0;
+    double user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    double sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+
+    // exit code, signal number or not started
+    char status[16];
+    if (c->pid == -1) {
+      snprintf(status, sizeof(status), "-");
+    } else if (WIFSIGNALED(c->status)) {
+      snprintf(status, sizeof(status), "sig %d", WTERMSIG(c->status));
+    } else {
+      snprintf(status, sizeof(status), "%d", WEXITSTATUS(c->status));
+    }
+
+    if (format == REPORT_TABLE) {
+      fprintf(stderr, "%-5d %-16.16s %8s %9.3f %9.3f %9.3f %11ld %8ld %8ld\n",
+              i + 1, c->args[0], status, wall, user, sys, ru->ru_maxrss,
+              ru->ru_nvcsw, ru->ru_nivcsw);
+      continue;
+    }
+
+    fprintf(stderr, "%s\n  {\"stage\": %d, \"command\": [", i ? "," : "",
+            i + 1);
+    for (int j = 0; c->args[j] != NULL; j++) {
+      fprintf(stderr, j ? ", " : "");
+      json_string(stderr, c->args[j]);
+    }
+    fprintf(stderr, "], \"pid\": %d, \"started\": %s", (int)c->pid,
+            c->pid != -1 ? "true" : "false");
+    if (c->pid != -1 && WIFSIGNALED(c->status)) {
+      fprintf(stderr, ", \"signal\": %d", WTERMSIG(c->status));
+    } else if (c->pid != -1) {
+      fprintf(stderr, ", \"exit\": %d", WEXITSTATUS(c->status));
+    }
+    fprintf(stderr,
+            ", \"wall_s\": %.6f, \"user_s\": %.6f, \"sys_s\": %.6f, "
+            "\"max_rss_kb\": %ld, \"voluntary_cs\": %ld, "
+            "\"involuntary_cs\": %ld}",
+            wall, user, sys, ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+  }
+
+  if (format == REPORT_JSON)
+    fprintf(stderr, "\n]}\n");
+}
+
+void json_string(FILE *fp, const char *str) {
+  fputc('"', fp);
+  for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(fp, "\\%c", *c);
+    } else if (*c < 0x20) {
+      fprintf(fp, "\\u%04x", *c);
+    } else {
+      fputc(*c, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+void cleanup(FILE *file, stage *commands, int commands_amount, int **pipes) {
   // CLOSES AND CLEANUPS EVERYTHING
 
   if (file != stdin) {
     fclose(file);
   }
   for (int i = 0; i < commands_amount; i++) {
-    free_args(commands[i]);
+    free_args(commands[i].args);
   }
   free(commands);
 
@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#include "parallel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wait.h>
+
+// How often processes that closed their output are checked for their exit,
+// in milliseconds
+#define EXIT_CHECK_MS 10
+
+extern char **environ;
+
+// A process of the command working on one chunk
+struct job {
+  bool used;
+  bool done;     // Exited and reaped, its output complete
+  pid_t pid;
+  size_t index;  // Number of the chunk
+  int in;        // Write end of its stdin, -1 once the chunk is written
+  int out;       // Read end of its stdout, -1 at its end
+  char *chunk;
+  size_t chunk_len;
+  size_t written;
+  char *buf; // Its output
+  size_t len;
+  size_t cap;
+  int status;
+};
+
+struct parallel {
+  char **args;
+  int replicas;
+  bool ordered;
+  bool grep;        // 1 is a result rather than a failure
+  struct job *jobs; // Window of slots, chunk i in slot i % window if ordered
+  int window;
+  int running;
+  size_t next_index; // Number of the next chunk to start
+  size_t next_emit;  // Number of the next chunk to write, if ordered
+  char *input;       // Input read but not yet cut into a chunk
+  size_t input_len;
+  size_t input_cap;
+  bool input_end;
+  int status;      // First failed status or 128 + signal, 0 if none
+  bool succeeded;  // A process exited with 0
+  bool no_result;  // A process exited with 1
+  posix_spawnattr_t attr;
+};
+
+static struct job *free_slot(struct parallel *p);
+static bool take_chunk(struct parallel *p, char **chunk, size_t *len);
+static int read_input(struct parallel *p);
+static void start_job(struct parallel *p, struct job *job, char *chunk,
+                      size_t len);
+static void feed_job(struct job *job);
+static int drain_job(struct job *job);
+static void reap_job(struct parallel *p, struct job *job, int flags);
+static void emit_jobs(struct parallel *p);
+static void emit_job(struct job *job);
+static void write_all(const char *buf, size_t len);
+static void fail(const char *what);
+
+int parallel_run(char **args, int replicas, bool ordered, bool grep) {
+  struct parallel p = {
+      .args = args,
+      .replicas = replicas,
+      .ordered = ordered,
+      .grep = grep,
+      .window = 2 * replicas,
+  };
+
+  p.jobs = calloc(p.window, sizeof *p.jobs);
+  struct pollfd *fds = malloc((1 + 2 * p.window) * sizeof *fds);
+  if (!p.jobs || !fds) {
+    fail("malloc");
+  }
+  for (int i = 0; i < p.window; i++) {
+    p.jobs[i] = (struct job){.in = -1, .out = -1};
+  }
+
+  // A process that stops reading shows as EPIPE here, the processes of the
+  // command get SIGPIPE back
+  signal(SIGPIPE, SIG_IGN);
+  sigset_t pipe_set;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  posix_spawnattr_init(&p.attr);
+  posix_spawnattr_setsigdefault(&p.attr, &pipe_set);
+  posix_spawnattr_setflags(&p.attr, POSIX_SPAWN_SETSIGDEF);
+
+  while (true) {
+    struct job *slot;
+    char *chunk;
+    size_t len;
+    while (p.running < p.replicas && (slot = free_slot(&p)) &&
+           take_chunk(&p, &chunk, &len)) {
+      start_job(&p, slot, chunk, len);
+    }
+    // Empty input still runs the command once, for its output and status
+    if (p.input_end && p.next_index == 0) {
+      start_job(&p, &p.jobs[0], NULL, 0);
+    }
+
+    bool busy = false;
+    for (int i = 0; i < p.window; i++) {
+      busy = busy || p.jobs[i].used;
+    }
+    if (!busy && p.input_end && p.input_len == 0) {
+      break;
+    }
+
+    // Input is only read while there is a process free to take it
+    nfds_t n = 0;
+    bool reading = !p.input_end && p.running < p.replicas && free_slot(&p);
+    if (reading) {
+      fds[n++] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+    }
+    int timeout = -1;
+    for (int i = 0; i < p.window; i++) {
+      struct job *job = &p.jobs[i];
+      if (job->in != -1) {
+        fds[n++] = (struct pollfd){.fd = job->in, .events = POLLOUT};
+      }
+      if (job->out != -1) {
+        fds[n++] = (struct pollfd){.fd = job->out, .events = POLLIN};
+      }
+      if (job->used && !job->done && job->out == -1) {
+        timeout = EXIT_CHECK_MS;
+      }
+    }
+
+    if (poll(fds, n, timeout) == -1 && errno != EINTR) {
+      fail("poll");
+    }
+
+    if (reading && fds[0].revents != 0 && read_input(&p) != 0) {
+      fail("read");
+    }
+    for (int i = 0; i < p.window; i++) {
+      struct job *job = &p.jobs[i];
+      if (!job->used || job->done) {
+        continue;
+      }
+      if (job->in != -1) {
+        feed_job(job);
+      }
+      if (job->out != -1 && drain_job(job) != 0) {
+        fail("read");
+      }
+      if (job->out == -1) {
+        reap_job(&p, job, WNOHANG);
+      }
+    }
+
+    emit_jobs(&p);
+  }
+
+  posix_spawnattr_destroy(&p.attr);
+  free(p.input);
+  free(p.jobs);
+  free(fds);
+
+  // With grep, 1 only stands when no chunk gave 0
+  if (p.status != 0) {
+    return p.status;
+  }
+  return p.no_result && !p.succeeded ? 1 : 0;
+}
+
+/*
+ * free_slot - Finds the slot for the next chunk
+ *
+ * @param p     The parallel stage
+ *
+ * @return The slot, NULL if it is still in use
+ * */
+static struct job *free_slot(struct parallel *p) {
+  if (p->ordered) {
+    struct job *job = &p->jobs[p->next_index % p->window];
+    return job->used ? NULL : job;
+  }
+
+  for (int i = 0; i < p->window; i++) {
+    if (!p->jobs[i].used) {
+      return &p->jobs[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * take_chunk - Cuts the next chunk from the input read so far. A chunk is
+ * at least PARALLEL_CHUNK bytes and ends at a newline, only the last one
+ * may be shorter or end without one.
+ *
+ * @param p       The parallel stage
+ * @param chunk   Filled with the chunk, to be freed by the caller
+ * @param len     Filled with its length
+ *
+ * @return true if there was a chunk, false if more input is needed
+ * */
+static bool take_chunk(struct parallel *p, char **chunk, size_t *len) {
+  if (p->input_len == 0) {
+    return false;
+  }
+
+  size_t cut = p->input_len;
+  if (!p->input_end) {
+    if (p->input_len < PARALLEL_CHUNK) {
+      return false;
+    }
+    char *nl = memrchr(p->input, '\n', p->input_len);
+    if (!nl) {
+      return false;
+    }
+    cut = nl - p->input + 1;
+  }
+
+  // The chunk keeps the buffer, only the partial line after it is copied
+  char *rest = NULL;
+  size_t rest_cap = 0;
+  if (p->input_len > cut || !p->input_end) {
+    rest_cap = PARALLEL_CHUNK;
+    while (rest_cap < p->input_len - cut) {
+      rest_cap *= 2;
+    }
+    if (!(rest = malloc(rest_cap))) {
+      fail("malloc");
+    }
+    memcpy(rest, p->input + cut, p->input_len - cut);
+  }
+
+  *chunk = p->input;
+  *len = cut;
+  p->input_len -= cut;
+  p->input = rest;
+  p->input_cap = rest_cap;
+  return true;
+}
+
+/*
+ * read_input - Reads what is ready on stdin, growing the buffer when a
+ * line does not fit
+ *
+ * @param p     The parallel stage
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+static int read_input(struct parallel *p) {
+  if (p->input_len == p->input_cap) {
+    size_t cap = p->input_cap ? 2 * p->input_cap : PARALLEL_CHUNK;
+    char *input = realloc(p->input, cap);
+    if (!input) {
+      return -1;
+    }
+    p->input = input;
+    p->input_cap = cap;
+  }
+
+  ssize_t n =
+      read(STDIN_FILENO, p->input + p->input_len, p->input_cap - p->input_len);
+  if (n == -1) {
+    return errno == EINTR || errno == EAGAIN ? 0 : -1;
+  }
+  if (n == 0) {
+    p->input_end = true;
+  }
+  p->input_len += n;
+  return 0;
+}
+
+/*
+ * start_job - Starts a process of the command on a chunk
+ *
+ * @param p       The parallel stage
+ * @param job     A free slot
+ * @param chunk   The chunk, owned by the job from now on
+ * @param len     Length of the chunk
+ * */
+static void start_job(struct parallel *p, struct job *job, char *chunk,
+                      size_t len) {
+  *job = (struct job){
+      .used = true,
+      .index = p->next_index++,
+      .in = -1,
+      .out = -1,
+      .chunk = chunk,
+      .chunk_len = len,
+  };
+
+  int in[2];
+  int out[2];
+  if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1) {
+    fail("pipe2");
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+  int err = posix_spawnp(&job->pid, p->args[0], &actions, &p->attr, p->args,
+                         environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(in[0]);
+  close(out[1]);
+
+  // A command that can not be started will not start for the next chunk
+  // either, the processes already running see their pipes close
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", p->args[0], strerror(err));
+    _exit(EXIT_FAILURE);
+  }
+
+  // Only mexec's ends are non-blocking, the process reads and writes as
+  // usual
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  fcntl(out[0], F_SETFL, O_NONBLOCK);
+  job->in = in[1];
+  job->out = out[0];
+  p->running++;
+}
+
+/*
+ * feed_job - Writes as much of the chunk as the process takes without
+ * waiting, and closes its stdin at the end of the chunk
+ *
+ * @param job   The job
+ * */
+static void feed_job(struct job *job) {
+  while (job->written < job->chunk_len) {
+    ssize_t n = write(job->in, job->chunk + job->written,
+                      job->chunk_len - job->written);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      return;
+    }
+    // A process that stops reading gets no more of its chunk
+    if (n == -1) {
+      break;
+    }
+    job->written += n;
+  }
+
+  close(job->in);
+  job->in = -1;
+  free(job->chunk);
+  job->chunk = NULL;
+}
+
+/*
+ * drain_job - Reads the output of a process that is ready, closing its
+ * stdout at the end
+ *
+ * @param job   The job
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+static int drain_job(struct job *job) {
+  while (true) {
+    if (job->len == job->cap) {
+      size_t cap = job->cap ? 2 * job->cap : 65536;
+      char *buf = realloc(job->buf, cap);
+      if (!buf) {
+        return -1;
+      }
+      job->buf = buf;
+      job->cap = cap;
+    }
+
+    ssize_t n = read(job->out, job->buf + job->len, job->cap - job->len);
+    if (n > 0) {
+      job->len += n;
+    } else if (n == 0) {
+      close(job->out);
+      job->out = -1;
+      return 0;
+    } else if (errno == EAGAIN) {
+      return 0;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+/*
+ * reap_job - Reaps the process of a job once it has exited and adds its
+ * status to those of the stage
+ *
+ * @param p       The parallel stage
+ * @param job     The job, its output at its end
+ * @param flags   0 to wait, WNOHANG to not wait
+ * */
+static void reap_job(struct parallel *p, struct job *job, int flags) {
+  pid_t pid;
+  do {
+    pid = waitpid(job->pid, &job->status, flags);
+  } while (pid == -1 && errno == EINTR);
+
+  if (pid == -1) {
+    fail("waitpid");
+  }
+  if (pid == 0) {
+    return;
+  }
+
+  // The rest of a chunk a process did not read is dropped
+  if (job->in != -1) {
+    close(job->in);
+    job->in = -1;
+    free(job->chunk);
+    job->chunk = NULL;
+  }
+  job->done = true;
+  p->running--;
+
+  if (WIFSIGNALED(job->status)) {
+    p->status = p->status ? p->status : 128 + WTERMSIG(job->status);
+  } else if (WEXITSTATUS(job->status) > (p->grep ? 1 : 0)) {
+    p->status = p->status ? p->status : WEXITSTATUS(job->status);
+  } else if (WEXITSTATUS(job->status) == 1) {
+    p->no_result = true;
+  } else {
+    p->succeeded = true;
+  }
+}
+
+/*
+ * emit_jobs - Writes the output of the jobs that are done and frees their
+ * slots. Ordered, a job waits for all chunks before its own.
+ *
+ * @param p     The parallel stage
+ * */
+static void emit_jobs(struct parallel *p) {
+  if (!p->ordered) {
+    for (int i = 0; i < p->window; i++) {
+      if (p->jobs[i].used && p->jobs[i].done) {
+        emit_job(&p->jobs[i]);
+      }
+    }
+    return;
+  }
+
+  while (true) {
+    struct job *job = &p->jobs[p->next_emit % p->window];
+    if (!job->used || !job->done || job->index != p->next_emit) {
+      return;
+    }
+    emit_job(job);
+    p->next_emit++;
+  }
+}
+
+/*
+ * emit_job - Writes the output of a job and frees its slot
+ *
+ * @param job   The job, done
+ * */
+static void emit_job(struct job *job) {
+  write_all(job->buf, job->len);
+  free(job->buf);
+  *job = (struct job){.in = -1, .out = -1};
+}
+
+/*
+ * write_all - Writes a buffer to stdout. A reader that is gone ends the
+ * stage with SIGPIPE, as it would a command writing there itself.
+ *
+ * @param buf   The buffer
+ * @param len   Its length
+ * */
+static void write_all(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDOUT_FILENO, buf, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EPIPE) {
+      signal(SIGPIPE, SIG_DFL);
+      raise(SIGPIPE);
+    }
+    if (n == -1) {
+      fail("write");
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/*
+ * fail - Reports a failed call and ends the stage
+ *
+ * @param what  The call
+ * */
+static void fail(const char *what) {
+  perror(what);
+  _exit(EXIT_FAILURE);
+}
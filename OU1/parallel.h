@@ -0,0 +1,37 @@
+/**
+ * Replicated stages of mexec, for the @parallel annotation. The input of
+ * the stage is cut into chunks that end at a newline, each chunk is given
+ * to a new process of the command, and at most a given number of them run
+ * at once. Their outputs are written whole, in the order of the chunks or
+ * in the order they are done.
+ *
+ * @file parallel.h
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdbool.h>
+
+// Bytes of input a chunk is cut from, back to its last newline
+#define PARALLEL_CHUNK (1 << 20)
+
+/*
+ * parallel_run - Runs a command over its stdin in chunks and writes the
+ * outputs to stdout. Meant to run as the process of the stage.
+ *
+ * @param args      The command and its arguments
+ * @param replicas  Most processes of the command that run at once
+ * @param ordered   true to write the outputs in the order of the chunks
+ * @param grep      true to combine the statuses the way grep ends on its
+ *                  whole input
+ *
+ * @return Exit status of the stage. The status of the first process that
+ * did not exit with 0, or 128 + its signal if it was killed. With grep, a
+ * status of 1 does not count as a failure: the stage then ends with 0 if
+ * any process exited with 0 and with 1 if all exited with 1. Empty input
+ * is given to one process.
+ * */
+int parallel_run(char **args, int replicas, bool ordered, bool grep);
+
+#endif
@@ -0,0 +1,71 @@
+#!/bin/bash
+# Tests of @parallel. Each case runs a pipeline with a replicated stage and
+# checks its output and exit status against the same pipeline without the
+# annotation.
+#
+# Usage: tests/parallel.sh [MEXEC]
+
+MEXEC=$(realpath "${1:-./mexec}")
+FAILED=0
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Several chunks, only one of them holds the line 42
+seq 1 3000000 >"$DIR/nums"
+
+# check NAME ANNOTATION COMMAND - Runs cat of the numbers into COMMAND into
+# wc -l, with and without ANNOTATION on COMMAND, and compares the results
+check() {
+    local name=$1 plain replicated plain_status replicated_status
+    printf 'cat %s\n%s\nwc -l\n' "$DIR/nums" "$3" >"$DIR/plain"
+    printf 'cat %s\n%s %s\nwc -l\n' "$DIR/nums" "$2" "$3" >"$DIR/replicated"
+    plain=$("$MEXEC" "$DIR/plain" 2>/dev/null)
+    plain_status=$?
+    replicated=$("$MEXEC" "$DIR/replicated" 2>/dev/null)
+    replicated_status=$?
+
+    if [ "$plain" != "$replicated" ] ||
+        [ "$plain_status" != "$replicated_status" ]; then
+        echo "FAIL $name: got '$replicated' status $replicated_status," \
+            "expected '$plain' status $plain_status"
+        FAILED=1
+    else
+        echo "ok   $name"
+    fi
+}
+
+check "match in one chunk" "@parallel 4 @status grep" "grep -x 42"
+check "match in no chunk" "@parallel 4 @status grep" "grep -x nomatch"
+check "error in every chunk" "@parallel 4 @status grep" "grep -E ("
+check "unordered" "@parallel 3 @unordered @status grep" "grep 7"
+check "ordered output" "@parallel 4" "cat"
+
+# Without @status grep, 1 from the process of one chunk fails the stage
+printf 'cat %s\n@parallel 4 awk /^42$/{exit(1)}{print}\n' "$DIR/nums" \
+    >"$DIR/fail"
+"$MEXEC" "$DIR/fail" >/dev/null
+if [ $? != 1 ]; then
+    echo "FAIL failure in one chunk: expected status 1"
+    FAILED=1
+else
+    echo "ok   failure in one chunk"
+fi
+printf 'cat %s\n@parallel 4 cat\n' "$DIR/nums" >"$DIR/order"
+if ! "$MEXEC" "$DIR/order" | cmp -s - "$DIR/nums"; then
+    echo "FAIL chunk order"
+    FAILED=1
+else
+    echo "ok   chunk order"
+fi
+
+printf 'true\n@parallel 4 @status grep grep x\n' >"$DIR/empty"
+"$MEXEC" "$DIR/empty"
+if [ $? != 1 ]; then
+    echo "FAIL empty input: expected status 1 like grep"
+    FAILED=1
+else
+    echo "ok   empty input"
+fi
+
+exit $FAILED
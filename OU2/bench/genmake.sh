@@ -0,0 +1,88 @@
+#!/bin/bash
+# Generates a synthetic mmakefile of a given shape, with its source files
+# and up-to-date targets, for benchmarks.
+#
+# Usage: bench/genmake.sh SHAPE N DIR
+#
+# Shapes, where sN are source files and every other name is a target whose
+# recipe touches it:
+#   chain    all -> t0 -> t1 -> ... -> t(N-1) -> s0
+#   fanin    all depends on the N sources s0 ... s(N-1) on one line
+#   diamond  N levels of two targets that both depend on both targets of the
+#            next level, the last level on s0
+#   tree     t0 ... t(N-1) where ti depends on t(4i+1) ... t(4i+4), the
+#            last one on s0
+#   flat     all depends on t0 ... t(N-1), each with its own source
+#
+# Sources are dated 2020-01-01 and targets 2020-01-02, so a build right
+# after generating has nothing to do. s0 is always the source deepest in
+# the graph, the one to touch for a rebuild.
+
+SHAPE=$1
+N=$2
+DIR=$3
+
+if [ -z "$SHAPE" ] || [ -z "$N" ] || [ -z "$DIR" ]; then
+    echo "Usage: $0 SHAPE N DIR" >&2
+    exit 1
+fi
+
+mkdir -p "$DIR" || exit 1
+
+awk -v shape="$SHAPE" -v n="$N" -v dir="$DIR" '
+function rule(target, prereqs) {
+    printf "%s: %s\n\ttouch %s\n", target, prereqs, target
+    print target > targets
+}
+BEGIN {
+    targets = dir "/.targets"
+    sources = dir "/.sources"
+    if (shape == "chain") {
+        rule("all", "t0")
+        for (i = 0; i < n; i++)
+            rule("t" i, i + 1 < n ? "t" (i + 1) : "s0")
+        print "s0" > sources
+    } else if (shape == "fanin") {
+        printf "all:"
+        for (i = 0; i < n; i++) {
+            printf " s%d", i
+            print "s" i > sources
+        }
+        printf "\n\ttouch all\n"
+        print "all" > targets
+    } else if (shape == "diamond") {
+        rule("all", "a0 b0")
+        for (i = 0; i < n; i++) {
+            p = i + 1 < n ? "a" (i + 1) " b" (i + 1) : "s0"
+            rule("a" i, p)
+            rule("b" i, p)
+        }
+        print "s0" > sources
+    } else if (shape == "tree") {
+        for (i = 0; i < n; i++) {
+            p = i == n - 1 ? "s0" : ""
+            for (c = 4 * i + 1; c <= 4 * i + 4 && c < n; c++)
+                p = p (p == "" ? "" : " ") "t" c
+            rule("t" i, p)
+        }
+        print "s0" > sources
+    } else if (shape == "flat") {
+        printf "all:"
+        for (i = 0; i < n; i++)
+            printf " t%d", i
+        printf "\n\ttouch all\n"
+        print "all" > targets
+        for (i = 0; i < n; i++) {
+            rule("t" i, "s" i)
+            print "s" i > sources
+        }
+    } else {
+        print "Unknown shape " shape > "/dev/stderr"
+        exit 1
+    }
+}' > "$DIR/mmakefile" || exit 1
+
+cd "$DIR" || exit 1
+xargs touch -d "2020-01-01 00:00:00" < .sources
+xargs touch -d "2020-01-02 00:00:00" < .targets
+rm -f .sources .targets
@@ -0,0 +1,267 @@
+/**
+ * Benchmark of the dependency graph against the parsed rules it is built
+ * from. For generated makefiles of several sizes it reports the heap memory
+ * the graph takes per node, the time to build it, and the time of three
+ * walks as the median of several runs:
+ *   Rule walk      every prerequisite of every target looked up by name in
+ *                  the parsed makefile, as a recursive build does
+ *   Graph walk     the same over the graph's prerequisite edges
+ *   Schedule pass  a topological pass over the dependents, as the scheduler
+ *                  makes with unlimited job slots
+ *
+ * Usage: graph_bench [RUNS]
+ *
+ * @file graph_bench.c
+ */
+
+#include "graph.h"
+#include "parser.h"
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Headers each target includes, out of a shared set of HEADERS
+#define TARGET_HEADERS 6
+#define HEADERS 1000
+
+static makefile *make_graph(long n_targets);
+static double walk_rules(makefile *mf, const graph *g, size_t *found);
+static double walk_graph(const graph *g, size_t *found);
+static double schedule_pass(const graph *g, size_t *done);
+static size_t heap_used(void);
+static double median(double *times, int runs);
+static int cmp_double(const void *a, const void *b);
+static double now(void);
+
+int main(int argc, char *argv[]) {
+  long sizes[] = {10000, 100000, 500000};
+  int runs = argc > 1 ? atoi(argv[1]) : 5;
+  const char *goal = "t0";
+
+  if (runs <= 0) {
+    fprintf(stderr, "Usage: %s [RUNS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  double *times[4];
+  for (int t = 0; t < 4; t++) {
+    if (!(times[t] = malloc(runs * sizeof *times[t]))) {
+      perror("malloc");
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf("Nodes | Edges | Bytes/node | Build (ms) | Rule walk (ms) | "
+         "Graph walk (ms) | Schedule pass (ms)\n");
+  for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+    makefile *mf = make_graph(sizes[i]);
+    if (!mf) {
+      fprintf(stderr, "Could not parse a makefile of %ld targets\n",
+              sizes[i]);
+      return EXIT_FAILURE;
+    }
+
+    // Only the last graph is kept for the walks and the memory count
+    graph *g = NULL;
+    size_t heap = 0;
+    for (int r = 0; r < runs; r++) {
+      graph_del(g);
+      size_t before = heap_used();
+      double start = now();
+      g = graph_new(mf, &goal, 1);
+      times[0][r] = now() - start;
+      if (!g) {
+        return EXIT_FAILURE;
+      }
+      heap = heap_used() - before;
+    }
+
+    size_t found[3];
+    for (int r = 0; r < runs; r++) {
+      times[1][r] = walk_rules(mf, g, &found[0]);
+      times[2][r] = walk_graph(g, &found[1]);
+      times[3][r] = schedule_pass(g, &found[2]);
+    }
+    if (found[0] != found[1] || found[2] != g->n) {
+      fprintf(stderr, "Walks disagree\n");
+      return EXIT_FAILURE;
+    }
+
+    printf("%zu | %u | %.1f | %.2f | %.2f | %.2f | %.2f\n", g->n,
+           g->prereq_off[g->n], (double)heap / g->n,
+           median(times[0], runs) * 1e3, median(times[1], runs) * 1e3,
+           median(times[2], runs) * 1e3, median(times[3], runs) * 1e3);
+
+    graph_del(g);
+    makefile_del(mf);
+  }
+
+  for (int t = 0; t < 4; t++) {
+    free(times[t]);
+  }
+  return EXIT_SUCCESS;
+}
+
+/*
+ * make_graph - Parses a generated makefile where target i depends on
+ * targets 2i + 1 and 2i + 2 and on headers shared between targets
+ *
+ * @param n_targets     Number of targets
+ *
+ * @return The parsed makefile, NULL on failure
+ * */
+static makefile *make_graph(long n_targets) {
+  char *text;
+  size_t len;
+  FILE *fp = open_memstream(&text, &len);
+  if (!fp) {
+    return NULL;
+  }
+
+  for (long i = 0; i < n_targets; i++) {
+    fprintf(fp, "t%ld :", i);
+    for (long c = 2 * i + 1; c <= 2 * i + 2 && c < n_targets; c++) {
+      fprintf(fp, " t%ld", c);
+    }
+    for (long h = 0; h < TARGET_HEADERS; h++) {
+      fprintf(fp, " include/h%ld.h", (i * 7919 + h * 104729) % HEADERS);
+    }
+    fprintf(fp, "\n\tcc -c t%ld.c\n\n", i);
+  }
+  for (long h = 0; h < HEADERS; h++) {
+    fprintf(fp, "include/h%ld.h :\n\ttouch include/h%ld.h\n\n", h, h);
+  }
+  fclose(fp);
+
+  fp = fmemopen(text, len, "r");
+  makefile *mf = fp ? parse_makefile(fp) : NULL;
+  if (fp) {
+    fclose(fp);
+  }
+  free(text);
+
+  return mf;
+}
+
+/*
+ * walk_rules - Looks up the rule of every prerequisite by name
+ *
+ * @param mf        The makefile
+ * @param g         Graph of the makefile, for the list of targets
+ * @param found     Filled with the number of prerequisites that have a rule
+ *
+ * @return Time taken in seconds
+ * */
+static double walk_rules(makefile *mf, const graph *g, size_t *found) {
+  double start = now();
+  size_t n = 0;
+
+  for (size_t i = 0; i < g->n; i++) {
+    rule *rule = makefile_rule(mf, g->names[i]);
+    if (!rule) {
+      continue;
+    }
+    for (const char **p = rule_prereq(rule); *p; p++) {
+      n += makefile_rule(mf, *p) != NULL;
+    }
+  }
+
+  *found = n;
+  return now() - start;
+}
+
+/*
+ * walk_graph - Checks every prerequisite edge for a rule
+ *
+ * @param g         The graph
+ * @param found     Filled with the number of prerequisites that have a rule
+ *
+ * @return Time taken in seconds
+ * */
+static double walk_graph(const graph *g, size_t *found) {
+  double start = now();
+  size_t n = 0;
+
+  for (size_t i = 0; i < g->n; i++) {
+    if (!g->rules[i]) {
+      continue;
+    }
+    for (size_t e = g->prereq_off[i]; e < g->prereq_off[i + 1]; e++) {
+      n += g->rules[g->prereq[e]] != NULL;
+    }
+  }
+
+  *found = n;
+  return now() - start;
+}
+
+/*
+ * schedule_pass - Finishes every node once its prerequisites are finished
+ *
+ * @param g     The graph
+ * @param done  Filled with the number of nodes finished
+ *
+ * @return Time taken in seconds, including the allocation of the counters
+ * */
+static double schedule_pass(const graph *g, size_t *done) {
+  double start = now();
+  size_t *pending = malloc(g->n * sizeof *pending);
+  size_t *ready = malloc(g->n * sizeof *ready);
+  size_t n_ready = 0;
+  size_t n = 0;
+
+  if (!pending || !ready) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < g->n; i++) {
+    pending[i] = graph_n_prereq(g, i);
+    if (pending[i] == 0) {
+      ready[n_ready++] = i;
+    }
+  }
+  while (n_ready > 0) {
+    size_t i = ready[--n_ready];
+    n++;
+    for (size_t e = g->dependent_off[i]; e < g->dependent_off[i + 1]; e++) {
+      if (--pending[g->dependents[e]] == 0) {
+        ready[n_ready++] = g->dependents[e];
+      }
+    }
+  }
+
+  free(pending);
+  free(ready);
+  *done = n;
+  return now() - start;
+}
+
+/*
+ * heap_used - Gets the bytes allocated with malloc, large blocks that are
+ * mapped separately included
+ *
+ * @return Bytes in use
+ * */
+static size_t heap_used(void) {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+}
+
+static double median(double *times, int runs) {
+  qsort(times, runs, sizeof *times, cmp_double);
+  return runs % 2 ? times[runs / 2]
+                  : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
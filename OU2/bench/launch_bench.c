@@ -0,0 +1,113 @@
+/**
+ * Microbenchmark of recipe launch latency against the size of the rule
+ * graph held in memory. Each size is measured with fork/execvp, which is how
+ * mmake used to start recipes, and with launch_cmd.
+ *
+ * Usage: launch_bench [RUNS]
+ *
+ * @file launch_bench.c
+ */
+
+#include "parser.h"
+#include "launch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static makefile *make_graph(long n_rules);
+static double launch_fork(char **cmd, int runs);
+static double launch_spawn(char **cmd, int runs);
+static double now(void);
+
+int main(int argc, char *argv[]) {
+  long sizes[] = {0, 10000, 100000, 500000};
+  int runs = argc > 1 ? atoi(argv[1]) : 500;
+  char *cmd[] = {"true", NULL};
+
+  if (runs <= 0) {
+    fprintf(stderr, "Usage: %s [RUNS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  printf("Rules | fork+exec (us) | posix_spawn (us)\n");
+  for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+    makefile *mf = make_graph(sizes[i]);
+    if (sizes[i] > 0 && !mf) {
+      fprintf(stderr, "Could not build a graph of %ld rules\n", sizes[i]);
+      return EXIT_FAILURE;
+    }
+
+    double f = launch_fork(cmd, runs);
+    double s = launch_spawn(cmd, runs);
+    printf("%ld | %.1f | %.1f\n", sizes[i], f * 1e6 / runs, s * 1e6 / runs);
+
+    if (mf) {
+      makefile_del(mf);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * make_graph - Parses a generated makefile with a chain of rules
+ *
+ * @param n_rules   Number of rules, 0 gives no graph
+ *
+ * @return The parsed makefile, NULL if n_rules is 0 or on failure
+ * */
+static makefile *make_graph(long n_rules) {
+  if (n_rules == 0) {
+    return NULL;
+  }
+
+  char *text;
+  size_t len;
+  FILE *fp = open_memstream(&text, &len);
+  for (long i = 0; i < n_rules; i++) {
+    fprintf(fp, "target%ld : target%ld source%ld.c\n\tcc -c source%ld.c\n", i,
+            i + 1, i, i);
+  }
+  fclose(fp);
+
+  fp = fmemopen(text, len, "r");
+  makefile *mf = parse_makefile(fp);
+  fclose(fp);
+  free(text);
+
+  return mf;
+}
+
+static double launch_fork(char **cmd, int runs) {
+  double start = now();
+
+  for (int i = 0; i < runs; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      execvp(cmd[0], cmd);
+      _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+  }
+
+  return now() - start;
+}
+
+static double launch_spawn(char **cmd, int runs) {
+  double start = now();
+
+  for (int i = 0; i < runs; i++) {
+    pid_t pid = launch_cmd(cmd, -1);
+    waitpid(pid, NULL, 0);
+  }
+
+  return now() - start;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
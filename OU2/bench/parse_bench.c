@@ -0,0 +1,135 @@
+/**
+ * Benchmark of parse throughput. Generates makefiles of a given size with
+ * short and with very long prerequisite lines and reports how many MB/s
+ * parse_makefile handles, as the median of several runs. The last column is
+ * the time to load the same makefile through its precompiled graph.
+ *
+ * Usage: parse_bench [MB]
+ *
+ * @file parse_bench.c
+ */
+
+#include "parser.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS 5
+
+static long write_makefile(const char *path, long bytes, int prereqs);
+static double parse_time(const char *path, bool cached);
+static int cmp_double(const void *a, const void *b);
+static double now(void);
+
+int main(int argc, char *argv[]) {
+  long mb = argc > 1 ? atol(argv[1]) : 64;
+  int widths[] = {2, 32, 2000};
+  char path[] = "/tmp/parse_bench.XXXXXX";
+  char graph[sizeof path + 5];
+
+  if (mb <= 0) {
+    fprintf(stderr, "Usage: %s [MB]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("mkstemp");
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  snprintf(graph, sizeof graph, "/tmp/.%s.mmc", path + 5);
+
+  printf("Prereqs/rule | Size(MB) | Time(s) | MB/s | Cached(s)\n");
+  for (size_t i = 0; i < sizeof widths / sizeof widths[0]; i++) {
+    long size = write_makefile(path, mb << 20, widths[i]);
+    if (size < 0) {
+      unlink(path);
+      return EXIT_FAILURE;
+    }
+
+    // The first cached run writes the graph file, it is not counted
+    double times[RUNS], cached[RUNS];
+    parse_time(path, true);
+    for (int r = 0; r < RUNS; r++) {
+      times[r] = parse_time(path, false);
+      cached[r] = parse_time(path, true);
+      if (times[r] < 0 || cached[r] < 0) {
+        fprintf(stderr, "Could not parse %s\n", path);
+        unlink(path);
+        return EXIT_FAILURE;
+      }
+    }
+    qsort(times, RUNS, sizeof times[0], cmp_double);
+    qsort(cached, RUNS, sizeof cached[0], cmp_double);
+
+    double t = times[RUNS / 2];
+    printf("%d | %.1f | %.3f | %.1f | %.3f\n", widths[i], size / 1048576.0,
+           t, size / 1048576.0 / t, cached[RUNS / 2]);
+  }
+
+  unlink(path);
+  unlink(graph);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * write_makefile - Writes rules with a fixed number of prerequisites until
+ * the file is at least the requested size
+ *
+ * @param path      Where to write the makefile
+ * @param bytes     Minimum size of the file
+ * @param prereqs   Number of prerequisites of each rule
+ *
+ * @return Size of the file, -1 on failure
+ * */
+static long write_makefile(const char *path, long bytes, int prereqs) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    perror(path);
+    return -1;
+  }
+
+  for (long i = 0; ftell(fp) < bytes; i++) {
+    fprintf(fp, "build/target%ld.o :", i);
+    for (int j = 0; j < prereqs; j++) {
+      fprintf(fp, " src/module%ld/file%d.h", i, j);
+    }
+    fprintf(fp, "\n\tgcc -c -O2 -o build/target%ld.o src/target%ld.c\n\n", i,
+            i);
+  }
+
+  long size = ftell(fp);
+  fclose(fp);
+  return size;
+}
+
+static double parse_time(const char *path, bool cached) {
+  double start = now();
+
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+  makefile *mf = cached ? parse_makefile_cached(fp, path) : parse_makefile(fp);
+  fclose(fp);
+  if (!mf) {
+    return -1;
+  }
+  makefile_del(mf);
+
+  return now() - start;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
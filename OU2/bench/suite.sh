@@ -0,0 +1,94 @@
+#!/bin/bash
+# Benchmark suite of mmake on large synthetic graphs. For each shape made
+# by bench/genmake.sh it measures
+#   parse_s   loading the makefile without a graph cache, which also writes
+#             the cache
+#   load_s    loading the makefile from the graph cache
+#   noop_s    a build with nothing to do
+#   touch_s   a build after touching the deepest source
+# and on a flat graph of SPAWN_RULES rules, whose recipes are all touch
+#   spawn_us    the cost per recipe of a forced rebuild over a no-op build,
+#               with every recipe started as a process
+#   builtin_us  the same with touch run inside mmake
+#
+# Each result is the median of RUNS runs, printed as one JSON object per
+# line so results of two versions can be compared by a script.
+#
+# Usage: bench/suite.sh [MMAKE] [RUNS]
+
+MMAKE=$(realpath "${1:-./mmake}")
+RUNS=${2:-5}
+GEN=$(realpath "$(dirname "$0")/genmake.sh")
+SHAPES="chain:2000 fanin:100000 diamond:500 tree:50000 flat:100000"
+SPAWN_RULES=1000
+
+# Name of a target no makefile has, so a run stops right after loading
+NONE=__bench_none__
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# elapsed CMD... - Runs a command and prints its wall time in seconds
+elapsed() {
+    local start end
+    start=$(date +%s%N)
+    "$@" >/dev/null 2>&1
+    end=$(date +%s%N)
+    awk -v ns=$((end - start)) 'BEGIN { printf "%.6f\n", ns / 1e9 }'
+}
+
+# median - Prints the median of the numbers on stdin
+median() {
+    sort -g | awk '{ v[NR] = $1 }
+        END { printf "%.6f\n", NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# report SHAPE N METRIC VALUE
+report() {
+    printf '{"shape":"%s","n":%s,"metric":"%s","median":%s,"runs":%s}\n' \
+        "$1" "$2" "$3" "$4" "$RUNS"
+}
+
+for entry in $SHAPES; do
+    shape=${entry%%:*}
+    n=${entry##*:}
+    work="$DIR/$shape"
+    "$GEN" "$shape" "$n" "$work" || exit 1
+    cd "$work" || exit 1
+
+    report "$shape" "$n" parse_s "$(for r in $(seq "$RUNS"); do
+        rm -f .mmakefile.mmc
+        elapsed "$MMAKE" -q $NONE
+    done | median)"
+
+    report "$shape" "$n" load_s "$(for r in $(seq "$RUNS"); do
+        elapsed "$MMAKE" -q $NONE
+    done | median)"
+
+    report "$shape" "$n" noop_s "$(for r in $(seq "$RUNS"); do
+        elapsed "$MMAKE" -s
+    done | median)"
+
+    report "$shape" "$n" touch_s "$(for r in $(seq "$RUNS"); do
+        touch s0
+        elapsed "$MMAKE" -s
+    done | median)"
+done
+
+work="$DIR/spawn"
+"$GEN" flat $SPAWN_RULES "$work" || exit 1
+cd "$work" || exit 1
+noop=$(for r in $(seq "$RUNS"); do elapsed "$MMAKE" -s; done | median)
+
+# per_recipe METRIC [OPTION] - Reports the cost per recipe of -B
+per_recipe() {
+    local forced
+    forced=$(for r in $(seq "$RUNS"); do
+        elapsed "$MMAKE" -s -B $2
+    done | median)
+    report flat $SPAWN_RULES "$1" "$(awk -v f="$forced" -v z="$noop" \
+        -v n=$((SPAWN_RULES + 1)) 'BEGIN { printf "%.3f\n", (f - z) * 1e6 / n }')"
+}
+
+per_recipe spawn_us --no-builtins
+per_recipe builtin_us
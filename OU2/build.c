@@ -1,105 +1,1745 @@
 #include "build.h"
+#include "builtin.h"
+#include "capture.h"
+#include "depfile.h"
+#include "graph.h"
+#include "hash.h"
 #include "parser.h"
+#include "launch.h"
+#include "priority.h"
+#include "procstat.h"
+#include "trace.h"
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <wait.h>
 
-int build_target(const char *target_name, makefile *mf, bool force_rebuild,
-                 bool silent) {
+// Content hash used for prerequisites that do not exist
+#define MISSING_HASH 0
 
-  // Gather the rule using the provided parsing functions
-  rule *rule = makefile_rule(mf, target_name);
+// Trace thread of targets that needed no job
+#define TRACE_MAIN_TID 0
 
-  if (!rule) {
-    // No rule for target so check if file exists
-    if (access(target_name, F_OK) == 0) {
-      return EXIT_SUCCESS;
+// Pool of a target that is not in a pool
+#define NO_POOL SIZE_MAX
+
+// Time constant in seconds of the one minute load average
+#define LOADAVG_PERIOD 60.0
+
+// Job slot pid of a builtin, which runs to its end before the next job
+#define BUILTIN_PID -1
+
+// Value of a DB_FILE_HASH record
+struct file_record {
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint64_t hash;
+};
+
+// Value of a DB_RESTAT record. It only applies while the target still has
+// the mtime its recipe left.
+struct restat_record {
+  int64_t mtime_sec; // mtime of the target after its recipe ran
+  int64_t mtime_nsec;
+  int64_t changed_sec; // mtime of the last run that changed the contents
+  int64_t changed_nsec;
+  int64_t inputs_sec; // Newest prerequisite when the recipe ran
+  int64_t inputs_nsec;
+};
+
+// Outcome of checking a ready target
+enum step {
+  STEP_DONE,   // Up to date, restored or a file without a rule
+  STEP_JOB,    // The recipe has to run
+  STEP_FAILED, // The target can not be made
+};
+
+// Per-target state of the scheduler
+struct plan {
+  bool decided; // The target needs a job, the fields below are set
+  uint64_t fingerprint;
+  size_t pool; // Index into sched.pools or NO_POOL
+  uint64_t mem; // Memory the recipe is expected to use, from "mem = SIZE"
+  bool restat;  // Compare the target before and after the recipe
+  const char *depfile; // From "depfile = PATH", NULL without one
+  bool live; // From "live = 1", the recipe writes straight to the terminal
+  struct file_info before; // The target before the recipe, with its hash
+  struct timespec start;
+};
+
+// Recipe that is running in a job slot
+struct job {
+  pid_t pid; // 0 marks a free slot
+  size_t node;
+  struct timespec started;
+  capture *out; // Output of the recipe, NULL if it is not captured
+};
+
+// Pool of jobs declared in the makefile, "pool NAME = DEPTH"
+struct pool {
+  const char *name;
+  int depth;
+  int running;
+  size_t *waiting; // Ready targets held back while the pool is full
+  size_t n_waiting;
+  size_t cap_waiting;
+};
+
+struct sched {
+  struct build_state *s;
+  graph *g;
+  const bool *dirty; // Targets that may be out of date, NULL for all
+  struct plan *plans;
+  size_t *pending; // Prerequisites of each target that are not done yet
+  size_t *ready;   // Heap of ready targets, first by priority_before
+  size_t n_ready;
+  double *rank;    // Priority ranks, NULL to build in node order
+  int64_t *took;   // Microseconds each recipe took in this run
+  struct job *jobs;
+  size_t n_slots;   // Allocated job slots
+  size_t max_slots; // Limit on n_slots
+  size_t running;
+  size_t peak; // Most jobs that ran at once
+  struct pool *pools;
+  size_t n_pools;
+  size_t tokens;   // Jobserver tokens held for the running jobs
+  int sig_fd;      // signalfd for SIGCHLD, -1 if not polling
+  bool want_token; // The next job waits for a jobserver token
+  bool buffer_output; // Capture the output of each job, jobs run in parallel
+  size_t live;        // Running jobs that write straight to the terminal
+  capture **held;     // Output of jobs that finished while a live job ran
+  size_t n_held;
+  size_t cap_held;
+  struct pollfd *fds; // Room to poll the signalfd, jobserver and all pipes
+  size_t cap_fds;
+  bool failed;
+};
+
+static int query_graph(graph *g, struct build_state *s);
+static int schedule(struct sched *sc);
+static enum step check_target(struct sched *sc, size_t i);
+static const char **rule_inputs(struct build_state *s, const graph *g,
+                                size_t i);
+static int out_of_date(struct build_state *s, const graph *g, size_t i,
+                       const char **inputs, uint64_t *fingerprint);
+static int record_deps(struct sched *sc, size_t i);
+static int open_db(struct build_state *s);
+static const struct restat_record *
+restat_record(struct build_state *s, const char *name,
+              const struct file_info *info);
+static struct file_info changed_info(struct build_state *s, const char *name,
+                                     const struct file_info *info);
+static int restat_target(struct sched *sc, size_t i);
+static int plan_job(struct sched *sc, size_t i);
+static size_t find_pool(struct sched *sc, const char *name);
+static bool pool_full(struct sched *sc, size_t i);
+static void pool_release(struct sched *sc, size_t pool);
+static bool take_slot(struct sched *sc, size_t i);
+static bool admit_load(struct sched *sc);
+static bool admit_mem(struct sched *sc, size_t i);
+static double age(const struct timespec *since);
+static void put_tokens(struct sched *sc);
+static int start_job(struct sched *sc, size_t i);
+static int wait_jobs(struct sched *sc);
+static void finish_job(struct sched *sc, pid_t pid, int status,
+                       struct rusage *usage);
+static void show_output(struct sched *sc, capture *out);
+static void show_held(struct sched *sc);
+static void target_done(struct sched *sc, size_t i);
+static int store_fingerprint(struct build_state *s, const char *target_name,
+                             uint64_t fingerprint);
+static int rank_targets(struct sched *sc);
+static void report_schedule(struct sched *sc);
+static void heap_push(struct sched *sc, size_t i);
+static size_t heap_pop(struct sched *sc);
+static bool newer_prereq(struct build_state *s, const struct file_info *target,
+                         const char **prereq);
+static int rule_fingerprint(struct build_state *s, rule *rule,
+                            const char **prereq, uint64_t *out);
+static int prereq_hashes(struct build_state *s, const char **prereq, size_t n,
+                         uint64_t *out);
+static void print_cmd(char **cmd);
+
+int build_targets(const char **target_names, size_t n_targets,
+                  struct build_state *s) {
+  graph *g = graph_new(s->mf, target_names, n_targets);
+  if (!g) {
+    return s->question ? QUESTION_ERROR : EXIT_FAILURE;
+  }
+
+  int status = build_graph(g, NULL, s);
+  graph_del(g);
+  return status;
+}
+
+int build_graph(graph *g, const bool *dirty, struct build_state *s) {
+  if (s->dry_run || s->question) {
+    return query_graph(g, s);
+  }
+
+  struct sched sc = {
+      .s = s,
+      .g = g,
+      .dirty = dirty,
+      .plans = calloc(g->n, sizeof *sc.plans),
+      .pending = malloc(g->n * sizeof *sc.pending),
+      .ready = malloc(g->n * sizeof *sc.ready),
+      .took = calloc(g->n, sizeof *sc.took),
+      .max_slots = s->jobs > 0 && (size_t)s->jobs < g->n ? (size_t)s->jobs
+                                                         : g->n,
+      .sig_fd = -1,
+  };
+
+  // One job at a time writes to the terminal in order as it is
+  sc.buffer_output = sc.max_slots > 1;
+
+  int status = EXIT_FAILURE;
+  if (!sc.plans || !sc.pending || !sc.ready || !sc.took) {
+    perror("malloc");
+  } else if (rank_targets(&sc) == 0 && schedule(&sc) == 0 && !sc.failed) {
+    status = EXIT_SUCCESS;
+  }
+  report_schedule(&sc);
+
+  for (size_t i = 0; i < sc.n_pools; i++) {
+    free(sc.pools[i].waiting);
+  }
+  free(sc.pools);
+  free(sc.plans);
+  free(sc.pending);
+  free(sc.ready);
+  free(sc.rank);
+  free(sc.took);
+  free(sc.jobs);
+  free(sc.held);
+  free(sc.fds);
+  return status;
+}
+
+/*
+ * query_graph - Finds the targets that are out of date without running
+ * anything. The metadata of all nodes is gathered up front in parallel, then
+ * the nodes are decided in node order, where a target is also out of date if
+ * a prerequisite is. With -n the recipes are printed in the order a serial
+ * build would run them, with -q the walk stops at the first stale target.
+ *
+ * @param g     The graph
+ * @param s     The build state
+ *
+ * @return EXIT_SUCCESS if nothing failed and, with -q, all targets are up
+ * to date. With -q, EXIT_FAILURE if a target is out of date and
+ * QUESTION_ERROR on an error.
+ * */
+static int query_graph(graph *g, struct build_state *s) {
+  bool *stale = calloc(g->n, sizeof *stale);
+  int status = s->question ? QUESTION_ERROR : EXIT_FAILURE;
+
+  if (!stale) {
+    perror("calloc");
+    goto out;
+  }
+
+  if (statcache_prefetch(s->stats, g->names, g->n) != 0) {
+    perror("statcache_prefetch");
+    goto out;
+  }
+
+  for (size_t i = 0; i < g->n; i++) {
+    if (!g->rules[i]) {
+      const struct file_info *info = statcache_get(s->stats, g->names[i]);
+      if (info && info->exists) {
+        continue;
+      }
+      fprintf(stderr, "mmake: No rule to make target '%s'\n", g->names[i]);
+      goto out;
     }
 
-    fprintf(stderr, "mmake: No rule to make target '%s'\n", target_name);
-    return EXIT_FAILURE;
+    int rebuild = s->force_rebuild;
+    for (size_t e = g->prereq_off[i]; e < g->prereq_off[i + 1] && !rebuild;
+         e++) {
+      rebuild = stale[g->prereq[e]];
+    }
+
+    uint64_t fingerprint;
+    if (!rebuild) {
+      const char **inputs = rule_inputs(s, g, i);
+      rebuild = inputs ? out_of_date(s, g, i, inputs, &fingerprint) : -1;
+      free(inputs);
+    }
+    if (rebuild == -1) {
+      goto out;
+    }
+    if (!rebuild) {
+      continue;
+    }
+
+    stale[i] = true;
+    if (s->question) {
+      status = EXIT_FAILURE;
+      goto out;
+    }
+    print_cmd(rule_cmd(g->rules[i]));
   }
+  status = EXIT_SUCCESS;
 
-  // Gather pre requestits from provided parsing functions
-  const char **prereq = rule_prereq(rule);
+out:
+  free(stale);
+  return status;
+}
 
-  for (int i = 0; prereq[i] != NULL; i++) {
-    // Recursvily build each target starting fromt he top
-    if (build_target(prereq[i], mf, force_rebuild, silent) != EXIT_SUCCESS) {
-      return EXIT_FAILURE;
+/*
+ * rank_targets - Ranks the targets for a parallel build by the durations
+ * their recipes had in earlier runs. With one job slot the order does not
+ * change the build time and node order is kept.
+ *
+ * @param sc    The scheduler
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int rank_targets(struct sched *sc) {
+  if (sc->max_slots < 2) {
+    return 0;
+  }
+
+  int64_t *expected = malloc(sc->g->n * sizeof *expected);
+  sc->rank = malloc(sc->g->n * sizeof *sc->rank);
+  if (!expected || !sc->rank) {
+    perror("malloc");
+    free(expected);
+    return -1;
+  }
+
+  for (size_t i = 0; i < sc->g->n; i++) {
+    size_t len;
+    const int64_t *dur = sc->s->db ? db_get(sc->s->db, DB_DURATION,
+                                            sc->g->names[i], &len)
+                                   : NULL;
+
+    if (!sc->g->rules[i]) {
+      expected[i] = 0;
+    } else if (dur && len == sizeof *dur) {
+      expected[i] = *dur;
+    } else {
+      expected[i] = PRIORITY_UNKNOWN;
     }
   }
 
-  struct stat target_stats;
-  bool rebuild = false;
+  priority_ranks(sc->g, expected, sc->rank);
+  free(expected);
+  return 0;
+}
 
-  // Check whether file is up to date or dosent exist then set boolean rebuild
-  // based on data
-  if (stat(target_name, &target_stats) != 0) {
-    rebuild = true;
-  } else {
-    for (int i = 0; prereq[i] != NULL; i++) {
-      struct stat dep;
-      if (stat(prereq[i], &dep) == 0)
-        if (dep.st_mtime > target_stats.st_mtime) {
-          rebuild = true;
+/*
+ * report_schedule - Adds the makespan of this build with node order and
+ * with the order that was used to the trace, both simulated with the
+ * recipe durations of this run
+ *
+ * @param sc    The scheduler, after the build
+ * */
+static void report_schedule(struct sched *sc) {
+  if (!sc->s->trace || !sc->rank || sc->failed) {
+    return;
+  }
+
+  int64_t fifo = priority_makespan(sc->g, sc->took, NULL, sc->peak);
+  int64_t used = priority_makespan(sc->g, sc->took, sc->rank, sc->peak);
+  if (fifo >= 0 && used >= 0) {
+    trace_schedule(sc->s->trace, fifo, used, sc->peak);
+  }
+}
+
+/*
+ * schedule - Builds the targets of the graph. Ready targets are taken by
+ * rank, or in node order with one job slot so the build runs in the same
+ * order as a recursive build. Once a recipe fails no new jobs are started and the
+ * running ones are waited for.
+ *
+ * @param sc    The scheduler, with plans, pending and ready allocated
+ *
+ * @return 0 if the scheduler ran to the end, -1 on a system error
+ * */
+static int schedule(struct sched *sc) {
+  jobserver *js = sc->s->js;
+  sigset_t chld, old_mask;
+  int status = 0;
+
+  // With a jobserver or captured output we wait for a token, output and a
+  // child at the same time, the signal is blocked so it can only arrive
+  // through the signalfd
+  if (js || sc->buffer_output) {
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old_mask);
+    sc->sig_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sc->sig_fd == -1) {
+      perror("signalfd");
+      sigprocmask(SIG_SETMASK, &old_mask, NULL);
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < sc->g->n; i++) {
+    sc->pending[i] = graph_n_prereq(sc->g, i);
+    if (sc->pending[i] == 0) {
+      heap_push(sc, i);
+    }
+  }
+
+  while (true) {
+    // Take ready targets until one needs a job slot that is not free
+    sc->want_token = false;
+    while (!sc->failed && sc->n_ready > 0) {
+      size_t i = sc->ready[0];
+      enum step step = check_target(sc, i);
+
+      if (step == STEP_JOB) {
+        // A full pool holds back its own targets, not the others
+        if (pool_full(sc, i)) {
+          continue;
+        }
+        if (!take_slot(sc, i)) {
           break;
         }
+        heap_pop(sc);
+        if (start_job(sc, i) != 0) {
+          sc->failed = true;
+          put_tokens(sc);
+        }
+        continue;
+      }
+
+      heap_pop(sc);
+      if (step == STEP_FAILED) {
+        sc->failed = true;
+      } else {
+        target_done(sc, i);
+      }
+    }
+
+    if (sc->running == 0) {
+      break;
+    }
+    if (wait_jobs(sc) != 0) {
+      status = -1;
+      break;
+    }
+  }
+
+  if (js || sc->buffer_output) {
+    close(sc->sig_fd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  }
+
+  return status;
+}
+
+/*
+ * check_target - Decides what a ready target needs. Targets that are up to
+ * date or can be restored from the action cache are finished here. The
+ * decision to run a recipe is remembered, since the target is checked again
+ * while it waits for a job slot.
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target
+ *
+ * @return What the target needs
+ * */
+static enum step check_target(struct sched *sc, size_t i) {
+  struct build_state *s = sc->s;
+  const graph *g = sc->g;
+  struct plan *plan = &sc->plans[i];
+  const char *target_name = g->names[i];
+
+  if (plan->decided) {
+    return STEP_JOB;
+  }
+
+  // Nothing this target depends on changed since it was last up to date
+  if (sc->dirty && !sc->dirty[i]) {
+    return STEP_DONE;
+  }
+
+  if (!g->rules[i]) {
+    // No rule for target so check if file exists
+    const struct file_info *info = statcache_get(s->stats, target_name);
+    if (info && info->exists) {
+      return STEP_DONE;
+    }
+
+    fprintf(stderr, "mmake: No rule to make target '%s'\n", target_name);
+    return STEP_FAILED;
+  }
+
+  // The trace covers the target's own work, not its prerequisites
+  if (s->trace) {
+    clock_gettime(CLOCK_MONOTONIC, &plan->start);
+  }
+
+  // The prerequisites from the makefile and from the last depfile
+  const char **inputs = rule_inputs(s, g, i);
+  if (!inputs) {
+    return STEP_FAILED;
+  }
+  uint64_t fingerprint = 0;
+  int rebuild = out_of_date(s, g, i, inputs, &fingerprint);
+
+  // The action cache needs the fingerprint even when mtimes decide, and
+  // for a recipe that -B runs anyway
+  if ((rebuild == 1 || s->force_rebuild) && s->cache && !s->content_hash &&
+      rule_fingerprint(s, g->rules[i], inputs, &fingerprint) != 0) {
+    rebuild = -1;
+  }
+  free(inputs);
+
+  if (rebuild == -1) {
+    return STEP_FAILED;
+  }
+
+  if (!rebuild && !s->force_rebuild) {
+    if (s->trace) {
+      trace_target(s->trace, target_name, TRACE_SKIPPED, &plan->start, NULL,
+                   TRACE_MAIN_TID);
+    }
+    return store_fingerprint(s, target_name, fingerprint) == 0 ? STEP_DONE
+                                                               : STEP_FAILED;
+  }
+
+  // The fingerprint covers the inputs, the same inputs can build several
+  // targets so the name is part of the key
+  if (s->cache && !s->force_rebuild &&
+      cache_restore(s->cache,
+                    hash_bytes(target_name, strlen(target_name), fingerprint),
+                    target_name)) {
+    if (!s->silent) {
+      print_cmd(rule_cmd(g->rules[i]));
+    }
+    statcache_invalidate(s->stats, target_name);
+    if (s->trace) {
+      trace_target(s->trace, target_name, TRACE_RESTORED, &plan->start, NULL,
+                   TRACE_MAIN_TID);
     }
+    return store_fingerprint(s, target_name, fingerprint) == 0 ? STEP_DONE
+                                                               : STEP_FAILED;
+  }
+
+  plan->fingerprint = fingerprint;
+  if (plan_job(sc, i) != 0) {
+    return STEP_FAILED;
+  }
+  plan->decided = true;
+  return STEP_JOB;
+}
+
+/*
+ * out_of_date - Decides whether the recipe of a target has to run, by the
+ * fingerprint with -H and by mtimes otherwise
+ *
+ * @param s             The build state
+ * @param g             The graph
+ * @param i             Node number of the target, which has a rule
+ * @param inputs        Its prerequisites, from rule_inputs
+ * @param fingerprint   Filled with the fingerprint with -H, left alone
+ *                      otherwise
+ *
+ * @return 1 if the target is out of date, 0 if not, -1 on failure
+ * */
+static int out_of_date(struct build_state *s, const graph *g, size_t i,
+                       const char **inputs, uint64_t *fingerprint) {
+  // Copy the target metadata since later lookups may move cache entries
+  const struct file_info *info = statcache_get(s->stats, g->names[i]);
+  if (!info) {
+    perror("statcache_get");
+    return -1;
+  }
+  struct file_info target = *info;
+
+  // A target its recipe left unchanged counts as built after the inputs it
+  // was checked against
+  const struct restat_record *rec = restat_record(s, g->names[i], &target);
+  if (rec && (rec->inputs_sec > target.mtime.tv_sec ||
+              (rec->inputs_sec == target.mtime.tv_sec &&
+               rec->inputs_nsec > target.mtime.tv_nsec))) {
+    target.mtime.tv_sec = rec->inputs_sec;
+    target.mtime.tv_nsec = rec->inputs_nsec;
   }
 
-  // If it needs to be rebuilt or force_rebuild is set then run each build cmd
-  if (rebuild || force_rebuild) {
-    char **cmd = rule_cmd(rule);
-    if (run_build_cmd(cmd, target_name, silent) != EXIT_SUCCESS) {
-      return EXIT_FAILURE;
+  if (!s->content_hash) {
+    if (!target.exists || newer_prereq(s, &target, inputs)) {
+      return 1;
+    }
+
+    // A header that went away was renamed or removed from the sources,
+    // the recipe has to run to find out which
+    for (size_t j = graph_n_prereq(g, i); inputs[j] != NULL; j++) {
+      const struct file_info *dep = statcache_get(s->stats, inputs[j]);
+      if (!dep || !dep->exists) {
+        return 1;
+      }
     }
+    return 0;
+  }
+
+  // A missing file hashes differently from any contents, so the
+  // fingerprint covers headers that went away
+  if (rule_fingerprint(s, g->rules[i], inputs, fingerprint) != 0) {
+    return -1;
   }
 
-  return EXIT_SUCCESS;
+  // Without an earlier fingerprint the mtimes decide, so turning on -H
+  // does not rebuild everything
+  size_t len;
+  const uint64_t *old = db_get(s->db, DB_FINGERPRINT, g->names[i], &len);
+  if (!target.exists) {
+    return 1;
+  }
+  if (old && len == sizeof *old) {
+    return *old != *fingerprint;
+  }
+  return newer_prereq(s, &target, inputs);
 }
 
-int run_build_cmd(char **cmd, const char *target_name, bool silent) {
-  // If not silent is set print each cmd ran
-  if (!silent) {
-    for (int i = 0; cmd[i] != NULL; i++) {
-      printf("%s", cmd[i]);
-      // If it is not the last cmd print space
-      if (cmd[i + 1] != NULL) {
-        printf(" ");
+/*
+ * rule_inputs - Gives the prerequisites of a target from the makefile,
+ * followed by the ones its depfile listed when it was last built
+ *
+ * @param s     The build state
+ * @param g     The graph
+ * @param i     Node number of the target, which has a rule
+ *
+ * @return Newly allocated NULL-terminated array, a single allocation with
+ * the names it points to. NULL on allocation failure.
+ * */
+static const char **rule_inputs(struct build_state *s, const graph *g,
+                                size_t i) {
+  const char **prereq = rule_prereq(g->rules[i]);
+  size_t len = 0;
+  const char *deps = s->db ? db_get(s->db, DB_DEPS, g->names[i], &len) : NULL;
+
+  size_t n_deps = 0;
+  for (size_t k = 0; k < len; k++) {
+    n_deps += deps[k] == '\0';
+  }
+
+  // Copy the names, a db_put may move the record
+  size_t n_prereq = graph_n_prereq(g, i);
+  size_t n = n_prereq + n_deps;
+  const char **inputs = malloc((n + 1) * sizeof *inputs + len);
+  if (!inputs) {
+    perror("malloc");
+    return NULL;
+  }
+  char *names = (char *)(inputs + n + 1);
+  if (len > 0) {
+    memcpy(names, deps, len);
+  }
+
+  memcpy(inputs, prereq, n_prereq * sizeof *inputs);
+  for (size_t j = n_prereq; j < n; j++) {
+    inputs[j] = names;
+    names += strlen(names) + 1;
+  }
+  inputs[n] = NULL;
+
+  return inputs;
+}
+
+/*
+ * record_deps - Reads the depfile a recipe wrote and stores the
+ * prerequisites it lists that the makefile does not, for the next check of
+ * the target
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target, its recipe succeeded
+ *
+ * @return 0 on success, -1 if the depfile is missing or can not be stored
+ * */
+static int record_deps(struct sched *sc, size_t i) {
+  const graph *g = sc->g;
+  const char *path = sc->plans[i].depfile;
+
+  size_t len;
+  char *deps = depfile_load(path, &len);
+  if (!deps) {
+    fprintf(stderr, "mmake: Depfile %s of target '%s': %s\n", path,
+            g->names[i], strerror(errno));
+    return -1;
+  }
+
+  // Keep the names that add something, in place
+  const char **prereq = rule_prereq(g->rules[i]);
+  size_t kept = 0;
+  for (size_t at = 0; at < len;) {
+    const char *dep = deps + at;
+    size_t dep_len = strlen(dep) + 1;
+    at += dep_len;
+
+    bool known = strcmp(dep, g->names[i]) == 0;
+    for (size_t j = 0; !known && j < graph_n_prereq(g, i); j++) {
+      known = strcmp(dep, prereq[j]) == 0;
+    }
+    if (!known) {
+      memmove(deps + kept, dep, dep_len);
+      kept += dep_len;
+    }
+  }
+
+  int status = db_put(sc->s->db, DB_DEPS, g->names[i], deps, kept);
+  free(deps);
+  return status;
+}
+
+/*
+ * open_db - Opens the build database if this run did not need it so far
+ *
+ * @param s     The build state
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int open_db(struct build_state *s) {
+  if (!s->db && !(s->db = db_open(DB_FILE))) {
+    perror(DB_FILE);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * plan_job - Reads the pool and memory attributes of a target whose recipe
+ * has to run
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target
+ *
+ * @return 0 on success, -1 if an attribute is invalid
+ * */
+static int plan_job(struct sched *sc, size_t i) {
+  const graph *g = sc->g;
+  struct plan *plan = &sc->plans[i];
+
+  plan->pool = NO_POOL;
+  const char *pool = rule_attr(g->rules[i], "pool");
+  if (pool && (plan->pool = find_pool(sc, pool)) == NO_POOL) {
+    fprintf(stderr, "mmake: Unknown pool '%s' for target '%s'\n", pool,
+            g->names[i]);
+    return -1;
+  }
+
+  plan->mem = 0;
+  const char *mem = rule_attr(g->rules[i], "mem");
+  if (mem && parse_size(mem, &plan->mem) != 0) {
+    fprintf(stderr, "mmake: Invalid mem '%s' for target '%s'\n", mem,
+            g->names[i]);
+    return -1;
+  }
+
+  const char *restat = rule_attr(g->rules[i], "restat");
+  if (restat && strcmp(restat, "0") != 0 && strcmp(restat, "1") != 0) {
+    fprintf(stderr, "mmake: Invalid restat '%s' for target '%s'\n", restat,
+            g->names[i]);
+    return -1;
+  }
+  plan->restat = restat ? strcmp(restat, "1") == 0 : sc->s->restat;
+
+  plan->depfile = rule_attr(g->rules[i], "depfile");
+
+  const char *live = rule_attr(g->rules[i], "live");
+  if (live && strcmp(live, "0") != 0 && strcmp(live, "1") != 0) {
+    fprintf(stderr, "mmake: Invalid live '%s' for target '%s'\n", live,
+            g->names[i]);
+    return -1;
+  }
+  plan->live = live && strcmp(live, "1") == 0;
+
+  // The records live in the build database, which plain builds do not open
+  if ((plan->restat || plan->depfile) && open_db(sc->s) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * find_pool - Looks up a pool, adding it to the scheduler the first time a
+ * target uses it
+ *
+ * @param sc    The scheduler
+ * @param name  Name of the pool
+ *
+ * @return Index of the pool, NO_POOL if it is not declared or on allocation
+ * failure
+ * */
+static size_t find_pool(struct sched *sc, const char *name) {
+  for (size_t p = 0; p < sc->n_pools; p++) {
+    if (strcmp(sc->pools[p].name, name) == 0) {
+      return p;
+    }
+  }
+
+  int depth = makefile_pool_depth(sc->s->mf, name);
+  if (depth < 1) {
+    return NO_POOL;
+  }
+
+  struct pool *pools =
+      realloc(sc->pools, (sc->n_pools + 1) * sizeof *sc->pools);
+  if (!pools) {
+    perror("realloc");
+    return NO_POOL;
+  }
+  sc->pools = pools;
+  sc->pools[sc->n_pools] = (struct pool){.name = name, .depth = depth};
+
+  return sc->n_pools++;
+}
+
+/*
+ * pool_full - Checks if the pool of a ready target is full. If it is, the
+ * target is moved from the ready heap to the waiting list of the pool.
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target, on top of the heap
+ *
+ * @return true if the target was held back
+ * */
+static bool pool_full(struct sched *sc, size_t i) {
+  size_t p = sc->plans[i].pool;
+  if (p == NO_POOL || sc->pools[p].running < sc->pools[p].depth) {
+    return false;
+  }
+
+  struct pool *pool = &sc->pools[p];
+  if (pool->n_waiting == pool->cap_waiting) {
+    size_t cap = pool->cap_waiting ? 2 * pool->cap_waiting : 16;
+    size_t *waiting = realloc(pool->waiting, cap * sizeof *waiting);
+    if (!waiting) {
+      // Leave it on the heap, it is retried when a job finishes
+      perror("realloc");
+      return false;
+    }
+    pool->waiting = waiting;
+    pool->cap_waiting = cap;
+  }
+
+  heap_pop(sc);
+  pool->waiting[pool->n_waiting++] = i;
+  return true;
+}
+
+/*
+ * pool_release - Frees a place in a pool after one of its jobs finished and
+ * makes the targets waiting for it ready again
+ *
+ * @param sc    The scheduler
+ * @param p     Index of the pool, or NO_POOL
+ * */
+static void pool_release(struct sched *sc, size_t p) {
+  if (p == NO_POOL) {
+    return;
+  }
+
+  struct pool *pool = &sc->pools[p];
+  pool->running--;
+  for (size_t j = 0; j < pool->n_waiting; j++) {
+    heap_push(sc, pool->waiting[j]);
+  }
+  pool->n_waiting = 0;
+}
+
+/*
+ * take_slot - Takes a job slot for a recipe. The first running job uses the
+ * slot every process gets for free. Further jobs are only started while the
+ * load and memory limits allow, and need a jobserver token when there is a
+ * jobserver.
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target
+ *
+ * @return true if a job can be started
+ * */
+static bool take_slot(struct sched *sc, size_t i) {
+  if (sc->running == 0) {
+    return true;
+  }
+  if (sc->running >= sc->max_slots || !admit_load(sc) || !admit_mem(sc, i)) {
+    return false;
+  }
+  if (sc->s->js) {
+    if (!jobserver_acquire(sc->s->js)) {
+      sc->want_token = true;
+      return false;
+    }
+    sc->tokens++;
+  }
+
+  return true;
+}
+
+/*
+ * admit_load - Checks the load limit. The load average follows the number
+ * of runnable processes with a delay, so the part of each running job that
+ * it does not show yet is added.
+ *
+ * @param sc    The scheduler
+ *
+ * @return true if the load allows another job
+ * */
+static bool admit_load(struct sched *sc) {
+  double load;
+  if (sc->s->max_load <= 0 || procstat_loadavg(&load) != 0) {
+    return true;
+  }
+
+  for (size_t slot = 0; slot < sc->n_slots; slot++) {
+    if (sc->jobs[slot].pid != 0) {
+      load += exp(-age(&sc->jobs[slot].started) / LOADAVG_PERIOD);
+    }
+  }
+
+  return load < sc->s->max_load;
+}
+
+/*
+ * admit_mem - Checks that starting a recipe leaves the memory headroom
+ * free. Running jobs that have not grown to their expected size yet are
+ * counted with the rest of that size, only the recipe process itself is
+ * measured.
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target
+ *
+ * @return true if there is memory for the recipe
+ * */
+static bool admit_mem(struct sched *sc, size_t i) {
+  uint64_t avail;
+  if ((sc->s->mem_headroom == 0 && sc->plans[i].mem == 0) ||
+      procstat_mem_available(&avail) != 0) {
+    return true;
+  }
+
+  uint64_t need = sc->s->mem_headroom + sc->plans[i].mem;
+  for (size_t slot = 0; slot < sc->n_slots; slot++) {
+    struct job *job = &sc->jobs[slot];
+    uint64_t mem = job->pid != 0 ? sc->plans[job->node].mem : 0;
+    uint64_t rss;
+    if (mem > 0 && procstat_rss(job->pid, &rss) == 0 && rss < mem) {
+      need += mem - rss;
+    }
+  }
+
+  return avail >= need;
+}
+
+/*
+ * age - Gets the time passed since a CLOCK_MONOTONIC timestamp
+ *
+ * @param since     The timestamp
+ *
+ * @return Seconds since the timestamp
+ * */
+static double age(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/*
+ * put_tokens - Gives back the jobserver tokens the running jobs do not need
+ *
+ * @param sc    The scheduler
+ * */
+static void put_tokens(struct sched *sc) {
+  while (sc->tokens > 0 && sc->tokens >= sc->running) {
+    jobserver_release(sc->s->js);
+    sc->tokens--;
+  }
+}
+
+/*
+ * start_job - Starts the recipe of a target in a free job slot
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target
+ *
+ * @return 0 on success, -1 if the recipe could not be started
+ * */
+static int start_job(struct sched *sc, size_t i) {
+  struct build_state *s = sc->s;
+  const graph *g = sc->g;
+  char **cmd = rule_cmd(g->rules[i]);
+
+  size_t slot = 0;
+  while (slot < sc->n_slots && sc->jobs[slot].pid != 0) {
+    slot++;
+  }
+  if (slot == sc->n_slots) {
+    size_t n_slots = sc->n_slots ? 2 * sc->n_slots : 8;
+    struct job *jobs = realloc(sc->jobs, n_slots * sizeof *jobs);
+    if (!jobs) {
+      perror("realloc");
+      return -1;
+    }
+    memset(jobs + sc->n_slots, 0, (n_slots - sc->n_slots) * sizeof *jobs);
+    sc->jobs = jobs;
+    sc->n_slots = n_slots;
+  }
+
+  // A recipe writing to the target in place must not modify a cache entry
+  if (s->cache) {
+    cache_unshare(g->names[i]);
+  }
+
+  // The contents before the recipe, unless they are already known
+  struct plan *plan = &sc->plans[i];
+  if (plan->restat) {
+    const struct file_info *info = statcache_get(s->stats, g->names[i]);
+    if (!info) {
+      perror("statcache_get");
+      return -1;
+    }
+    plan->before = *info;
+
+    uint64_t hash;
+    if (plan->before.exists) {
+      if (prereq_hashes(s, &g->names[i], 1, &hash) != 0) {
+        return -1;
       }
+      plan->before.hash = hash;
+    }
+  }
+
+  // A builtin writes its output before anything else can, the output of a
+  // parallel recipe is captured with its command line at the start
+  bool builtin = !s->no_builtins && sc->live == 0 && builtin_handles(cmd);
+  capture *out = NULL;
+  if (sc->buffer_output && !builtin && !plan->live &&
+      !(out = capture_new(s->silent ? NULL : cmd))) {
+    perror("capture_new");
+    return -1;
+  }
+
+  // If not silent is set print each cmd ran
+  if (!s->silent && !out) {
+    print_cmd(cmd);
+  }
+
+  // The trace of a recipe covers the recipe alone
+  if (s->trace) {
+    clock_gettime(CLOCK_MONOTONIC, &sc->plans[i].start);
+  }
+
+  // A builtin runs to its end here and finishes like a recipe that exited
+  if (builtin) {
+    int code = builtin_run(cmd);
+    sc->jobs[slot] = (struct job){.pid = BUILTIN_PID, .node = i};
+    clock_gettime(CLOCK_MONOTONIC, &sc->jobs[slot].started);
+    if (sc->plans[i].pool != NO_POOL) {
+      sc->pools[sc->plans[i].pool].running++;
     }
-    printf("\n");
-    fflush(stdout);
+    if (++sc->running > sc->peak) {
+      sc->peak = sc->running;
+    }
+    struct rusage usage = {0};
+    finish_job(sc, BUILTIN_PID, W_EXITCODE(code, 0), &usage);
+    return 0;
   }
 
-  // Fork a child
-  pid_t pid = fork();
+  // Start the command, posix_spawnp does not copy our address space
+  pid_t pid = launch_cmd(cmd, out ? capture_job_fd(out) : -1);
   if (pid == -1) {
-    perror("fork");
-    return EXIT_FAILURE;
+    perror(cmd[0]);
+    capture_del(out);
+    fprintf(stderr, "mmake: Command failed for target '%s'\n", g->names[i]);
+    if (s->trace) {
+      trace_target(s->trace, g->names[i], TRACE_FAILED, &sc->plans[i].start,
+                   NULL, TRACE_MAIN_TID);
+    }
+    return -1;
+  }
+
+  if (out) {
+    capture_started(out);
+  }
+  if (plan->live) {
+    sc->live++;
   }
 
-  // If child procecc execute the cmd
-  if (pid == 0) {
-    execvp(cmd[0], cmd);
-    perror("execvp");
-    exit(EXIT_FAILURE);
+  sc->jobs[slot] = (struct job){.pid = pid, .node = i, .out = out};
+  clock_gettime(CLOCK_MONOTONIC, &sc->jobs[slot].started);
+  if (sc->plans[i].pool != NO_POOL) {
+    sc->pools[sc->plans[i].pool].running++;
+  }
+  if (++sc->running > sc->peak) {
+    sc->peak = sc->running;
   }
+  return 0;
+}
 
-  // Wait for the child
+/*
+ * wait_jobs - Waits until a job finishes, or with a jobserver also until a
+ * token may be available for a ready target, and finishes the jobs that are
+ * done. Captured output is taken from the pipes meanwhile, so no job stalls
+ * on a full pipe.
+ *
+ * @param sc    The scheduler, with at least one running job
+ *
+ * @return 0 on success, -1 on a system error
+ * */
+static int wait_jobs(struct sched *sc) {
+  struct rusage usage;
   int status;
-  if (waitpid(pid, &status, 0) == -1) {
-    perror("waitpid");
-    return EXIT_FAILURE;
+  pid_t pid;
+  bool want_token = sc->want_token && !sc->failed;
+
+  if (!want_token && !sc->buffer_output) {
+    // wait4 also reports what the recipe used
+    while ((pid = wait4(-1, &status, 0, &usage)) == -1 && errno == EINTR) {
+    }
+    if (pid == -1) {
+      perror("wait4");
+      return -1;
+    }
+    finish_job(sc, pid, status, &usage);
+    return 0;
+  }
+
+  if (sc->cap_fds < sc->n_slots + 2) {
+    struct pollfd *fds = realloc(sc->fds, (sc->n_slots + 2) * sizeof *fds);
+    if (!fds) {
+      perror("realloc");
+      return -1;
+    }
+    sc->fds = fds;
+    sc->cap_fds = sc->n_slots + 2;
+  }
+
+  size_t n_fds = 0;
+  sc->fds[n_fds++] = (struct pollfd){.fd = sc->sig_fd, .events = POLLIN};
+  if (want_token) {
+    sc->fds[n_fds++] =
+        (struct pollfd){.fd = jobserver_fd(sc->s->js), .events = POLLIN};
+  }
+  size_t first_pipe = n_fds;
+  for (size_t slot = 0; slot < sc->n_slots; slot++) {
+    capture *out = sc->jobs[slot].pid != 0 ? sc->jobs[slot].out : NULL;
+    if (out && capture_fd(out) != -1) {
+      sc->fds[n_fds++] =
+          (struct pollfd){.fd = capture_fd(out), .events = POLLIN};
+    }
+  }
+
+  if (poll(sc->fds, n_fds, -1) == -1 && errno != EINTR) {
+    perror("poll");
+    return -1;
   }
 
+  // The pipes are visited in the order they were added
+  size_t f = first_pipe;
+  for (size_t slot = 0; slot < sc->n_slots; slot++) {
+    capture *out = sc->jobs[slot].pid != 0 ? sc->jobs[slot].out : NULL;
+    if (!out || capture_fd(out) == -1) {
+      continue;
+    }
+    if (sc->fds[f++].revents != 0 && capture_read(out) != 0) {
+      perror("capture_read");
+    }
+  }
+
+  // Signals are merged, so reap every child that is done
+  struct signalfd_siginfo info;
+  while (read(sc->sig_fd, &info, sizeof info) == sizeof info) {
+  }
+  while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+    finish_job(sc, pid, status, &usage);
+  }
+
+  return 0;
+}
+
+/*
+ * finish_job - Records the result of a recipe that has exited and frees
+ * its job slot
+ *
+ * @param sc        The scheduler
+ * @param pid       Pid of the recipe
+ * @param status    Wait status of the recipe
+ * @param usage     Resource usage of the recipe
+ * */
+static void finish_job(struct sched *sc, pid_t pid, int status,
+                       struct rusage *usage) {
+  struct build_state *s = sc->s;
+  size_t slot = 0;
+  while (slot < sc->n_slots && sc->jobs[slot].pid != pid) {
+    slot++;
+  }
+  if (slot == sc->n_slots) {
+    return;
+  }
+
+  size_t i = sc->jobs[slot].node;
+  const char *target_name = sc->g->names[i];
+  capture *out = sc->jobs[slot].out;
+  sc->jobs[slot].pid = 0;
+  sc->jobs[slot].out = NULL;
+  sc->running--;
+  put_tokens(sc);
+  pool_release(sc, sc->plans[i].pool);
+
+  // The block of a job comes before any message about it
+  if (sc->plans[i].live) {
+    sc->live--;
+  }
+  if (out) {
+    show_output(sc, out);
+  }
+  if (sc->live == 0) {
+    show_held(sc);
+  }
+
+  // The recipe may have changed the target, nothing else
+  statcache_invalidate(s->stats, target_name);
+
   // Check that the child exited correctly
-  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+  bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (s->trace) {
+    trace_target(s->trace, target_name, ok ? TRACE_REBUILT : TRACE_FAILED,
+                 &sc->plans[i].start, usage, (int)slot + 1);
+  }
+  if (!ok) {
     fprintf(stderr, "mmake: Command failed for target '%s'\n", target_name);
-    return EXIT_FAILURE;
+    sc->failed = true;
+    return;
+  }
+
+  // Remember how long the recipe took for ranking targets in later runs,
+  // averaged with earlier runs to smooth out noise
+  sc->took[i] = (int64_t)(age(&sc->jobs[slot].started) * 1e6);
+  if (s->db) {
+    size_t len;
+    const int64_t *old = db_get(s->db, DB_DURATION, target_name, &len);
+    int64_t dur = old && len == sizeof *old ? (*old + sc->took[i]) / 2
+                                            : sc->took[i];
+    if (db_put(s->db, DB_DURATION, target_name, &dur, sizeof dur) != 0) {
+      sc->failed = true;
+      return;
+    }
+  }
+
+  // New headers change the fingerprint, store the one the next check of
+  // the target computes
+  uint64_t fingerprint = sc->plans[i].fingerprint;
+  if (sc->plans[i].depfile) {
+    if (record_deps(sc, i) != 0) {
+      sc->failed = true;
+      return;
+    }
+
+    const char **inputs = rule_inputs(s, sc->g, i);
+    if (!inputs || ((s->content_hash || s->cache) &&
+                    rule_fingerprint(s, sc->g->rules[i], inputs,
+                                     &fingerprint) != 0)) {
+      free(inputs);
+      sc->failed = true;
+      return;
+    }
+    free(inputs);
+  }
+
+  // A failed store only costs a later cache miss. Only regular files are
+  // stored, a recipe may make a directory.
+  struct stat st;
+  if (s->cache && stat(target_name, &st) == 0 && S_ISREG(st.st_mode)) {
+    cache_store(s->cache,
+                hash_bytes(target_name, strlen(target_name), fingerprint),
+                target_name);
+  }
+
+  if (store_fingerprint(s, target_name, fingerprint) != 0 ||
+      (sc->plans[i].restat && restat_target(sc, i) != 0)) {
+    sc->failed = true;
+    return;
+  }
+
+  target_done(sc, i);
+}
+
+/*
+ * show_output - Writes the captured output of a finished job to stdout, or
+ * holds it back while a live job writes to the terminal
+ *
+ * @param sc    The scheduler
+ * @param out   The capture, freed or held
+ * */
+static void show_output(struct sched *sc, capture *out) {
+  // What the job wrote just before it exited may still be in the pipe
+  if (capture_read(out) != 0) {
+    perror("capture_read");
+  }
+
+  if (sc->live > 0) {
+    if (sc->n_held == sc->cap_held) {
+      size_t cap = sc->cap_held ? 2 * sc->cap_held : 8;
+      capture **held = realloc(sc->held, cap * sizeof *held);
+      if (held) {
+        sc->held = held;
+        sc->cap_held = cap;
+      }
+    }
+    // Without room the output is written now rather than lost
+    if (sc->n_held < sc->cap_held) {
+      sc->held[sc->n_held++] = out;
+      return;
+    }
+  }
+
+  fflush(stdout);
+  if (capture_write(out, STDOUT_FILENO) != 0) {
+    perror("write");
+  }
+  capture_del(out);
+}
+
+/*
+ * show_held - Writes the output held back while live jobs ran, in the order
+ * the jobs finished
+ *
+ * @param sc    The scheduler, with no live job running
+ * */
+static void show_held(struct sched *sc) {
+  for (size_t h = 0; h < sc->n_held; h++) {
+    show_output(sc, sc->held[h]);
+  }
+  sc->n_held = 0;
+}
+
+/*
+ * restat_target - Compares a target with its contents before the recipe
+ * ran. If they did not change the target keeps the mtime of its last
+ * change for its dependents, so those that were only out of date because of
+ * it are not rebuilt, in this run and later ones.
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target, its recipe succeeded
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int restat_target(struct sched *sc, size_t i) {
+  struct build_state *s = sc->s;
+  const graph *g = sc->g;
+  const struct file_info *before = &sc->plans[i].before;
+
+  const struct file_info *info = statcache_get(s->stats, g->names[i]);
+  if (!info) {
+    perror("statcache_get");
+    return -1;
+  }
+  struct file_info after = *info;
+  if (!before->exists || !after.exists) {
+    return 0;
+  }
+
+  // An untouched target needs no hash
+  bool touched = after.mtime.tv_sec != before->mtime.tv_sec ||
+                 after.mtime.tv_nsec != before->mtime.tv_nsec;
+  uint64_t hash;
+  if (touched) {
+    if (after.size != before->size) {
+      return 0;
+    }
+    if (prereq_hashes(s, &g->names[i], 1, &hash) != 0) {
+      return -1;
+    }
+    if (hash != before->hash) {
+      return 0;
+    }
+  }
+
+  struct file_info changed = changed_info(s, g->names[i], before);
+  struct restat_record rec = {
+      .mtime_sec = after.mtime.tv_sec,
+      .mtime_nsec = after.mtime.tv_nsec,
+      .changed_sec = changed.mtime.tv_sec,
+      .changed_nsec = changed.mtime.tv_nsec,
+  };
+
+  // Prerequisites are done, their times are final
+  const char **inputs = rule_inputs(s, g, i);
+  if (!inputs) {
+    return -1;
+  }
+  for (size_t j = 0; inputs[j] != NULL; j++) {
+    const struct file_info *dep = statcache_get(s->stats, inputs[j]);
+    if (!dep || !dep->exists) {
+      continue;
+    }
+    struct file_info dep_changed = changed_info(s, inputs[j], dep);
+    if (dep_changed.mtime.tv_sec > rec.inputs_sec ||
+        (dep_changed.mtime.tv_sec == rec.inputs_sec &&
+         dep_changed.mtime.tv_nsec > rec.inputs_nsec)) {
+      rec.inputs_sec = dep_changed.mtime.tv_sec;
+      rec.inputs_nsec = dep_changed.mtime.tv_nsec;
+    }
+  }
+  free(inputs);
+
+  return db_put(s->db, DB_RESTAT, g->names[i], &rec, sizeof rec);
+}
+
+/*
+ * restat_record - Looks up the restat record of a file
+ *
+ * @param s     The build state
+ * @param name  Name of the file
+ * @param info  Current metadata of the file
+ *
+ * @return The record, NULL if there is none or the file changed since
+ * */
+static const struct restat_record *
+restat_record(struct build_state *s, const char *name,
+              const struct file_info *info) {
+  if (!s->db || !info->exists) {
+    return NULL;
+  }
+
+  size_t len;
+  const struct restat_record *rec = db_get(s->db, DB_RESTAT, name, &len);
+  if (!rec || len != sizeof *rec || rec->mtime_sec != info->mtime.tv_sec ||
+      rec->mtime_nsec != info->mtime.tv_nsec) {
+    return NULL;
+  }
+
+  return rec;
+}
+
+/*
+ * changed_info - Gives the metadata of a file with the mtime of the last
+ * change of its contents, as dependents see it
+ *
+ * @param s     The build state
+ * @param name  Name of the file
+ * @param info  Current metadata of the file
+ *
+ * @return Copy of info, with the mtime from its restat record if it has one
+ * */
+static struct file_info changed_info(struct build_state *s, const char *name,
+                                     const struct file_info *info) {
+  struct file_info changed = *info;
+  const struct restat_record *rec = restat_record(s, name, info);
+
+  if (rec) {
+    changed.mtime.tv_sec = rec->changed_sec;
+    changed.mtime.tv_nsec = rec->changed_nsec;
+  }
+
+  return changed;
+}
+
+/*
+ * target_done - Marks a target as built, making the targets that waited
+ * only for it ready
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target
+ * */
+static void target_done(struct sched *sc, size_t i) {
+  const graph *g = sc->g;
+  for (size_t e = g->dependent_off[i]; e < g->dependent_off[i + 1]; e++) {
+    size_t d = g->dependents[e];
+    if (--sc->pending[d] == 0) {
+      heap_push(sc, d);
+    }
+  }
+}
+
+/*
+ * store_fingerprint - Saves the fingerprint a target was checked or built
+ * with, when content hashes decide rebuilds
+ *
+ * @param s             The build state
+ * @param target_name   Name of the target
+ * @param fingerprint   Fingerprint of its rule
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int store_fingerprint(struct build_state *s, const char *target_name,
+                             uint64_t fingerprint) {
+  if (!s->content_hash) {
+    return 0;
+  }
+
+  return db_put(s->db, DB_FINGERPRINT, target_name, &fingerprint,
+                sizeof fingerprint);
+}
+
+/*
+ * heap_push - Adds a target to the ready heap
+ *
+ * @param sc    The scheduler
+ * @param i     Node number of the target
+ * */
+static void heap_push(struct sched *sc, size_t i) {
+  size_t pos = sc->n_ready++;
+  while (pos > 0 &&
+         priority_before(sc->g, sc->rank, i, sc->ready[(pos - 1) / 2])) {
+    sc->ready[pos] = sc->ready[(pos - 1) / 2];
+    pos = (pos - 1) / 2;
+  }
+  sc->ready[pos] = i;
+}
+
+/*
+ * heap_pop - Removes the ready target that should start first
+ *
+ * @param sc    The scheduler, with a non-empty heap
+ *
+ * @return Node number of the target
+ * */
+static size_t heap_pop(struct sched *sc) {
+  size_t top = sc->ready[0];
+  size_t last = sc->ready[--sc->n_ready];
+  size_t pos = 0;
+
+  while (2 * pos + 1 < sc->n_ready) {
+    size_t child = 2 * pos + 1;
+    if (child + 1 < sc->n_ready &&
+        priority_before(sc->g, sc->rank, sc->ready[child + 1],
+                        sc->ready[child])) {
+      child++;
+    }
+    if (!priority_before(sc->g, sc->rank, sc->ready[child], last)) {
+      break;
+    }
+    sc->ready[pos] = sc->ready[child];
+    pos = child;
+  }
+  sc->ready[pos] = last;
+
+  return top;
+}
+
+/*
+ * print_cmd - Prints a command and its arguments on one line
+ *
+ * @param cmd   NULL-terminated array of words
+ * */
+static void print_cmd(char **cmd) {
+  for (int i = 0; cmd[i] != NULL; i++) {
+    printf("%s", cmd[i]);
+    // If it is not the last cmd print space
+    if (cmd[i + 1] != NULL) {
+      printf(" ");
+    }
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+/*
+ * newer_prereq - Checks if any existing prerequisite was modified after the
+ * target
+ *
+ * @param s         The build state
+ * @param target    Metadata of the target, which must exist
+ * @param prereq    NULL-terminated array of prerequisites
+ *
+ * @return true if the target is out of date
+ * */
+static bool newer_prereq(struct build_state *s, const struct file_info *target,
+                         const char **prereq) {
+  for (int i = 0; prereq[i] != NULL; i++) {
+    const struct file_info *dep = statcache_get(s->stats, prereq[i]);
+    if (!dep || !dep->exists) {
+      continue;
+    }
+
+    struct file_info changed = changed_info(s, prereq[i], dep);
+    if (file_newer(&changed, target)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * rule_fingerprint - Hashes everything a target is built from: the command
+ * line and the name and contents of each prerequisite
+ *
+ * @param s         The build state
+ * @param rule      The rule of the target
+ * @param prereq    NULL-terminated array of prerequisites
+ * @param out       Filled with the fingerprint
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int rule_fingerprint(struct build_state *s, rule *rule,
+                            const char **prereq, uint64_t *out) {
+  size_t n = 0;
+  while (prereq[n] != NULL) {
+    n++;
+  }
+
+  uint64_t *hashes = malloc((n + 1) * sizeof *hashes);
+  if (!hashes) {
+    perror("malloc");
+    return -1;
+  }
+
+  if (prereq_hashes(s, prereq, n, hashes) != 0) {
+    free(hashes);
+    return -1;
+  }
+
+  // Hash each word including its NUL so word boundaries count
+  uint64_t h = 0;
+  char **cmd = rule_cmd(rule);
+  for (int i = 0; cmd[i] != NULL; i++) {
+    h = hash_bytes(cmd[i], strlen(cmd[i]) + 1, h);
+  }
+  for (size_t i = 0; i < n; i++) {
+    h = hash_bytes(prereq[i], strlen(prereq[i]) + 1, h);
+    h = hash_bytes(&hashes[i], sizeof hashes[i], h);
+  }
+
+  free(hashes);
+  *out = h;
+
+  return 0;
+}
+
+/*
+ * prereq_hashes - Gets the content hash of each prerequisite. Hashes are
+ * taken from the stat cache, or from the build database when the file has
+ * the same mtime and size as when it was last hashed. The remaining files
+ * are hashed in parallel.
+ *
+ * @param s         The build state
+ * @param prereq    Array of prerequisites
+ * @param n         Number of prerequisites
+ * @param out       Array of n hashes to fill
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int prereq_hashes(struct build_state *s, const char **prereq, size_t n,
+                         uint64_t *out) {
+  const char **todo = malloc((n + 1) * sizeof *todo);
+  size_t *todo_idx = malloc((n + 1) * sizeof *todo_idx);
+  uint64_t *todo_hash = malloc((n + 1) * sizeof *todo_hash);
+  size_t n_todo = 0;
+  int status = -1;
+
+  if (!todo || !todo_idx || !todo_hash) {
+    perror("malloc");
+    goto out;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    const struct file_info *info = statcache_get(s->stats, prereq[i]);
+    if (!info) {
+      perror("statcache_get");
+      goto out;
+    }
+
+    if (!info->exists) {
+      out[i] = MISSING_HASH;
+      continue;
+    }
+    if (info->hashed) {
+      out[i] = info->hash;
+      continue;
+    }
+
+    size_t len;
+    const struct file_record *rec =
+        db_get(s->db, DB_FILE_HASH, prereq[i], &len);
+    if (rec && len == sizeof *rec && rec->mtime_sec == info->mtime.tv_sec &&
+        rec->mtime_nsec == info->mtime.tv_nsec && rec->size == info->size) {
+      out[i] = rec->hash;
+      statcache_set_hash(s->stats, prereq[i], rec->hash);
+      continue;
+    }
+
+    todo[n_todo] = prereq[i];
+    todo_idx[n_todo] = i;
+    n_todo++;
+  }
+
+  if (n_todo > 0 && hash_files(todo, n_todo, todo_hash) != 0) {
+    fprintf(stderr, "mmake: Could not hash prerequisites\n");
+    goto out;
+  }
+
+  for (size_t i = 0; i < n_todo; i++) {
+    const struct file_info *info = statcache_get(s->stats, todo[i]);
+    struct file_record rec = {
+        .mtime_sec = info->mtime.tv_sec,
+        .mtime_nsec = info->mtime.tv_nsec,
+        .size = info->size,
+        .hash = todo_hash[i],
+    };
+
+    out[todo_idx[i]] = todo_hash[i];
+    statcache_set_hash(s->stats, todo[i], todo_hash[i]);
+    if (db_put(s->db, DB_FILE_HASH, todo[i], &rec, sizeof rec) != 0) {
+      goto out;
+    }
+  }
+  status = 0;
+
+out:
+  free(todo);
+  free(todo_idx);
+  free(todo_hash);
+  return status;
+}
+
+int parse_size(const char *str, uint64_t *out) {
+  // strtoull would take leading blanks and a sign, and negate a '-'
+  if (*str < '0' || *str > '9') {
+    return -1;
+  }
+
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (errno == ERANGE) {
+    return -1;
+  }
+
+  unsigned shift = 0;
+  switch (*end) {
+  case 'G':
+  case 'g':
+    shift += 10;
+    // fall through
+  case 'M':
+  case 'm':
+    shift += 10;
+    // fall through
+  case 'K':
+  case 'k':
+    shift += 10;
+    end++;
+    break;
+  case '\0':
+    break;
+  default:
+    return -1;
+  }
+
+  if (*end != '\0' || value > UINT64_MAX >> shift) {
+    return -1;
   }
 
-  return EXIT_SUCCESS;
+  *out = (uint64_t)value << shift;
+  return 0;
 }
@@ -3,36 +3,81 @@
 #ifndef BUILD_H
 #define BUILD_H
 
+#include "cache.h"
+#include "db.h"
+#include "graph.h"
+#include "jobserver.h"
 #include "parser.h"
+#include "statcache.h"
+#include "trace.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <wait.h>
 
+// Exit status of -q when the check fails, as with GNU make. 1 means that a
+// target is out of date.
+#define QUESTION_ERROR 2
+
+struct build_state {
+  makefile *mf;          // The parsed makefile
+  statcache *stats;      // File metadata gathered during this run
+  db *db;                // Build database, NULL unless hashes are needed
+  cache *cache;          // [-c DIR] Action cache, NULL if not used
+  trace *trace;          // [--trace FILE] NULL if not tracing
+  jobserver *js;         // Shared job slots, NULL if not used
+  int jobs;              // [-j N] Job slots, 0 for no limit besides js
+  double max_load;       // [-l LOAD] 0 for no limit
+  uint64_t mem_headroom; // [--mem-headroom SIZE] Memory to leave free
+  bool force_rebuild;    // [-B]
+  bool restat;           // [--restat] Check every rebuilt target for changes
+  bool dry_run;          // [-n] Print the recipes that would run
+  bool question;         // [-q] Only tell whether anything is out of date
+  bool silent;           // [-s]
+  bool content_hash;     // [-H] Compare input contents instead of mtimes
+  bool no_builtins;      // [--no-builtins] Start every command as a process
+};
+
+/*
+ * build_targets - Builds the targets from the makefile in one pass over a
+ * shared graph, running up to s->jobs recipes at a time. A prerequisite
+ * shared by several targets is checked once, and targets that share
+ * nothing are built side by side.
+ *
+ * @param target_names      Names of the targets
+ * @param n_targets         Number of targets
+ * @param s                 The makefile, options and caches of this run
+ *
+ * @return EXIT_SUCCESS if every target was brought up to date. With -q,
+ * EXIT_FAILURE if a target is out of date and QUESTION_ERROR on an error.
+ * */
+int build_targets(const char **target_names, size_t n_targets,
+                  struct build_state *s);
+
 /*
- * build_target - Builds the target from the makefile
+ * build_graph - Builds all targets of a graph, running up to s->jobs
+ * recipes at a time
  *
- * @param traget_name       Name of target
- * @param mf                The makefile
- * @param force_rebuild     Boolean value stating if it should force the build
- * or not.
- * @param silent            Boolean value stating whether to have any output or
- * not.
+ * @param g         The graph, built from s->mf
+ * @param dirty     Per node, false if nothing the node depends on changed
+ *                  since it was last up to date, so it is not checked. NULL
+ *                  to check every node.
+ * @param s         The makefile, options and caches of this run
  *
- * @reuturn int EXIT_SUCCESS on correct execution
+ * @return EXIT_SUCCESS if every target was brought up to date
  * */
-int build_target(const char *target_name, makefile *mf, bool force_rebuild,
-                 bool silent);
+int build_graph(graph *g, const bool *dirty, struct build_state *s);
+
 /*
- * run_build_cmd - Runs the commands to build the target
+ * parse_size - Parses a size in bytes with an optional K, M or G suffix
  *
- * @param cmd               Array of commands to be executed
- * @param target_name       The name of the target
- * @param silent            Boolean value stating whether to have any output or
- * not
+ * @param str   The string to parse
+ * @param out   Filled with the size on success
  *
- * @reutnr void
+ * @return 0 on success, -1 if str is not a valid size or the size does not
+ * fit in 64 bits
  * */
-int run_build_cmd(char **cmd, const char *target_name, bool silent);
+int parse_size(const char *str, uint64_t *out);
 #endif
@@ -0,0 +1,384 @@
+#include "builtin.h"
+#include "copy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Exit status of the coreutils commands on any failure
+#define FAILED 1
+
+static int dispatch(char **cmd, bool run);
+static int parse_opts(char **cmd, const char *allowed, char *set,
+                      char ***operands);
+static int run_touch(char **cmd, bool run);
+static int run_cp(char **cmd, bool run);
+static int run_mkdir(char **cmd, bool run);
+static int run_rm(char **cmd, bool run);
+static int run_echo(char **cmd, bool run);
+static int make_dirs(char *path);
+static void fail(const char *cmd, const char *what, const char *path);
+
+// Each builtin checks its arguments and returns -1 if it can not run them,
+// which is all it does unless run is true
+static const struct {
+  const char *name;
+  int (*run)(char **cmd, bool run);
+} builtins[] = {
+    {"touch", run_touch}, {"cp", run_cp},     {"mkdir", run_mkdir},
+    {"rm", run_rm},       {"echo", run_echo},
+};
+
+bool builtin_handles(char **cmd) { return dispatch(cmd, false) != -1; }
+
+int builtin_run(char **cmd) { return dispatch(cmd, true); }
+
+/*
+ * dispatch - Checks or runs a command with the builtin of its name
+ *
+ * @param cmd   The command and its arguments
+ * @param run   false to only check the arguments
+ *
+ * @return Exit status, 0 if only checked, -1 if there is no builtin for
+ * the command or its arguments
+ * */
+static int dispatch(char **cmd, bool run) {
+  for (size_t i = 0; i < sizeof builtins / sizeof *builtins; i++) {
+    if (strcmp(cmd[0], builtins[i].name) == 0) {
+      return builtins[i].run(cmd, run);
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * parse_opts - Reads the short options in front of the operands. Options
+ * end at "--" or at the first word not starting with '-', a lone "-" is an
+ * operand.
+ *
+ * @param cmd       The command and its arguments
+ * @param allowed   The option letters the builtin implements
+ * @param set       Filled with whether each allowed letter was given, in
+ *                  the order of allowed
+ * @param operands  Filled with the first operand
+ *
+ * @return 0 on success, -1 for any other option
+ * */
+static int parse_opts(char **cmd, const char *allowed, char *set,
+                      char ***operands) {
+  memset(set, 0, strlen(allowed));
+
+  char **arg = cmd + 1;
+  for (; *arg && (*arg)[0] == '-' && (*arg)[1] != '\0'; arg++) {
+    if (strcmp(*arg, "--") == 0) {
+      arg++;
+      break;
+    }
+    for (const char *c = *arg + 1; *c; c++) {
+      const char *opt = strchr(allowed, *c);
+      if (!opt) {
+        return -1;
+      }
+      set[opt - allowed] = 1;
+    }
+  }
+
+  *operands = arg;
+  return 0;
+}
+
+/*
+ * run_touch - touch [-c] FILE... Sets the times of files to now, creating
+ * them unless -c is given
+ *
+ * @param cmd   The command and its arguments
+ * @param run   false to only check the arguments
+ *
+ * @return Exit status, -1 to leave the command to the real touch
+ * */
+static int run_touch(char **cmd, bool run) {
+  char no_create;
+  char **files;
+  if (parse_opts(cmd, "c", &no_create, &files) != 0 || !files[0]) {
+    return -1;
+  }
+  if (!run) {
+    return 0;
+  }
+
+  int ret = 0;
+  for (; *files; files++) {
+    if (utimensat(AT_FDCWD, *files, NULL, 0) == 0) {
+      continue;
+    }
+    if (errno == ENOENT && no_create) {
+      continue;
+    }
+
+    int fd = -1;
+    if (errno == ENOENT) {
+      fd = open(*files, O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC, 0666);
+    }
+    if (fd == -1) {
+      fail("touch", "cannot touch", *files);
+      ret = FAILED;
+      continue;
+    }
+    close(fd);
+  }
+
+  return ret;
+}
+
+/*
+ * run_cp - cp [-f] SRC DST Copies a regular file. A new copy gets the mode
+ * of the source less the umask, an existing one keeps its mode.
+ *
+ * @param cmd   The command and its arguments
+ * @param run   false to only check the arguments
+ *
+ * @return Exit status, -1 to leave the command to the real cp
+ * */
+static int run_cp(char **cmd, bool run) {
+  char force;
+  char **files;
+  if (parse_opts(cmd, "f", &force, &files) != 0 || !files[0] || !files[1] ||
+      files[2]) {
+    return -1;
+  }
+
+  // Directories, devices and missing sources are left to cp
+  struct stat src;
+  struct stat dst;
+  if (stat(files[0], &src) != 0 || !S_ISREG(src.st_mode)) {
+    return -1;
+  }
+  // cp writes into an existing file, a copy renamed into place would not
+  // go through a symlink or reach the other names of a hard link
+  bool exists = lstat(files[1], &dst) == 0;
+  if (exists && (!S_ISREG(dst.st_mode) || dst.st_nlink > 1)) {
+    return -1;
+  }
+  if (!run) {
+    return 0;
+  }
+
+  if (exists && src.st_dev == dst.st_dev && src.st_ino == dst.st_ino) {
+    fprintf(stderr, "cp: '%s' and '%s' are the same file\n", files[0],
+            files[1]);
+    return FAILED;
+  }
+
+  if (copy_file(files[0], files[1]) != 0) {
+    fail("cp", "cannot create regular file", files[1]);
+    return FAILED;
+  }
+
+  mode_t mask = umask(0);
+  umask(mask);
+  mode_t mode = exists ? dst.st_mode : src.st_mode & ~mask;
+  if (chmod(files[1], mode & 07777) != 0) {
+    fail("cp", "cannot set permissions of", files[1]);
+    return FAILED;
+  }
+
+  return 0;
+}
+
+/*
+ * run_mkdir - mkdir [-p] DIR... Creates directories, with -p also their
+ * parents and without an error for those that exist
+ *
+ * @param cmd   The command and its arguments
+ * @param run   false to only check the arguments
+ *
+ * @return Exit status, -1 to leave the command to the real mkdir
+ * */
+static int run_mkdir(char **cmd, bool run) {
+  char parents;
+  char **dirs;
+  if (parse_opts(cmd, "p", &parents, &dirs) != 0 || !dirs[0]) {
+    return -1;
+  }
+  if (!run) {
+    return 0;
+  }
+
+  int ret = 0;
+  for (; *dirs; dirs++) {
+    if (parents ? make_dirs(*dirs) != 0 : mkdir(*dirs, 0777) != 0) {
+      fail("mkdir", "cannot create directory", *dirs);
+      ret = FAILED;
+    }
+  }
+
+  return ret;
+}
+
+/*
+ * make_dirs - Creates a directory and its missing parents
+ *
+ * @param path  Path of the directory, modified while running
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+static int make_dirs(char *path) {
+  if (path[0] == '\0') {
+    errno = ENOENT;
+    return -1;
+  }
+
+  struct stat st;
+  for (char *p = path + 1;; p++) {
+    if (*p != '/' && *p != '\0') {
+      continue;
+    }
+
+    char c = *p;
+    *p = '\0';
+    int ret = mkdir(path, 0777);
+    if (ret != 0 && errno == EEXIST && stat(path, &st) == 0 &&
+        !S_ISDIR(st.st_mode)) {
+      errno = c ? ENOTDIR : EEXIST;
+    } else if (ret != 0 && errno == EEXIST) {
+      ret = 0;
+    }
+    *p = c;
+
+    if (ret != 0) {
+      return -1;
+    }
+    if (c == '\0') {
+      return 0;
+    }
+  }
+}
+
+/*
+ * run_rm - rm [-f] FILE... Removes files. Without -f a missing file is an
+ * error.
+ *
+ * @param cmd   The command and its arguments
+ * @param run   false to only check the arguments
+ *
+ * @return Exit status, -1 to leave the command to the real rm
+ * */
+static int run_rm(char **cmd, bool run) {
+  char force;
+  char **files;
+  if (parse_opts(cmd, "f", &force, &files) != 0) {
+    return -1;
+  }
+
+  // rm asks before removing a write-protected file from a terminal
+  if (!force && isatty(STDIN_FILENO)) {
+    return -1;
+  }
+  if (!run) {
+    return 0;
+  }
+
+  if (!files[0]) {
+    if (force) {
+      return 0;
+    }
+    fprintf(stderr, "rm: missing operand\n");
+    return FAILED;
+  }
+
+  int ret = 0;
+  for (; *files; files++) {
+    if (unlink(*files) == 0 || (errno == ENOENT && force)) {
+      continue;
+    }
+    fail("rm", "cannot remove", *files);
+    ret = FAILED;
+  }
+
+  return ret;
+}
+
+/*
+ * run_echo - echo [-n] [ARG...] Writes the arguments separated by spaces,
+ * ending with a newline unless -n is given. A word that is not an option
+ * is written as it is.
+ *
+ * @param cmd   The command and its arguments
+ * @param run   false to only check the arguments
+ *
+ * @return Exit status, -1 to leave the command to the real echo
+ * */
+static int run_echo(char **cmd, bool run) {
+  bool newline = true;
+  char **arg = cmd + 1;
+  for (; *arg && (*arg)[0] == '-' && (*arg)[1] != '\0'; arg++) {
+    size_t n = strspn(*arg + 1, "neE");
+    if ((*arg)[1 + n] != '\0') {
+      break;
+    }
+    // Escapes are left to echo
+    if (strpbrk(*arg + 1, "eE")) {
+      return -1;
+    }
+    newline = false;
+  }
+  if (!run) {
+    return 0;
+  }
+
+  size_t len = 1;
+  for (char **a = arg; *a; a++) {
+    len += strlen(*a) + 1;
+  }
+  char *buf = malloc(len);
+  if (!buf) {
+    fprintf(stderr, "echo: %s\n", strerror(errno));
+    return FAILED;
+  }
+
+  // One write keeps the line together with the output of other jobs
+  size_t n = 0;
+  for (char **a = arg; *a; a++) {
+    if (a != arg) {
+      buf[n++] = ' ';
+    }
+    size_t l = strlen(*a);
+    memcpy(buf + n, *a, l);
+    n += l;
+  }
+  if (newline) {
+    buf[n++] = '\n';
+  }
+
+  int ret = 0;
+  for (size_t off = 0; off < n;) {
+    ssize_t w = write(STDOUT_FILENO, buf + off, n - off);
+    if (w == -1 && errno == EINTR) {
+      continue;
+    }
+    if (w == -1) {
+      fprintf(stderr, "echo: write error: %s\n", strerror(errno));
+      ret = FAILED;
+      break;
+    }
+    off += w;
+  }
+
+  free(buf);
+  return ret;
+}
+
+/*
+ * fail - Prints an error in the form of the coreutils commands
+ *
+ * @param cmd   Name of the command
+ * @param what  What failed
+ * @param path  The file it failed on
+ * */
+static void fail(const char *cmd, const char *what, const char *path) {
+  fprintf(stderr, "%s: %s '%s': %s\n", cmd, what, path, strerror(errno));
+}
@@ -0,0 +1,35 @@
+/**
+ * Builtin recipe commands. touch, cp, mkdir, rm and echo are run inside
+ * mmake when they only use options implemented here, with the messages and
+ * exit statuses of the coreutils versions. Anything else is left to the
+ * real command.
+ *
+ * @file builtin.h
+ */
+
+#ifndef BUILTIN_H
+#define BUILTIN_H
+
+#include <stdbool.h>
+
+/*
+ * builtin_handles - Checks whether a command runs in process
+ *
+ * @param cmd   NULL-terminated array with the command and its arguments
+ *
+ * @return true if builtin_run can run it, false if it has to be started as
+ * a process
+ * */
+bool builtin_handles(char **cmd);
+
+/*
+ * builtin_run - Runs a command in process
+ *
+ * @param cmd   NULL-terminated array with the command and its arguments,
+ *              which builtin_handles accepted
+ *
+ * @return Exit status of the command
+ * */
+int builtin_run(char **cmd);
+
+#endif
@@ -0,0 +1,280 @@
+#include "cache.h"
+#include "copy.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Entries live in DIR/kk/kkkkkkkkkkkkkk where k is the hex key
+#define KEY_HEX_LEN 16
+
+// Eviction trims the cache to this percentage of its limit
+#define EVICT_TARGET 90
+
+struct cache {
+  char *dir;
+  uint64_t max_size;
+  unsigned long hits;
+  unsigned long misses;
+  bool stored; // Set when this run added entries
+};
+
+struct cache_entry {
+  char *path;
+  time_t atime; // Time of last use, kept in the entry's mtime
+  off_t size;
+};
+
+static char *entry_path(cache *c, uint64_t key, bool create_dir);
+static int link_or_copy(const char *src, const char *dst);
+static void evict(cache *c);
+static int cmp_entry(const void *a, const void *b);
+
+cache *cache_open(const char *dir, uint64_t max_size) {
+  if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+    perror(dir);
+    return NULL;
+  }
+
+  cache *c = calloc(1, sizeof *c);
+  if (!c || !(c->dir = strdup(dir))) {
+    perror("malloc");
+    free(c);
+    return NULL;
+  }
+  c->max_size = max_size;
+
+  return c;
+}
+
+void cache_close(cache *c, bool report) {
+  if (!c) {
+    return;
+  }
+
+  if (c->stored) {
+    evict(c);
+  }
+
+  if (report && c->hits + c->misses > 0) {
+    fprintf(stderr, "mmake: cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+            c->hits, c->misses, 100.0 * c->hits / (c->hits + c->misses));
+  }
+
+  free(c->dir);
+  free(c);
+}
+
+bool cache_restore(cache *c, uint64_t key, const char *target) {
+  char *path = entry_path(c, key, false);
+  if (!path) {
+    return false;
+  }
+
+  bool hit = link_or_copy(path, target) == 0;
+  if (hit) {
+    // Newer than the inputs, and most recently used. With a hard link this
+    // also updates the entry itself.
+    utimensat(AT_FDCWD, target, NULL, 0);
+    utimensat(AT_FDCWD, path, NULL, 0);
+    c->hits++;
+  } else {
+    c->misses++;
+  }
+
+  free(path);
+  return hit;
+}
+
+int cache_store(cache *c, uint64_t key, const char *target) {
+  char *path = entry_path(c, key, true);
+  if (!path) {
+    return -1;
+  }
+
+  // Always a real copy, the target may still be written to by the user
+  int status = copy_file(target, path);
+  if (status != 0) {
+    fprintf(stderr, "mmake: cache: could not store '%s': %s\n", target,
+            strerror(errno));
+  } else {
+    c->stored = true;
+  }
+
+  free(path);
+  return status;
+}
+
+void cache_unshare(const char *target) {
+  struct stat st;
+  if (lstat(target, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+    unlink(target);
+  }
+}
+
+/*
+ * entry_path - Builds the path of the entry for a key
+ *
+ * @param c             The cache
+ * @param key           The key
+ * @param create_dir    Create the subdirectory of the entry if missing
+ *
+ * @return Allocated path, NULL on failure
+ * */
+static char *entry_path(cache *c, uint64_t key, bool create_dir) {
+  size_t len = strlen(c->dir) + KEY_HEX_LEN + 3;
+  char *path = malloc(len);
+  if (!path) {
+    return NULL;
+  }
+
+  char hex[KEY_HEX_LEN + 1];
+  snprintf(hex, sizeof hex, "%016llx", (unsigned long long)key);
+  snprintf(path, len, "%s/%.2s", c->dir, hex);
+
+  if (create_dir && mkdir(path, 0777) == -1 && errno != EEXIST) {
+    free(path);
+    return NULL;
+  }
+
+  snprintf(path, len, "%s/%.2s/%s", c->dir, hex, hex + 2);
+  return path;
+}
+
+/*
+ * link_or_copy - Puts a cache entry at the path of a target. A reflink keeps
+ * the entry independent of the target, a hard link is the next best thing
+ * and a copy is the last resort.
+ *
+ * @param src   Path of the entry
+ * @param dst   Path of the target
+ *
+ * @return 0 on success, -1 if the entry does not exist or can't be used
+ * */
+static int link_or_copy(const char *src, const char *dst) {
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    return -1;
+  }
+
+  struct stat st;
+  int status = -1;
+  if (fstat(in, &st) == 0) {
+    unlink(dst);
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                   st.st_mode & 07777);
+    if (out != -1) {
+      status = ioctl(out, FICLONE, in);
+      close(out);
+      if (status != 0) {
+        unlink(dst);
+      }
+    }
+  }
+  close(in);
+
+  if (status == 0 || link(src, dst) == 0) {
+    return 0;
+  }
+
+  return copy_file(src, dst);
+}
+
+/*
+ * evict - Removes the least recently used entries until the cache is below
+ * EVICT_TARGET percent of its limit. Runs once per build, after all entries
+ * of the build have been stored.
+ *
+ * @param c     The cache
+ * */
+static void evict(cache *c) {
+  struct cache_entry *entries = NULL;
+  size_t n = 0, cap = 0;
+  bool full = false; // Out of memory, evict from what was listed so far
+  uint64_t total = 0;
+
+  DIR *top = opendir(c->dir);
+  if (!top) {
+    return;
+  }
+
+  struct dirent *d;
+  while (!full && (d = readdir(top)) != NULL) {
+    if (strlen(d->d_name) != 2 || d->d_name[0] == '.') {
+      continue;
+    }
+
+    size_t sub_len = strlen(c->dir) + 4;
+    char *sub = malloc(sub_len);
+    if (!sub) {
+      continue;
+    }
+    snprintf(sub, sub_len, "%s/%s", c->dir, d->d_name);
+
+    DIR *dir = opendir(sub);
+    struct dirent *e;
+    while (dir && (e = readdir(dir)) != NULL) {
+      struct stat st;
+      // Skip temporary files of stores that are still in progress
+      if (strlen(e->d_name) != KEY_HEX_LEN - 2 ||
+          fstatat(dirfd(dir), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+          !S_ISREG(st.st_mode)) {
+        continue;
+      }
+
+      if (n == cap) {
+        size_t new_cap = cap ? cap * 2 : 1024;
+        struct cache_entry *tmp = realloc(entries, new_cap * sizeof *entries);
+        if (!tmp) {
+          full = true;
+          break;
+        }
+        entries = tmp;
+        cap = new_cap;
+      }
+
+      size_t len = sub_len + strlen(e->d_name) + 1;
+      if (!(entries[n].path = malloc(len))) {
+        full = true;
+        break;
+      }
+      snprintf(entries[n].path, len, "%s/%s", sub, e->d_name);
+      entries[n].atime = st.st_mtime;
+      entries[n].size = st.st_blocks * 512;
+      total += entries[n].size;
+      n++;
+    }
+    if (dir) {
+      closedir(dir);
+    }
+    free(sub);
+  }
+  closedir(top);
+
+  if (total > c->max_size) {
+    qsort(entries, n, sizeof *entries, cmp_entry);
+
+    uint64_t goal = c->max_size / 100 * EVICT_TARGET;
+    for (size_t i = 0; i < n && total > goal; i++) {
+      if (unlink(entries[i].path) == 0) {
+        total -= entries[i].size;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    free(entries[i].path);
+  }
+  free(entries);
+}
+
+static int cmp_entry(const void *a, const void *b) {
+  const struct cache_entry *x = a, *y = b;
+  return (x->atime > y->atime) - (x->atime < y->atime);
+}
@@ -0,0 +1,72 @@
+/**
+ * Local content-addressed action cache. Targets are stored under a key that
+ * identifies the command and the inputs they were built from, and restored
+ * on a later build with the same key instead of running the recipe. The
+ * cache directory may be shared between machines, entries are published
+ * with an atomic rename.
+ *
+ * @file cache.h
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CACHE_DEFAULT_SIZE (1ULL << 30)
+
+typedef struct cache cache;
+
+/*
+ * cache_open - Opens a cache directory, creating it if needed
+ *
+ * @param dir         Path of the cache directory
+ * @param max_size    Size in bytes the cache is trimmed to on close
+ *
+ * @return Pointer to the cache or NULL on failure
+ * */
+cache *cache_open(const char *dir, uint64_t max_size);
+
+/*
+ * cache_close - Evicts the least recently used entries if the cache has
+ * grown past its size limit and frees the cache
+ *
+ * @param c         The cache
+ * @param report    Print hit and miss counts of this run to stderr
+ * */
+void cache_close(cache *c, bool report);
+
+/*
+ * cache_restore - Restores a target from the cache. A reflink or hard link
+ * is used if the filesystem allows it, otherwise the entry is copied. The
+ * restored target gets the current time as its mtime.
+ *
+ * @param c         The cache
+ * @param key       Key of the action that builds the target
+ * @param target    Path of the target
+ *
+ * @return true on a hit, false if the target has to be built
+ * */
+bool cache_restore(cache *c, uint64_t key, const char *target);
+
+/*
+ * cache_store - Stores a freshly built target under a key
+ *
+ * @param c         The cache
+ * @param key       Key of the action that built the target
+ * @param target    Path of the target
+ *
+ * @return 0 on success, -1 on failure
+ * */
+int cache_store(cache *c, uint64_t key, const char *target);
+
+/*
+ * cache_unshare - Removes a target that is hard linked to a cache entry, so
+ * that a recipe writing to it in place can not modify the entry
+ *
+ * @param target    Path of the target
+ * */
+void cache_unshare(const char *target);
+
+#endif
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Most bytes moved by one splice or sendfile call
+#define CHUNK (1 << 16)
+
+struct capture {
+  int rd; // Read end of the pipe, -1 at its end
+  int wr; // Write end until the job started, -1 after
+  char *head; // Command line with its newline
+  size_t head_len;
+  char *buf; // Output before any spill
+  size_t len;
+  size_t cap;
+  int spill; // Temporary file for the rest of the output, -1 if none
+};
+
+static int open_spill(void);
+static int spill_read(capture *c);
+static int write_all(int fd, struct iovec *iov, int n);
+static int copy_spill(int src, int fd);
+
+capture *capture_new(char **cmd) {
+  capture *c = calloc(1, sizeof *c);
+  if (!c) {
+    return NULL;
+  }
+  c->spill = -1;
+
+  size_t len = 0;
+  for (size_t i = 0; cmd && cmd[i] != NULL; i++) {
+    len += strlen(cmd[i]) + 1;
+  }
+  if (len > 0 && !(c->head = malloc(len))) {
+    free(c);
+    return NULL;
+  }
+  for (size_t i = 0; cmd && cmd[i] != NULL; i++) {
+    size_t l = strlen(cmd[i]);
+    memcpy(c->head + c->head_len, cmd[i], l);
+    c->head_len += l;
+    c->head[c->head_len++] = cmd[i + 1] != NULL ? ' ' : '\n';
+  }
+
+  // Only mmake's end must not block, the job writes as usual
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    free(c->head);
+    free(c);
+    return NULL;
+  }
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  c->rd = fds[0];
+  c->wr = fds[1];
+
+  return c;
+}
+
+int capture_job_fd(const capture *c) { return c->wr; }
+
+void capture_started(capture *c) {
+  if (c->wr != -1) {
+    close(c->wr);
+    c->wr = -1;
+  }
+}
+
+int capture_fd(const capture *c) { return c->rd; }
+
+int capture_read(capture *c) {
+  while (c->rd != -1) {
+    if (c->spill != -1) {
+      return spill_read(c);
+    }
+
+    if (c->len == c->cap) {
+      if (c->cap >= CAPTURE_MEM_LIMIT) {
+        if ((c->spill = open_spill()) == -1) {
+          return -1;
+        }
+        continue;
+      }
+      size_t cap = c->cap ? 2 * c->cap : 4096;
+      char *buf = realloc(c->buf, cap);
+      if (!buf) {
+        return -1;
+      }
+      c->buf = buf;
+      c->cap = cap;
+    }
+
+    ssize_t n = read(c->rd, c->buf + c->len, c->cap - c->len);
+    if (n > 0) {
+      c->len += n;
+    } else if (n == 0) {
+      close(c->rd);
+      c->rd = -1;
+    } else if (errno == EAGAIN) {
+      return 0;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int capture_write(capture *c, int fd) {
+  struct iovec iov[] = {
+      {.iov_base = c->head, .iov_len = c->head_len},
+      {.iov_base = c->buf, .iov_len = c->len},
+  };
+
+  if (write_all(fd, iov, 2) != 0) {
+    return -1;
+  }
+  return c->spill != -1 ? copy_spill(c->spill, fd) : 0;
+}
+
+void capture_del(capture *c) {
+  if (!c) {
+    return;
+  }
+
+  if (c->rd != -1) {
+    close(c->rd);
+  }
+  if (c->wr != -1) {
+    close(c->wr);
+  }
+  if (c->spill != -1) {
+    close(c->spill);
+  }
+  free(c->head);
+  free(c->buf);
+  free(c);
+}
+
+/*
+ * open_spill - Creates an unnamed temporary file in TMPDIR or /tmp
+ *
+ * @return Descriptor of the file, -1 with errno set on failure
+ * */
+static int open_spill(void) {
+  const char *dir = getenv("TMPDIR");
+  if (!dir || !*dir) {
+    dir = "/tmp";
+  }
+
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR)) {
+    return fd;
+  }
+
+  // Filesystems without O_TMPFILE get a file that is removed at once
+  char path[4096];
+  if (snprintf(path, sizeof path, "%s/mmake.XXXXXX", dir) >=
+      (int)sizeof path) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if ((fd = mkostemp(path, O_CLOEXEC)) != -1) {
+    unlink(path);
+  }
+  return fd;
+}
+
+/*
+ * spill_read - Moves the output in the pipe to the temporary file. splice
+ * keeps the data in the kernel, read and write are used where the file
+ * does not support it.
+ *
+ * @param c     The capture, spilling
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+static int spill_read(capture *c) {
+  char buf[4096];
+  bool use_splice = true;
+
+  while (c->rd != -1) {
+    ssize_t n = use_splice ? splice(c->rd, NULL, c->spill, NULL, CHUNK,
+                                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+                           : read(c->rd, buf, sizeof buf);
+    if (n == -1 && errno == EINVAL && use_splice) {
+      use_splice = false;
+      continue;
+    }
+    if (n > 0 && !use_splice) {
+      struct iovec iov = {.iov_base = buf, .iov_len = n};
+      if (write_all(c->spill, &iov, 1) != 0) {
+        return -1;
+      }
+    } else if (n == 0) {
+      close(c->rd);
+      c->rd = -1;
+    } else if (n == -1 && errno == EAGAIN) {
+      return 0;
+    } else if (n == -1 && errno != EINTR) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * write_all - Writes a vector of buffers, continuing after short writes
+ *
+ * @param fd    Where to write
+ * @param iov   The buffers, modified while writing
+ * @param n     Number of buffers
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+static int write_all(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    if (iov->iov_len == 0) {
+      iov++;
+      n--;
+      continue;
+    }
+
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1 && errno == EINTR) {
+      continue;
+    }
+    if (w == -1) {
+      return -1;
+    }
+
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * copy_spill - Writes the whole temporary file, with sendfile where the
+ * destination allows it
+ *
+ * @param src   The temporary file
+ * @param fd    Where to write
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+static int copy_spill(int src, int fd) {
+  off_t off = 0;
+  char buf[4096];
+
+  while (true) {
+    ssize_t n = sendfile(fd, src, &off, CHUNK);
+    if (n == 0) {
+      return 0;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno != EINVAL && errno != ENOSYS) {
+      return -1;
+    }
+    if (n == -1) {
+      break;
+    }
+  }
+
+  while (true) {
+    ssize_t n = pread(src, buf, sizeof buf, off);
+    if (n == 0) {
+      return 0;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return -1;
+    }
+    struct iovec iov = {.iov_base = buf, .iov_len = n};
+    if (write_all(fd, &iov, 1) != 0) {
+      return -1;
+    }
+    off += n;
+  }
+}
@@ -0,0 +1,85 @@
+/**
+ * Capture of the output of a job. The job writes stdout and stderr into a
+ * pipe. Its output is kept in memory, or once it grows past
+ * CAPTURE_MEM_LIMIT moved on to a temporary file, and is written out as one
+ * block when the job is done, so the output of parallel jobs does not mix.
+ *
+ * @file capture.h
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+
+// Output a capture keeps in memory before it spills to a temporary file
+#define CAPTURE_MEM_LIMIT (1 << 20)
+
+typedef struct capture capture;
+
+/*
+ * capture_new - Creates the pipe for the output of a job
+ *
+ * @param cmd   Command line written at the start of the block, NULL for
+ *              none
+ *
+ * @return Pointer to the capture, NULL with errno set on failure
+ * */
+capture *capture_new(char **cmd);
+
+/*
+ * capture_job_fd - Gets the descriptor the job writes to, to pass to
+ * launch_cmd
+ *
+ * @param c     The capture
+ *
+ * @return The write end of the pipe
+ * */
+int capture_job_fd(const capture *c);
+
+/*
+ * capture_started - Closes mmake's copy of the write end once the job has
+ * its own, so the pipe ends when the job does
+ *
+ * @param c     The capture
+ * */
+void capture_started(capture *c);
+
+/*
+ * capture_fd - Gets the descriptor to poll for output of the job
+ *
+ * @param c     The capture
+ *
+ * @return The read end of the pipe, -1 once it reached its end
+ * */
+int capture_fd(const capture *c);
+
+/*
+ * capture_read - Takes the output that is in the pipe without waiting for
+ * more
+ *
+ * @param c     The capture
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+int capture_read(capture *c);
+
+/*
+ * capture_write - Writes the command line and everything captured as one
+ * block
+ *
+ * @param c     The capture, read to the end of the output of its job
+ * @param fd    Where to write
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+int capture_write(capture *c, int fd);
+
+/*
+ * capture_del - Closes the pipe and frees the captured output
+ *
+ * @param c     The capture, may be NULL
+ * */
+void capture_del(capture *c);
+
+#endif
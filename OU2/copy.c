@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include "copy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COPY_CHUNK (1 << 20)
+
+static int copy_fd(int in, int out, off_t size);
+
+int copy_file(const char *src, const char *dst) {
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(in, &st) == -1) {
+    close(in);
+    return -1;
+  }
+
+  size_t tmp_len = strlen(dst) + 8;
+  char *tmp = malloc(tmp_len);
+  if (!tmp) {
+    close(in);
+    return -1;
+  }
+  snprintf(tmp, tmp_len, "%s.XXXXXX", dst);
+
+  // mkostemp gives a unique name even when the directory is shared
+  int out = mkostemp(tmp, O_CLOEXEC);
+  int status = -1;
+
+  if (out != -1) {
+    fchmod(out, st.st_mode & 07777);
+
+    // Share the blocks if the filesystem supports it, copy otherwise
+    if (ioctl(out, FICLONE, in) == 0 || copy_fd(in, out, st.st_size) == 0) {
+      status = 0;
+    }
+    if (close(out) == -1) {
+      status = -1;
+    }
+    if (status == 0 && rename(tmp, dst) == -1) {
+      status = -1;
+    }
+    if (status != 0) {
+      int saved = errno;
+      unlink(tmp);
+      errno = saved;
+    }
+  }
+
+  close(in);
+  free(tmp);
+
+  return status;
+}
+
+/*
+ * copy_fd - Copies the contents of one file to another, inside the kernel
+ * when possible
+ *
+ * @param in      File to read from, at offset 0
+ * @param out     File to write to, at offset 0
+ * @param size    Size of the input file
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int copy_fd(int in, int out, off_t size) {
+  off_t done = 0;
+
+  while (done < size) {
+    ssize_t n = copy_file_range(in, NULL, out, NULL, size - done, 0);
+    if (n == -1) {
+      // Not supported between these files, fall back to read/write
+      if (done == 0 && (errno == EXDEV || errno == ENOSYS ||
+                        errno == EINVAL || errno == EOPNOTSUPP)) {
+        break;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    done += n;
+  }
+
+  if (done >= size) {
+    return 0;
+  }
+
+  char *buf = malloc(COPY_CHUNK);
+  if (!buf) {
+    return -1;
+  }
+
+  ssize_t n;
+  while ((n = read(in, buf, COPY_CHUNK)) > 0) {
+    for (ssize_t off = 0; off < n;) {
+      ssize_t w = write(out, buf + off, n - off);
+      if (w == -1) {
+        free(buf);
+        return -1;
+      }
+      off += w;
+    }
+  }
+  free(buf);
+
+  return n == 0 ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+/**
+ * File copying that lets the filesystem share data blocks when it can.
+ *
+ * @file copy.h
+ */
+
+#ifndef COPY_H
+#define COPY_H
+
+/*
+ * copy_file - Copies the contents and permission bits of a file. The copy is
+ * written to a temporary file next to dst and renamed into place, so readers
+ * never see a partial file. A reflink is tried first, then copy_file_range,
+ * and last a plain read/write loop.
+ *
+ * @param src   Path of the file to copy
+ * @param dst   Path of the copy, replaced if it exists
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+int copy_file(const char *src, const char *dst);
+
+#endif
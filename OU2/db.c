@@ -0,0 +1,489 @@
+#include "db.h"
+#include "hash.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * The log starts with a header of DB_MAGIC followed by a version number.
+ * Each record is a kind byte, the key length and value length as 32-bit
+ * integers in host byte order, then the key and value bytes. A later record
+ * for the same kind and key replaces an earlier one.
+ */
+#define DB_MAGIC "MMDB"
+#define DB_VERSION 1
+#define HEADER_LEN 8
+#define RECORD_HEAD 9
+
+// Compact when the log is this many times larger than the live records
+#define COMPACT_RATIO 3
+#define COMPACT_MIN 1024
+
+struct record {
+  char *key; // NULL marks an empty slot
+  void *val;
+  uint32_t key_len;
+  uint32_t val_len;
+  uint64_t hash;
+  uint8_t kind;
+};
+
+struct db {
+  char *path;
+  int fd; // Log opened for appending, -1 until the first write
+  struct record *records;
+  size_t cap;
+  size_t size;
+  size_t n_logged; // Records in the log, including overwritten ones
+};
+
+static struct record *find_slot(struct record *records, size_t cap,
+                                uint8_t kind, const char *key, uint32_t key_len,
+                                uint64_t hash);
+static int grow(db *d);
+static int insert(db *d, uint8_t kind, const char *key, uint32_t key_len,
+                  const void *val, uint32_t val_len);
+static int load(db *d, const char *data, size_t len, size_t *end);
+static void repair(db *d, int fd, const struct stat *read, size_t end);
+static int open_log(db *d);
+static int write_header(int fd);
+static int write_record(int fd, const struct record *r);
+static int compact(db *d);
+static uint64_t key_hash(uint8_t kind, const char *key, uint32_t key_len);
+
+db *db_open(const char *path) {
+  db *d = calloc(1, sizeof *d);
+  if (!d) {
+    return NULL;
+  }
+
+  d->fd = -1;
+  d->cap = 256;
+  d->path = strdup(path);
+  d->records = calloc(d->cap, sizeof *d->records);
+  if (!d->path || !d->records) {
+    free(d->path);
+    free(d->records);
+    free(d);
+    return NULL;
+  }
+
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    if (errno == ENOENT) {
+      return d;
+    }
+    db_close(d);
+    return NULL;
+  }
+
+  // Read the whole log in one go, it is parsed in place. The shared lock
+  // keeps compact from replacing it meanwhile.
+  struct stat st;
+  char *data = NULL;
+  if (flock(fileno(fp), LOCK_SH) == 0 && fstat(fileno(fp), &st) == 0 &&
+      (data = malloc(st.st_size + 1)) &&
+      fread(data, 1, st.st_size, fp) == (size_t)st.st_size) {
+    size_t end;
+    if (load(d, data, st.st_size, &end) != 0) {
+      fprintf(stderr, "mmake: %s: ignoring damaged build database\n", path);
+    }
+    if (end != (size_t)st.st_size) {
+      repair(d, fileno(fp), &st, end);
+    }
+  }
+  free(data);
+  fclose(fp);
+
+  return d;
+}
+
+int db_close(db *d) {
+  if (!d) {
+    return 0;
+  }
+
+  int status = 0;
+  if (d->n_logged > COMPACT_MIN && d->n_logged > COMPACT_RATIO * d->size) {
+    status = compact(d);
+  }
+
+  if (d->fd != -1 && close(d->fd) == -1) {
+    status = -1;
+  }
+
+  for (size_t i = 0; i < d->cap; i++) {
+    free(d->records[i].key);
+    free(d->records[i].val);
+  }
+  free(d->records);
+  free(d->path);
+  free(d);
+
+  return status;
+}
+
+const void *db_get(db *d, enum db_kind kind, const char *key, size_t *len) {
+  uint32_t key_len = strlen(key);
+  struct record *r = find_slot(d->records, d->cap, kind, key, key_len,
+                               key_hash(kind, key, key_len));
+  if (!r->key) {
+    return NULL;
+  }
+
+  if (len) {
+    *len = r->val_len;
+  }
+  return r->val;
+}
+
+int db_put(db *d, enum db_kind kind, const char *key, const void *val,
+           size_t len) {
+  uint32_t key_len = strlen(key);
+  struct record *r = find_slot(d->records, d->cap, kind, key, key_len,
+                               key_hash(kind, key, key_len));
+
+  if (r->key && r->val_len == len && memcmp(r->val, val, len) == 0) {
+    return 0;
+  }
+
+  if (insert(d, kind, key, key_len, val, len) != 0) {
+    return -1;
+  }
+
+  if (d->fd == -1 && open_log(d) != 0) {
+    return -1;
+  }
+
+  r = find_slot(d->records, d->cap, kind, key, key_len,
+                key_hash(kind, key, key_len));
+  if (write_record(d->fd, r) != 0) {
+    return -1;
+  }
+  d->n_logged++;
+
+  return 0;
+}
+
+/*
+ * find_slot - Finds the slot of a record, or the empty slot where it would
+ * be inserted
+ *
+ * @return Pointer to the slot
+ * */
+static struct record *find_slot(struct record *records, size_t cap,
+                                uint8_t kind, const char *key, uint32_t key_len,
+                                uint64_t hash) {
+  size_t mask = cap - 1;
+  size_t i = hash & mask;
+
+  while (records[i].key &&
+         (records[i].hash != hash || records[i].kind != kind ||
+          records[i].key_len != key_len ||
+          memcmp(records[i].key, key, key_len) != 0)) {
+    i = (i + 1) & mask;
+  }
+
+  return &records[i];
+}
+
+/*
+ * grow - Doubles the size of the table and rehashes all records
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int grow(db *d) {
+  size_t cap = d->cap * 2;
+  struct record *records = calloc(cap, sizeof *records);
+  if (!records) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < d->cap; i++) {
+    struct record *r = &d->records[i];
+    if (r->key) {
+      *find_slot(records, cap, r->kind, r->key, r->key_len, r->hash) = *r;
+    }
+  }
+
+  free(d->records);
+  d->records = records;
+  d->cap = cap;
+
+  return 0;
+}
+
+/*
+ * insert - Inserts or replaces a record in memory only
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int insert(db *d, uint8_t kind, const char *key, uint32_t key_len,
+                  const void *val, uint32_t val_len) {
+  uint64_t hash = key_hash(kind, key, key_len);
+  struct record *r = find_slot(d->records, d->cap, kind, key, key_len, hash);
+
+  if (!r->key) {
+    if (2 * (d->size + 1) > d->cap) {
+      if (grow(d) != 0) {
+        return -1;
+      }
+      r = find_slot(d->records, d->cap, kind, key, key_len, hash);
+    }
+
+    // Keys are stored NUL-terminated so they can be used as strings
+    r->key = malloc(key_len + 1);
+    if (!r->key) {
+      return -1;
+    }
+    memcpy(r->key, key, key_len);
+    r->key[key_len] = '\0';
+    r->key_len = key_len;
+    r->hash = hash;
+    r->kind = kind;
+    r->val = NULL;
+    d->size++;
+  }
+
+  void *copy = malloc(val_len ? val_len : 1);
+  if (!copy) {
+    return -1;
+  }
+  memcpy(copy, val, val_len);
+  free(r->val);
+  r->val = copy;
+  r->val_len = val_len;
+
+  return 0;
+}
+
+/*
+ * load - Replays a log into the in-memory table. A truncated last record,
+ * left by an interrupted write, is dropped.
+ *
+ * @param d       The database
+ * @param data    Contents of the log
+ * @param len     Length of data
+ * @param end     Filled with the length of the log to keep: after the last
+ *                whole record, 0 if the log is not a database of this
+ *                version, len if a record could not be stored
+ *
+ * @return 0 on success, -1 if the log is not a database of this version or
+ * a record could not be stored
+ * */
+static int load(db *d, const char *data, size_t len, size_t *end) {
+  uint32_t version;
+
+  *end = 0;
+  if (len < HEADER_LEN || memcmp(data, DB_MAGIC, 4) != 0) {
+    return -1;
+  }
+  memcpy(&version, data + 4, sizeof version);
+  if (version != DB_VERSION) {
+    return -1;
+  }
+
+  size_t pos = HEADER_LEN;
+  while (pos + RECORD_HEAD <= len) {
+    uint8_t kind = data[pos];
+    uint32_t key_len, val_len;
+    memcpy(&key_len, data + pos + 1, sizeof key_len);
+    memcpy(&val_len, data + pos + 5, sizeof val_len);
+
+    if (len - pos - RECORD_HEAD < (uint64_t)key_len + val_len) {
+      break;
+    }
+
+    const char *key = data + pos + RECORD_HEAD;
+    if (insert(d, kind, key, key_len, key + key_len, val_len) != 0) {
+      *end = len;
+      return -1;
+    }
+
+    pos += RECORD_HEAD + key_len + val_len;
+    d->n_logged++;
+  }
+
+  *end = pos;
+  return 0;
+}
+
+/*
+ * repair - Cuts the log back to the part load kept, so appends continue
+ * after the last whole record or a new header is written. The log is only
+ * cut under an exclusive lock, which fails while another mmake has it open
+ * and may still be writing to it, and only if it is the file that was read
+ * and has the same size.
+ *
+ * @param d       The database
+ * @param fd      The log as it was read, locked shared
+ * @param read    Stat data of the log when it was read
+ * @param end     Length to keep
+ * */
+static void repair(db *d, int fd, const struct stat *read, size_t end) {
+  struct stat st, path_st;
+
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &st) == -1 ||
+      stat(d->path, &path_st) == -1 || st.st_size != read->st_size ||
+      st.st_dev != path_st.st_dev || st.st_ino != path_st.st_ino) {
+    return;
+  }
+
+  if (truncate(d->path, end) == -1) {
+    perror(d->path);
+  }
+}
+
+/*
+ * open_log - Opens the log for appending, writing the header if the file is
+ * new or empty. The log stays locked shared while it is open, so compact
+ * can tell that no other mmake appends to it. A log that compact replaced
+ * while this waited for the lock is opened again.
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int open_log(db *d) {
+  struct stat st, path_st;
+
+  while (true) {
+    d->fd = open(d->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (d->fd == -1) {
+      perror(d->path);
+      return -1;
+    }
+    if (flock(d->fd, LOCK_SH) == -1 || fstat(d->fd, &st) == -1 ||
+        stat(d->path, &path_st) == -1) {
+      perror(d->path);
+      return -1;
+    }
+    if (st.st_dev == path_st.st_dev && st.st_ino == path_st.st_ino) {
+      break;
+    }
+    close(d->fd);
+  }
+
+  if (st.st_size >= HEADER_LEN) {
+    return 0;
+  }
+
+  // Only one of several new writers may write the header
+  if (flock(d->fd, LOCK_EX) == -1 || fstat(d->fd, &st) == -1 ||
+      (st.st_size < HEADER_LEN &&
+       (ftruncate(d->fd, 0) == -1 || write_header(d->fd) != 0)) ||
+      flock(d->fd, LOCK_SH) == -1) {
+    perror(d->path);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * write_header - Writes the header of a log at its current offset
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int write_header(int fd) {
+  char header[HEADER_LEN] = DB_MAGIC;
+  uint32_t version = DB_VERSION;
+  memcpy(header + 4, &version, sizeof version);
+
+  return write(fd, header, HEADER_LEN) == HEADER_LEN ? 0 : -1;
+}
+
+/*
+ * write_record - Appends one record with a single write
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int write_record(int fd, const struct record *r) {
+  char head[RECORD_HEAD];
+  head[0] = r->kind;
+  memcpy(head + 1, &r->key_len, sizeof r->key_len);
+  memcpy(head + 5, &r->val_len, sizeof r->val_len);
+
+  struct iovec iov[3] = {
+      {head, RECORD_HEAD},
+      {r->key, r->key_len},
+      {r->val, r->val_len},
+  };
+  ssize_t total = RECORD_HEAD + r->key_len + r->val_len;
+
+  if (writev(fd, iov, 3) != total) {
+    perror("mmake: build database");
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * compact - Rewrites the log with only the live records. The new log is
+ * written to a temporary file and renamed over the old one, so a crash
+ * leaves either the old or the new log. It is skipped while another mmake
+ * has the log open, as its appends would go to the replaced file.
+ *
+ * @return 0 on success or when skipped, -1 on failure
+ * */
+static int compact(db *d) {
+  int lock = d->fd != -1 ? d->fd : open(d->path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (lock == -1 || flock(lock, LOCK_EX | LOCK_NB) == -1 ||
+      fstat(lock, &st) == -1) {
+    if (lock != -1 && lock != d->fd) {
+      close(lock);
+    }
+    return 0;
+  }
+
+  int status = -1;
+  size_t tmp_len = strlen(d->path) + 8;
+  char *tmp = malloc(tmp_len);
+  int fd = -1;
+  if (tmp) {
+    snprintf(tmp, tmp_len, "%s.XXXXXX", d->path);
+    fd = mkstemp(tmp);
+  }
+
+  // The new log keeps the mode of the old one rather than that of mkstemp
+  if (fd != -1 && fchmod(fd, st.st_mode & 07777) == 0) {
+    status = write_header(fd);
+  }
+  for (size_t i = 0; status == 0 && i < d->cap; i++) {
+    if (d->records[i].key) {
+      status = write_record(fd, &d->records[i]);
+    }
+  }
+
+  if (fd != -1 && close(fd) == -1) {
+    status = -1;
+  }
+  if (status == 0 && rename(tmp, d->path) == -1) {
+    status = -1;
+  }
+  if (status != 0) {
+    perror(d->path);
+    if (fd != -1) {
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+
+  // The lock on the log of this database goes when db_close closes it
+  if (lock != d->fd) {
+    close(lock);
+  }
+
+  return status;
+}
+
+static uint64_t key_hash(uint8_t kind, const char *key, uint32_t key_len) {
+  return hash_bytes(key, key_len, kind);
+}
@@ -0,0 +1,76 @@
+/**
+ * Persistent build database. Records are kept in memory in a hash table and
+ * appended to a log file as they change. When the log holds many overwritten
+ * records it is compacted on close.
+ *
+ * @file db.h
+ */
+
+#ifndef DB_H
+#define DB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DB_FILE ".mmake_db"
+
+typedef struct db db;
+
+enum db_kind {
+  DB_FILE_HASH = 1,   // Content hash of a file with the stat data it had
+  DB_FINGERPRINT = 2, // Fingerprint of the inputs a target was built from
+  DB_DURATION = 3,    // Microseconds the recipe of a target takes
+  DB_RESTAT = 4,      // Effective mtimes of a target whose contents a
+                      // recipe left unchanged
+  DB_DEPS = 5,        // Prerequisites the depfile of a target listed, each
+                      // followed by a NUL
+};
+
+/*
+ * db_open - Loads a database from its log file. A missing file gives an
+ * empty database, the file is then created on the first db_put.
+ *
+ * @param path    Path of the log file
+ *
+ * @return Pointer to the database or NULL on failure
+ * */
+db *db_open(const char *path);
+
+/*
+ * db_close - Compacts the log if needed and frees the database
+ *
+ * @param d   The database
+ *
+ * @return 0 on success, -1 if the log could not be written
+ * */
+int db_close(db *d);
+
+/*
+ * db_get - Looks up a record
+ *
+ * @param d       The database
+ * @param kind    Kind of record
+ * @param key     Key of the record
+ * @param len     Filled with the length of the value, may be NULL
+ *
+ * @return Pointer to the value, valid until the next db_put, or NULL if
+ * there is no such record
+ * */
+const void *db_get(db *d, enum db_kind kind, const char *key, size_t *len);
+
+/*
+ * db_put - Inserts or replaces a record and appends it to the log. Storing
+ * the value a record already has does nothing.
+ *
+ * @param d       The database
+ * @param kind    Kind of record
+ * @param key     Key of the record
+ * @param val     The value
+ * @param len     Length of the value
+ *
+ * @return 0 on success, -1 on failure
+ * */
+int db_put(db *d, enum db_kind kind, const char *key, const void *val,
+           size_t len);
+
+#endif
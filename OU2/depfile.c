@@ -0,0 +1,117 @@
+#include "depfile.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+static char *read_all(const char *path, size_t *len);
+static bool is_space(char c);
+
+char *depfile_load(const char *path, size_t *len) {
+  size_t n;
+  char *buf = read_all(path, &n);
+  if (!buf) {
+    return NULL;
+  }
+
+  // Unescaping only shrinks the text and every word gives up at least one
+  // separator for its NUL, except the last one
+  char *out = malloc(n + 1);
+  if (!out) {
+    free(buf);
+    return NULL;
+  }
+
+  size_t o = 0;
+  size_t i = 0;
+  bool in_prereq = false; // Past the ':' of the current rule
+
+  while (i < n) {
+    if (buf[i] == '\\' && i + 1 < n && buf[i + 1] == '\n') {
+      i += 2;
+      continue;
+    }
+    if (buf[i] == '\n') {
+      in_prereq = false;
+      i++;
+      continue;
+    }
+    if (is_space(buf[i])) {
+      i++;
+      continue;
+    }
+
+    size_t start = o;
+    bool colon = false;
+    while (i < n && !is_space(buf[i]) && buf[i] != '\n') {
+      if (buf[i] == '\\' && i + 1 < n &&
+          (buf[i + 1] == ' ' || buf[i + 1] == '#')) {
+        out[o++] = buf[i + 1];
+        i += 2;
+      } else if (buf[i] == '\\' && i + 1 < n && buf[i + 1] == '\n') {
+        break;
+      } else if (buf[i] == '$' && i + 1 < n && buf[i + 1] == '$') {
+        out[o++] = '$';
+        i += 2;
+      } else if (buf[i] == ':' && !in_prereq &&
+                 (i + 1 == n || is_space(buf[i + 1]) || buf[i + 1] == '\n')) {
+        // A colon inside a word, as in c:/path, does not end the targets
+        colon = true;
+        i++;
+        break;
+      } else {
+        out[o++] = buf[i++];
+      }
+    }
+
+    // Targets are dropped, prerequisites kept
+    if (!in_prereq || colon) {
+      o = start;
+      in_prereq = in_prereq || colon;
+    } else {
+      out[o++] = '\0';
+    }
+  }
+
+  free(buf);
+  *len = o;
+  return out;
+}
+
+/*
+ * read_all - Reads a whole file into memory
+ *
+ * @param path  Path of the file
+ * @param len   Filled with the length of the file
+ *
+ * @return Newly allocated contents, NULL with errno set on failure
+ * */
+static char *read_all(const char *path, size_t *len) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    return NULL;
+  }
+
+  struct stat st;
+  char *buf = NULL;
+  if (fstat(fileno(fp), &st) == 0 && (buf = malloc(st.st_size + 1)) &&
+      fread(buf, 1, st.st_size, fp) != (size_t)st.st_size) {
+    free(buf);
+    buf = NULL;
+    errno = EIO;
+  }
+  fclose(fp);
+
+  *len = buf ? (size_t)st.st_size : 0;
+  return buf;
+}
+
+/*
+ * is_space - Checks for a blank that separates words on a line
+ *
+ * @param c     The character
+ *
+ * @return true for a space, tab or carriage return
+ * */
+static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
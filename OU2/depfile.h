@@ -0,0 +1,26 @@
+/**
+ * Reading of depfiles, the makefile fragments compilers write with -MD or
+ * -MMD to list the headers an object was built from.
+ *
+ * @file depfile.h
+ */
+
+#ifndef DEPFILE_H
+#define DEPFILE_H
+
+#include <stddef.h>
+
+/*
+ * depfile_load - Reads the prerequisites of all rules in a depfile. Lines
+ * continue after a backslash, "\ " and "\#" stand for a space and a '#', and
+ * "$$" for a '$'.
+ *
+ * @param path  Path of the depfile
+ * @param len   Filled with the length of the result
+ *
+ * @return Newly allocated prerequisites in file order, each followed by a
+ * NUL. NULL with errno set on failure.
+ * */
+char *depfile_load(const char *path, size_t *len);
+
+#endif
@@ -0,0 +1,399 @@
+#include "graph.h"
+#include "hash.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum visit { UNSEEN, VISITING, DONE };
+
+struct entry {
+  const char *name; // NULL marks an empty slot
+  uint64_t hash;
+  enum visit visit;
+  uint32_t node; // Only valid once DONE
+};
+
+// Frame of the iterative depth-first walk
+struct frame {
+  const char *name;
+  rule *rule;
+  const char **prereq;
+  size_t next;
+};
+
+struct builder {
+  makefile *mf;
+  struct entry *table;
+  size_t table_cap; // Always a power of two
+  size_t table_size;
+  struct frame *stack;
+  size_t sp;
+  size_t stack_cap;
+  const char **names; // Per numbered node
+  size_t names_cap;
+  rule **rules;
+  size_t rules_cap;
+  uint32_t *prereq_off;
+  size_t prereq_off_cap;
+  size_t n_nodes;
+  uint32_t *edges; // Prerequisites of the numbered nodes
+  size_t n_edges;
+  size_t edges_cap;
+};
+
+static const char *no_prereq[] = {NULL};
+
+static struct entry *lookup(struct builder *b, const char *name);
+static int grow_table(struct builder *b);
+static int push(struct builder *b, const char *name);
+static int finish(struct builder *b);
+static int link_dependents(struct builder *b, graph *g);
+static int build_index(graph *g);
+static int reserve(void **array, size_t *cap, size_t need, size_t size);
+
+graph *graph_new(makefile *mf, const char **goals, size_t n_goals) {
+  struct builder b = {.mf = mf, .table_cap = 256};
+  graph *g = NULL;
+
+  if (!(b.table = calloc(b.table_cap, sizeof *b.table))) {
+    perror("calloc");
+    return NULL;
+  }
+
+  for (size_t i = 0; i < n_goals; i++) {
+    if (push(&b, goals[i]) != 0) {
+      goto out;
+    }
+
+    while (b.sp > 0) {
+      struct frame *f = &b.stack[b.sp - 1];
+
+      if (f->prereq[f->next] == NULL) {
+        if (finish(&b) != 0) {
+          goto out;
+        }
+        continue;
+      }
+
+      const char *name = f->prereq[f->next++];
+      struct entry *e = lookup(&b, name);
+      if (!e) {
+        goto out;
+      }
+      if (e->visit == VISITING) {
+        fprintf(stderr, "mmake: Circular dependency %s <- %s\n", name,
+                f->name);
+        goto out;
+      }
+      if (e->visit == UNSEEN && push(&b, name) != 0) {
+        goto out;
+      }
+    }
+  }
+
+  if (!(g = calloc(1, sizeof *g))) {
+    perror("calloc");
+    goto out;
+  }
+  if (link_dependents(&b, g) != 0 || build_index(g) != 0) {
+    graph_del(g);
+    g = NULL;
+  }
+
+out:
+  free(b.table);
+  free(b.stack);
+  free(b.names);
+  free(b.rules);
+  free(b.prereq_off);
+  free(b.edges);
+  return g;
+}
+
+size_t graph_find(const graph *g, const char *name) {
+  size_t mask = g->index_cap - 1;
+
+  for (size_t i = hash_str(name) & mask; g->index[i] != 0; i = (i + 1) & mask) {
+    if (strcmp(g->names[g->index[i] - 1], name) == 0) {
+      return g->index[i] - 1;
+    }
+  }
+
+  return GRAPH_NONE;
+}
+
+void graph_del(graph *g) {
+  if (!g) {
+    return;
+  }
+
+  free(g->names);
+  free(g->rules);
+  free(g->prereq_off);
+  free(g->prereq);
+  free(g->dependent_off);
+  free(g->dependents);
+  free(g->index);
+  free(g);
+}
+
+/*
+ * lookup - Finds the table entry of a name, inserting an UNSEEN entry if the
+ * name is new
+ *
+ * @param b     The builder
+ * @param name  Name of the target
+ *
+ * @return Pointer to the entry, valid until the next insertion. NULL on
+ * allocation failure.
+ * */
+static struct entry *lookup(struct builder *b, const char *name) {
+  uint64_t hash = hash_str(name);
+  size_t mask = b->table_cap - 1;
+  size_t i = hash & mask;
+
+  while (b->table[i].name) {
+    if (b->table[i].hash == hash && strcmp(b->table[i].name, name) == 0) {
+      return &b->table[i];
+    }
+    i = (i + 1) & mask;
+  }
+
+  // Keep the table at most half full
+  if (2 * (b->table_size + 1) > b->table_cap) {
+    if (grow_table(b) != 0) {
+      return NULL;
+    }
+    return lookup(b, name);
+  }
+
+  b->table[i] = (struct entry){.name = name, .hash = hash, .visit = UNSEEN};
+  b->table_size++;
+  return &b->table[i];
+}
+
+/*
+ * grow_table - Doubles the size of the name table and rehashes all entries
+ *
+ * @param b     The builder
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int grow_table(struct builder *b) {
+  size_t cap = b->table_cap * 2;
+  struct entry *table = calloc(cap, sizeof *table);
+  if (!table) {
+    perror("calloc");
+    return -1;
+  }
+
+  for (size_t i = 0; i < b->table_cap; i++) {
+    struct entry *old = &b->table[i];
+    if (old->name) {
+      size_t j = old->hash & (cap - 1);
+      while (table[j].name) {
+        j = (j + 1) & (cap - 1);
+      }
+      table[j] = *old;
+    }
+  }
+
+  free(b->table);
+  b->table = table;
+  b->table_cap = cap;
+  return 0;
+}
+
+/*
+ * push - Starts visiting a target
+ *
+ * @param b     The builder
+ * @param name  Name of the target, must stay valid while the graph exists
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int push(struct builder *b, const char *name) {
+  struct entry *e = lookup(b, name);
+  if (!e) {
+    return -1;
+  }
+  if (e->visit != UNSEEN) {
+    return 0;
+  }
+
+  if (reserve((void **)&b->stack, &b->stack_cap, b->sp + 1,
+              sizeof *b->stack) != 0) {
+    return -1;
+  }
+
+  rule *rule = makefile_rule(b->mf, name);
+  e->visit = VISITING;
+  b->stack[b->sp++] = (struct frame){
+      .name = e->name,
+      .rule = rule,
+      .prereq = rule ? rule_prereq(rule) : no_prereq,
+      .next = 0,
+  };
+
+  return 0;
+}
+
+/*
+ * finish - Numbers the target on top of the stack once all its
+ * prerequisites are numbered and records its edges
+ *
+ * @param b     The builder
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int finish(struct builder *b) {
+  struct frame *f = &b->stack[b->sp - 1];
+
+  if (b->n_nodes >= GRAPH_MAX || f->next > GRAPH_MAX - b->n_edges) {
+    fprintf(stderr, "mmake: Graph too large\n");
+    return -1;
+  }
+  if (reserve((void **)&b->names, &b->names_cap, b->n_nodes + 1,
+              sizeof *b->names) != 0 ||
+      reserve((void **)&b->rules, &b->rules_cap, b->n_nodes + 1,
+              sizeof *b->rules) != 0 ||
+      reserve((void **)&b->prereq_off, &b->prereq_off_cap, b->n_nodes + 2,
+              sizeof *b->prereq_off) != 0 ||
+      reserve((void **)&b->edges, &b->edges_cap, b->n_edges + f->next,
+              sizeof *b->edges) != 0) {
+    return -1;
+  }
+
+  b->names[b->n_nodes] = f->name;
+  b->rules[b->n_nodes] = f->rule;
+  b->prereq_off[b->n_nodes] = b->n_edges;
+
+  for (size_t i = 0; i < f->next; i++) {
+    b->edges[b->n_edges++] = lookup(b, f->prereq[i])->node;
+  }
+  b->prereq_off[b->n_nodes + 1] = b->n_edges;
+
+  struct entry *e = lookup(b, f->name);
+  e->visit = DONE;
+  e->node = b->n_nodes++;
+  b->sp--;
+
+  return 0;
+}
+
+/*
+ * link_dependents - Moves the nodes and prerequisite edges into the graph
+ * and adds the reverse edges
+ *
+ * @param b     The builder
+ * @param g     The graph to fill
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int link_dependents(struct builder *b, graph *g) {
+  size_t n = b->n_nodes;
+
+  g->n = n;
+  g->names = b->names;
+  g->rules = b->rules;
+  g->prereq_off = b->prereq_off;
+  g->prereq = b->edges;
+  b->names = NULL;
+  b->rules = NULL;
+  b->prereq_off = NULL;
+  b->edges = NULL;
+
+  // Empty goal lists still get their single offset
+  if (!g->prereq_off && !(g->prereq_off = calloc(1, sizeof *g->prereq_off))) {
+    perror("calloc");
+    return -1;
+  }
+
+  g->dependent_off = calloc(n + 1, sizeof *g->dependent_off);
+  g->dependents = malloc((b->n_edges + 1) * sizeof *g->dependents);
+  if (!g->dependent_off || !g->dependents) {
+    perror("malloc");
+    return -1;
+  }
+
+  // Count the dependents of each node and turn the counts into the end of
+  // its slice, then fill the slices from the back so each lists its
+  // dependents by increasing node number and its offset ends at the start
+  uint32_t *off = g->dependent_off;
+  for (size_t e = 0; e < b->n_edges; e++) {
+    off[g->prereq[e]]++;
+  }
+  for (size_t i = 1; i <= n; i++) {
+    off[i] += off[i - 1];
+  }
+  for (size_t i = n; i-- > 0;) {
+    for (size_t e = g->prereq_off[i + 1]; e-- > g->prereq_off[i];) {
+      g->dependents[--off[g->prereq[e]]] = i;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * build_index - Builds the name index of a graph, at most half full
+ *
+ * @param g     The graph
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int build_index(graph *g) {
+  g->index_cap = 16;
+  while (g->index_cap < 2 * g->n) {
+    g->index_cap *= 2;
+  }
+
+  g->index = calloc(g->index_cap, sizeof *g->index);
+  if (!g->index) {
+    perror("calloc");
+    return -1;
+  }
+
+  size_t mask = g->index_cap - 1;
+  for (size_t n = 0; n < g->n; n++) {
+    size_t i = hash_str(g->names[n]) & mask;
+    while (g->index[i] != 0) {
+      i = (i + 1) & mask;
+    }
+    g->index[i] = n + 1;
+  }
+
+  return 0;
+}
+
+/*
+ * reserve - Grows a dynamic array so it holds at least need elements
+ *
+ * @param array     Pointer to the array, updated when it moves
+ * @param cap       Pointer to the capacity in elements, updated
+ * @param need      Number of elements needed
+ * @param size      Size of one element
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int reserve(void **array, size_t *cap, size_t need, size_t size) {
+  if (need <= *cap) {
+    return 0;
+  }
+
+  size_t new_cap = *cap ? *cap : 64;
+  while (new_cap < need) {
+    new_cap *= 2;
+  }
+
+  void *new_array = realloc(*array, new_cap * size);
+  if (!new_array) {
+    perror("realloc");
+    return -1;
+  }
+
+  *array = new_array;
+  *cap = new_cap;
+  return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * Dependency graph of the targets reachable from a set of goals. Nodes are
+ * numbered in the post-order of a depth-first walk that visits goals and
+ * prerequisites in makefile order, so building the nodes by increasing
+ * number reproduces the order of a serial recursive build.
+ *
+ * @file graph.h
+ */
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include "parser.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Result of graph_find for a name that is not in the graph
+#define GRAPH_NONE SIZE_MAX
+
+// Largest number of nodes or edges of a graph, node numbers are stored in
+// 32 bits
+#define GRAPH_MAX (UINT32_MAX - 1)
+
+/*
+ * Nodes are numbered densely and everything about a node is kept in arrays
+ * indexed by its number. Edges are in compressed sparse row form: the
+ * prerequisites of node i are prereq[prereq_off[i]] up to
+ * prereq[prereq_off[i + 1]], its dependents likewise.
+ */
+typedef struct graph {
+  size_t n;                // Number of nodes
+  const char **names;      // Per node, points into the makefile
+  rule **rules;            // Per node, NULL for files without a rule
+  uint32_t *prereq_off;    // n + 1 offsets into prereq
+  uint32_t *prereq;        // Prerequisites of each node, in makefile order
+  uint32_t *dependent_off; // n + 1 offsets into dependents
+  uint32_t *dependents;    // Targets that list each node, by node number
+  uint32_t *index;         // Node number + 1 per slot, 0 marks an empty slot
+  size_t index_cap;        // Always a power of two
+} graph;
+
+/*
+ * graph_new - Builds the graph of everything the goals depend on. A cycle
+ * is reported on stderr.
+ *
+ * @param mf        The makefile
+ * @param goals     Names of the goals
+ * @param n_goals   Number of goals
+ *
+ * @return Pointer to the graph, NULL on a cycle or allocation failure
+ * */
+graph *graph_new(makefile *mf, const char **goals, size_t n_goals);
+
+/*
+ * graph_n_prereq - Counts the prerequisites of a node
+ *
+ * @param g     The graph
+ * @param i     Node number
+ *
+ * @return Number of prerequisites
+ * */
+static inline size_t graph_n_prereq(const graph *g, size_t i) {
+  return g->prereq_off[i + 1] - g->prereq_off[i];
+}
+
+/*
+ * graph_find - Looks up the node of a target or file
+ *
+ * @param g     The graph
+ * @param name  Name as written in the makefile
+ *
+ * @return Node number, GRAPH_NONE if the name is not in the graph
+ * */
+size_t graph_find(const graph *g, const char *name);
+
+/*
+ * graph_del - Frees a graph
+ *
+ * @param g     The graph, may be NULL
+ * */
+void graph_del(graph *g);
+
+#endif
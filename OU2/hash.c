@@ -0,0 +1,245 @@
+#include "hash.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define MAX_HASH_THREADS 8
+
+struct hash_job {
+  const char **paths;
+  uint64_t *out;
+  size_t n;
+  size_t next; // Index of the next file to hash, protected by lock
+  int err;
+  pthread_mutex_t lock;
+};
+
+static uint64_t rotl64(uint64_t x, int r);
+static uint64_t read64(const unsigned char *p);
+static uint32_t read32(const unsigned char *p);
+static uint64_t xxh_round(uint64_t acc, uint64_t input);
+static uint64_t xxh_merge(uint64_t acc, uint64_t val);
+static void *hash_worker(void *arg);
+
+uint64_t hash_str(const char *s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (*s != '\0') {
+    h ^= (unsigned char)*s++;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+
+    // Four independent lanes over 32 byte stripes
+    do {
+      v1 = xxh_round(v1, read64(p));
+      v2 = xxh_round(v2, read64(p + 8));
+      v3 = xxh_round(v3, read64(p + 16));
+      v4 = xxh_round(v4, read64(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  } else {
+    h = seed + PRIME64_5;
+  }
+
+  h += len;
+
+  // Mix in the tail
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  // Final avalanche
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+int hash_file(const char *path, uint64_t *out) {
+  // O_NONBLOCK so that opening a FIFO does not wait for a writer
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  // Directories and devices can not be read as a whole, their stat data
+  // stands in for the contents
+  if (!S_ISREG(st.st_mode)) {
+    int64_t meta[4] = {st.st_mode & S_IFMT, st.st_size, st.st_mtim.tv_sec,
+                       st.st_mtim.tv_nsec};
+    *out = hash_bytes(meta, sizeof meta, 0);
+    close(fd);
+    return 0;
+  }
+
+  if (st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      *out = hash_bytes(data, st.st_size, 0);
+      munmap(data, st.st_size);
+      close(fd);
+      return 0;
+    }
+  }
+
+  // Not mappable, read the whole file instead
+  size_t cap = 65536;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  ssize_t n;
+
+  while (buf && (n = read(fd, buf + len, cap - len)) != 0) {
+    if (n == -1) {
+      free(buf);
+      close(fd);
+      return -1;
+    }
+    len += n;
+    if (len == cap) {
+      char *tmp = realloc(buf, cap *= 2);
+      if (!tmp) {
+        free(buf);
+      }
+      buf = tmp;
+    }
+  }
+  close(fd);
+
+  if (!buf) {
+    return -1;
+  }
+  *out = hash_bytes(buf, len, 0);
+  free(buf);
+
+  return 0;
+}
+
+int hash_files(const char **paths, size_t n, uint64_t *out) {
+  struct hash_job job = {.paths = paths, .out = out, .n = n};
+  pthread_mutex_init(&job.lock, NULL);
+
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t n_threads = n < (size_t)n_cpus ? n : (size_t)n_cpus;
+  if (n_threads > MAX_HASH_THREADS) {
+    n_threads = MAX_HASH_THREADS;
+  }
+
+  // The calling thread works too, so only start the extra ones
+  pthread_t threads[MAX_HASH_THREADS];
+  size_t started = 0;
+  while (started + 1 < n_threads &&
+         pthread_create(&threads[started], NULL, hash_worker, &job) == 0) {
+    started++;
+  }
+
+  hash_worker(&job);
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&job.lock);
+
+  return job.err ? -1 : 0;
+}
+
+/*
+ * hash_worker - Thread function that hashes files from a shared job until
+ * there are none left
+ *
+ * @param arg   Pointer to the struct hash_job
+ *
+ * @return NULL
+ * */
+static void *hash_worker(void *arg) {
+  struct hash_job *job = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    size_t i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+
+    if (i >= job->n) {
+      return NULL;
+    }
+
+    if (hash_file(job->paths[i], &job->out[i]) != 0) {
+      pthread_mutex_lock(&job->lock);
+      job->err = 1;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+}
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
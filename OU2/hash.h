@@ -0,0 +1,57 @@
+/**
+ * Hash functions shared by the mmake modules.
+ *
+ * @file hash.h
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * hash_str - Hashes a NUL-terminated string using 64-bit FNV-1a
+ *
+ * @param s   The string to hash
+ *
+ * @return The hash of s
+ * */
+uint64_t hash_str(const char *s);
+
+/*
+ * hash_bytes - Hashes a block of memory using XXH64
+ *
+ * @param data    The bytes to hash
+ * @param len     Number of bytes
+ * @param seed    Seed value, can be used to chain hashes
+ *
+ * @return The hash of the bytes
+ * */
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+
+/*
+ * hash_file - Hashes the contents of a file. The file is mapped into memory
+ * when possible and read otherwise. A file that is not a regular file, such
+ * as a directory, is hashed by its type, size and mtime instead.
+ *
+ * @param path    Path of the file
+ * @param out     Filled with the hash on success
+ *
+ * @return 0 on success, -1 with errno set on failure
+ * */
+int hash_file(const char *path, uint64_t *out);
+
+/*
+ * hash_files - Hashes the contents of several files, spreading the work over
+ * a few threads when there is more than one file
+ *
+ * @param paths   Paths of the files
+ * @param n       Number of files
+ * @param out     Array of n hashes, filled on success
+ *
+ * @return 0 on success, -1 if any file could not be hashed
+ * */
+int hash_files(const char **paths, size_t n, uint64_t *out);
+
+#endif
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include "jobserver.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Byte written as a token by mmake, tokens read are given back unchanged
+#define TOKEN '+'
+
+struct jobserver {
+  int read_fd;
+  int write_fd;
+  bool own_read; // read_fd was opened by mmake, write_fd is never owned
+  bool blocking; // read_fd may block, poll before reading
+  char *dir;     // Directory of a fifo created by mmake, NULL when joined
+  char *fifo;
+  char *held; // Tokens taken and not given back yet
+  size_t n_held;
+  size_t cap_held;
+};
+
+static const char *find_auth(const char *flags, size_t *len);
+static jobserver *join_fifo(const char *path);
+static jobserver *join_pipe(int read_fd, int write_fd);
+static int write_token(jobserver *js, char token);
+
+jobserver *jobserver_join(void) {
+  const char *flags = getenv("MAKEFLAGS");
+  if (!flags) {
+    return NULL;
+  }
+
+  size_t len;
+  const char *auth = find_auth(flags, &len);
+  if (!auth) {
+    return NULL;
+  }
+
+  char *value = strndup(auth, len);
+  if (!value) {
+    perror("strndup");
+    return NULL;
+  }
+
+  jobserver *js = NULL;
+  int read_fd, write_fd;
+  if (strncmp(value, "fifo:", 5) == 0) {
+    js = join_fifo(value + 5);
+  } else if (sscanf(value, "%d,%d", &read_fd, &write_fd) == 2) {
+    js = join_pipe(read_fd, write_fd);
+  } else {
+    fprintf(stderr, "mmake: Unknown jobserver '%s', using -j1\n", value);
+  }
+
+  free(value);
+  return js;
+}
+
+jobserver *jobserver_create(int jobs) {
+  jobserver *js = calloc(1, sizeof *js);
+  if (!js) {
+    perror("calloc");
+    return NULL;
+  }
+  js->read_fd = -1;
+
+  const char *tmp = getenv("TMPDIR");
+  if (!tmp || *tmp == '\0') {
+    tmp = "/tmp";
+  }
+
+  if (asprintf(&js->dir, "%s/mmake-XXXXXX", tmp) == -1) {
+    js->dir = NULL;
+    perror("asprintf");
+    goto fail;
+  }
+  if (!mkdtemp(js->dir)) {
+    perror(js->dir);
+    free(js->dir);
+    js->dir = NULL;
+    goto fail;
+  }
+
+  if (asprintf(&js->fifo, "%s/jobserver", js->dir) == -1) {
+    js->fifo = NULL;
+    perror("asprintf");
+    goto fail;
+  }
+  if (mkfifo(js->fifo, 0600) != 0) {
+    perror(js->fifo);
+    free(js->fifo);
+    js->fifo = NULL;
+    goto fail;
+  }
+
+  // Opening a fifo for reading and writing does not wait for a peer
+  js->read_fd = open(js->fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (js->read_fd == -1) {
+    perror(js->fifo);
+    goto fail;
+  }
+  js->write_fd = js->read_fd;
+  js->own_read = true;
+
+  for (int i = 1; i < jobs; i++) {
+    if (write_token(js, TOKEN) != 0) {
+      goto fail;
+    }
+  }
+
+  // The last jobserver option in MAKEFLAGS wins, so recipes that run make
+  // or mmake join this one rather than one mmake itself was given
+  const char *old = getenv("MAKEFLAGS");
+  char *flags;
+  if (asprintf(&flags, "%s%s-j%d --jobserver-auth=fifo:%s", old ? old : "",
+               old && *old ? " " : "", jobs, js->fifo) == -1) {
+    perror("asprintf");
+    goto fail;
+  }
+  if (setenv("MAKEFLAGS", flags, 1) != 0) {
+    perror("setenv");
+    free(flags);
+    goto fail;
+  }
+  free(flags);
+
+  return js;
+
+fail:
+  jobserver_close(js);
+  return NULL;
+}
+
+int jobserver_fd(jobserver *js) { return js->read_fd; }
+
+bool jobserver_acquire(jobserver *js) {
+  if (js->n_held == js->cap_held) {
+    size_t cap = js->cap_held ? 2 * js->cap_held : 16;
+    char *held = realloc(js->held, cap);
+    if (!held) {
+      return false;
+    }
+    js->held = held;
+    js->cap_held = cap;
+  }
+
+  // Another process may take the token between poll and read, so an fd
+  // that could not be made non-blocking can still block here for a while
+  if (js->blocking) {
+    struct pollfd pfd = {.fd = js->read_fd, .events = POLLIN};
+    if (poll(&pfd, 1, 0) != 1) {
+      return false;
+    }
+  }
+
+  char token;
+  if (read(js->read_fd, &token, 1) != 1) {
+    return false;
+  }
+
+  js->held[js->n_held++] = token;
+  return true;
+}
+
+void jobserver_release(jobserver *js) {
+  if (js->n_held > 0) {
+    write_token(js, js->held[--js->n_held]);
+  }
+}
+
+void jobserver_close(jobserver *js) {
+  if (!js) {
+    return;
+  }
+
+  while (js->n_held > 0) {
+    jobserver_release(js);
+  }
+
+  if (js->own_read) {
+    close(js->read_fd);
+  }
+  if (js->fifo) {
+    unlink(js->fifo);
+  }
+  if (js->dir) {
+    rmdir(js->dir);
+  }
+
+  free(js->fifo);
+  free(js->dir);
+  free(js->held);
+  free(js);
+}
+
+/*
+ * find_auth - Finds the value of the last --jobserver-auth or
+ * --jobserver-fds option in MAKEFLAGS
+ *
+ * @param flags     Value of MAKEFLAGS
+ * @param len       Filled with the length of the value
+ *
+ * @return Pointer to the value inside flags, NULL if there is none
+ * */
+static const char *find_auth(const char *flags, size_t *len) {
+  static const char *names[] = {"--jobserver-auth=", "--jobserver-fds="};
+  const char *found = NULL;
+
+  for (const char *word = flags; *word != '\0';) {
+    size_t word_len = strcspn(word, " ");
+
+    for (size_t i = 0; i < sizeof names / sizeof *names; i++) {
+      size_t name_len = strlen(names[i]);
+      if (word_len > name_len && strncmp(word, names[i], name_len) == 0) {
+        found = word + name_len;
+        *len = word_len - name_len;
+      }
+    }
+
+    word += word_len;
+    word += strspn(word, " ");
+  }
+
+  return found;
+}
+
+/*
+ * join_fifo - Joins a jobserver that uses a named fifo
+ *
+ * @param path  Path of the fifo
+ *
+ * @return Pointer to the jobserver, NULL if it can not be opened
+ * */
+static jobserver *join_fifo(const char *path) {
+  int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "mmake: Jobserver %s unavailable, using -j1: %s\n", path,
+            strerror(errno));
+    return NULL;
+  }
+
+  jobserver *js = calloc(1, sizeof *js);
+  if (!js) {
+    perror("calloc");
+    close(fd);
+    return NULL;
+  }
+
+  js->read_fd = fd;
+  js->write_fd = fd;
+  js->own_read = true;
+  return js;
+}
+
+/*
+ * join_pipe - Joins a jobserver that uses an inherited pipe. The read end is
+ * opened again through /proc so it can be made non-blocking without
+ * changing the descriptor the other processes share.
+ *
+ * @param read_fd   Inherited read end
+ * @param write_fd  Inherited write end
+ *
+ * @return Pointer to the jobserver, NULL if the descriptors are not open
+ * */
+static jobserver *join_pipe(int read_fd, int write_fd) {
+  // make only passes the pipe to recipes it knows run make
+  if (read_fd < 0 || write_fd < 0 || fcntl(read_fd, F_GETFD) == -1 ||
+      fcntl(write_fd, F_GETFD) == -1) {
+    fprintf(stderr, "mmake: Jobserver unavailable, using -j1. Add '+' to "
+                    "the parent make rule.\n");
+    return NULL;
+  }
+
+  jobserver *js = calloc(1, sizeof *js);
+  if (!js) {
+    perror("calloc");
+    return NULL;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "/proc/self/fd/%d", read_fd);
+  js->read_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (js->read_fd != -1) {
+    js->own_read = true;
+  } else {
+    js->read_fd = read_fd;
+    js->blocking = true;
+  }
+  js->write_fd = write_fd;
+
+  return js;
+}
+
+/*
+ * write_token - Writes one token to the jobserver
+ *
+ * @param js        The jobserver
+ * @param token     The token
+ *
+ * @return 0 on success, -1 on failure
+ * */
+static int write_token(jobserver *js, char token) {
+  while (write(js->write_fd, &token, 1) != 1) {
+    if (errno != EINTR) {
+      perror("jobserver");
+      return -1;
+    }
+  }
+
+  return 0;
+}
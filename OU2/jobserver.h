@@ -0,0 +1,73 @@
+/**
+ * GNU make jobserver protocol. A jobserver is a pipe or fifo holding one
+ * byte per job slot beyond the first. Every process in the tree gets one
+ * job for free and reads a token before starting each additional job, so
+ * the number of jobs across nested builds stays bounded.
+ *
+ * mmake joins the jobserver named in MAKEFLAGS by --jobserver-auth (or the
+ * older --jobserver-fds) when run from make, and creates a fifo jobserver
+ * for its recipes when given -j.
+ *
+ * @file jobserver.h
+ */
+
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+#include <stdbool.h>
+
+typedef struct jobserver jobserver;
+
+/*
+ * jobserver_join - Joins the jobserver named in MAKEFLAGS. A jobserver that
+ * is named but can not be used is reported on stderr.
+ *
+ * @return Pointer to the jobserver, NULL if there is none to use
+ * */
+jobserver *jobserver_join(void);
+
+/*
+ * jobserver_create - Creates a fifo jobserver with jobs - 1 tokens and adds
+ * it to MAKEFLAGS in the environment of the recipes
+ *
+ * @param jobs  Total number of jobs, at least 2
+ *
+ * @return Pointer to the jobserver or NULL on failure
+ * */
+jobserver *jobserver_create(int jobs);
+
+/*
+ * jobserver_fd - Gets the descriptor that becomes readable when a token may
+ * be available, for use with poll
+ *
+ * @param js    The jobserver
+ *
+ * @return The descriptor
+ * */
+int jobserver_fd(jobserver *js);
+
+/*
+ * jobserver_acquire - Takes a token without blocking
+ *
+ * @param js    The jobserver
+ *
+ * @return true if a token was taken
+ * */
+bool jobserver_acquire(jobserver *js);
+
+/*
+ * jobserver_release - Gives back a token taken with jobserver_acquire
+ *
+ * @param js    The jobserver
+ * */
+void jobserver_release(jobserver *js);
+
+/*
+ * jobserver_close - Gives back all tokens still held and frees the
+ * jobserver. A jobserver created by mmake is removed.
+ *
+ * @param js    The jobserver, may be NULL
+ * */
+void jobserver_close(jobserver *js);
+
+#endif
@@ -0,0 +1,42 @@
+#include "launch.h"
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+
+extern char **environ;
+
+pid_t launch_cmd(char **cmd, int out_fd) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  pid_t pid;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+
+  if (out_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDERR_FILENO);
+    if (out_fd > STDERR_FILENO) {
+      posix_spawn_file_actions_addclose(&actions, out_fd);
+    }
+  }
+
+  // The command starts with no signals blocked, whatever mmake is doing
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+  int err = posix_spawnp(&pid, cmd[0], &actions, &attr, cmd, environ);
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+
+  return pid;
+}
@@ -0,0 +1,26 @@
+/**
+ * Launching of recipe commands. Commands are started with posix_spawnp,
+ * which uses vfork semantics so the cost does not grow with the size of
+ * mmake's address space.
+ *
+ * @file launch.h
+ */
+
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <sys/types.h>
+
+/*
+ * launch_cmd - Starts a command in a new process
+ *
+ * @param cmd       NULL-terminated array with the command and its arguments,
+ *                  the command is looked up in PATH
+ * @param out_fd    Descriptor that becomes stdout and stderr of the command,
+ *                  such as the write end of a pipe. -1 to inherit them.
+ *
+ * @return Pid of the new process, or -1 with errno set on failure
+ * */
+pid_t launch_cmd(char **cmd, int out_fd);
+
+#endif
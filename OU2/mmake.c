@@ -1,19 +1,47 @@
 #include "build.h"
+#include "db.h"
+#include "jobserver.h"
 #include "parser.h"
+#include "watch.h"
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+// Long options without a short form
+enum { OPT_TRACE = 256, OPT_MEM_HEADROOM, OPT_WATCH, OPT_RESTAT,
+       OPT_NO_BUILTINS };
+
+static const struct option long_options[] = {
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"mem-headroom", required_argument, NULL, OPT_MEM_HEADROOM},
+    {"watch", no_argument, NULL, OPT_WATCH},
+    {"restat", no_argument, NULL, OPT_RESTAT},
+    {"no-builtins", no_argument, NULL, OPT_NO_BUILTINS},
+    {NULL, 0, NULL, 0},
+};
 
 int main(int argc, char *argv[]) {
   FILE *file;
   char *filename = "mmakefile"; // [-f MAKEFILE]
   bool force_rebuild = false;   // [-B]
+  bool dry_run = false;         // [-n]
+  bool question = false;        // [-q]
   bool silent = false;          // [-s]
+  bool content_hash = false;    // [-H]
+  char *cache_dir = getenv("MMAKE_CACHE_DIR"); // [-c DIR]
+  char *trace_file = NULL;                     // [--trace FILE]
+  int jobs = 0;                                // [-j N] 0 if not given
+  double max_load = 0;                         // [-l LOAD]
+  uint64_t mem_headroom = 0;                   // [--mem-headroom SIZE]
+  bool watch = false;                          // [--watch]
+  bool restat = false;                         // [--restat]
+  bool no_builtins = false;                    // [--no-builtins]
 
   // Gather data from cmd line arguments
   int c;
-  while ((c = getopt(argc, argv, "f:Bs")) != -1) {
+  while ((c = getopt_long(argc, argv, "f:BnqsHc:j:l:", long_options, NULL)) != -1) {
     switch (c) {
     case 'f':
       filename = optarg;
@@ -21,54 +49,197 @@ int main(int argc, char *argv[]) {
     case 'B':
       force_rebuild = true;
       break;
+    case 'n':
+      dry_run = true;
+      break;
+    case 'q':
+      question = true;
+      break;
     case 's':
       silent = true;
       break;
+    case 'H':
+      content_hash = true;
+      break;
+    case 'c':
+      cache_dir = optarg;
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      if (jobs < 1) {
+        fprintf(stderr, "mmake: Invalid number of jobs: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'l':
+      max_load = atof(optarg);
+      if (max_load <= 0) {
+        fprintf(stderr, "mmake: Invalid load limit: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_MEM_HEADROOM:
+      if (parse_size(optarg, &mem_headroom) != 0) {
+        fprintf(stderr, "mmake: Invalid memory headroom: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_TRACE:
+      trace_file = optarg;
+      break;
+    case OPT_WATCH:
+      watch = true;
+      break;
+    case OPT_RESTAT:
+      restat = true;
+      break;
+    case OPT_NO_BUILTINS:
+      no_builtins = true;
+      break;
     default:
-      fprintf(stderr, "Usage: mmake [-f MAKEFILE] [-B] [-s] [TARGET ...]\n");
-      return EXIT_FAILURE;
+      fprintf(stderr, "Usage: mmake [-f MAKEFILE] [-B] [-n] [-q] [-s] [-H] "
+                      "[-c DIR] [-j N] [-l LOAD] [--mem-headroom SIZE] "
+                      "[--trace FILE] [--watch] [--restat] [--no-builtins] "
+                      "[TARGET ...]\n"
+                      "With -j above 1 the stdout and stderr of a recipe are "
+                      "written to stdout\n"
+                      "as one block when it is done, unless its rule sets "
+                      "live = 1.\n"
+                      "With -q the exit status is 0 if the targets are up to "
+                      "date, 1 if not\n"
+                      "and 2 on an error.\n");
+      return question ? QUESTION_ERROR : EXIT_FAILURE;
     }
   }
 
+  // Errors are told apart from out of date targets with -q
+  int error = question ? QUESTION_ERROR : EXIT_FAILURE;
+
   // Open file and check that it worked
   file = fopen(filename, "r");
   if (!file) {
     perror(filename);
-    return EXIT_FAILURE;
+    return error;
   }
 
   // Parse the file into a makefile struct
-  makefile *mf = parse_makefile(file);
+  makefile *mf = parse_makefile_cached(file, filename);
   fclose(file);
 
   if (!mf) {
     perror("mmakefile");
-    return EXIT_FAILURE;
+    return error;
   }
 
-  int num_targets = argc - optind;
-  const char *target_name;
+  struct build_state state = {
+      .mf = mf,
+      .stats = statcache_new(),
+      .db = NULL,
+      .cache = NULL,
+      .trace = NULL,
+      .js = NULL,
+      .jobs = jobs,
+      .max_load = max_load,
+      .mem_headroom = mem_headroom,
+      .force_rebuild = force_rebuild,
+      .restat = restat,
+      .dry_run = dry_run,
+      .question = question,
+      .silent = silent,
+      .content_hash = content_hash,
+      .no_builtins = no_builtins,
+  };
 
-  // If any targets are given build each target
-  if (num_targets > 0) {
-    for (int i = optind; i < argc; i++) {
-      if (build_target(argv[i], mf, force_rebuild, silent) != EXIT_SUCCESS) {
-        makefile_del(mf);
-        return EXIT_FAILURE;
-      }
+  if (!state.stats) {
+    perror("statcache_new");
+    makefile_del(mf);
+    return error;
+  }
+
+  if (cache_dir && *cache_dir != '\0') {
+    uint64_t max_size = CACHE_DEFAULT_SIZE;
+    char *size = getenv("MMAKE_CACHE_SIZE");
+    if (size && parse_size(size, &max_size) != 0) {
+      fprintf(stderr, "mmake: Invalid MMAKE_CACHE_SIZE: %s\n", size);
+      statcache_del(state.stats);
+      makefile_del(mf);
+      return error;
+    }
+
+    if (!(state.cache = cache_open(cache_dir, max_size))) {
+      statcache_del(state.stats);
+      makefile_del(mf);
+      return error;
     }
+  }
+
+  // An explicit -j overrides a jobserver mmake was started with, otherwise
+  // job slots come from make's jobserver with no local limit
+  if (jobs > 1) {
+    state.js = jobserver_create(jobs);
+    if (!state.js) {
+      cache_close(state.cache, false);
+      statcache_del(state.stats);
+      makefile_del(mf);
+      return error;
+    }
+  } else if (jobs == 0) {
+    state.js = jobserver_join();
+    state.jobs = state.js ? 0 : 1;
+  }
+
+  // Stored file hashes and fingerprints are only needed when comparing
+  // contents or looking up cached actions, recipe durations only when
+  // ordering a parallel build. An existing database may hold restat
+  // records that decide whether targets are up to date.
+  if ((content_hash || state.cache || state.jobs != 1 || restat ||
+       access(DB_FILE, F_OK) == 0) &&
+      !(state.db = db_open(DB_FILE))) {
+    perror(DB_FILE);
+    jobserver_close(state.js);
+    cache_close(state.cache, false);
+    statcache_del(state.stats);
+    makefile_del(mf);
+    return error;
+  }
+
+  if (trace_file && !(state.trace = trace_open(trace_file))) {
+    jobserver_close(state.js);
+    db_close(state.db);
+    cache_close(state.cache, false);
+    statcache_del(state.stats);
+    makefile_del(mf);
+    return error;
+  }
+
+  int num_targets = argc - optind;
+  int status;
+
+  // Watch mode keeps building until interrupted
+  if (watch) {
+    status = watch_build(&state, filename, (const char **)argv + optind,
+                         num_targets);
+  } else if (num_targets > 0) {
+    // All given targets share one build so common prerequisites are only
+    // checked once and independent targets can run in parallel
+    status = build_targets((const char **)argv + optind, num_targets, &state);
   } else {
     // If no targets are given the target name is just the default target so we
     // build that
-    target_name = makefile_default_target(mf);
-    if (build_target(target_name, mf, force_rebuild, silent) != EXIT_SUCCESS) {
-      makefile_del(mf);
-      perror("build_target");
-      return EXIT_FAILURE;
-    }
+    const char *target_name = makefile_default_target(mf);
+    status = build_targets(&target_name, 1, &state);
   }
 
-  // Cleanup memory from prase_makefile
-  makefile_del(mf);
-  return EXIT_SUCCESS;
+  // Cleanup memory from prase_makefile and save the build database
+  jobserver_close(state.js);
+  if (db_close(state.db) != 0) {
+    status = error;
+  }
+  cache_close(state.cache, !silent);
+  if (trace_close(state.trace, state.mf, !silent) != 0) {
+    status = error;
+  }
+  statcache_del(state.stats);
+  makefile_del(state.mf);
+  return status;
 }
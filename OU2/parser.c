@@ -3,6 +3,19 @@
  * the student as part of the mmake assignment in the course C Programming and
  * Unix (5DV088).
  *
+ * The whole file is read into memory, mapped when possible, and parsed in two
+ * linear passes. The first pass checks the syntax and counts rules, words and
+ * bytes. The second copies everything into one allocation: the makefile
+ * header, the rules, the hash index, one shared array of word pointers that
+ * the prerequisite and command arrays are slices of, and the strings.
+ *
+ * Besides rules a makefile may declare job pools, "pool NAME = DEPTH", and
+ * give a rule attributes on indented "key = value" lines after its command.
+ *
+ * Because the parsed graph is a single block it can be saved as is, with
+ * pointers turned into offsets. parse_makefile_cached keeps such a
+ * precompiled graph next to the makefile and maps it on later runs.
+ *
  * @file parse.h
  * @author Elias Åström, Fredrik Peteri
  * @date 2020-09-04
@@ -11,81 +24,220 @@
  */
 
 #include "parser.h"
+#include "hash.h"
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* ------------------------------- Constants ------------------------------- */
 
-#define MAX_RULES 256
-#define MAX_LINE 1024
-#define MAX_PREREQ 32
-#define MAX_CMD 32
+#define READ_CHUNK 65536
+
+// Precompiled graphs, only kept for makefiles of at least GRAPH_MIN_SIZE
+#define GRAPH_MAGIC "MMGC"
+#define GRAPH_VERSION 3
+#define GRAPH_BYTE_ORDER 0x01020304
+#define GRAPH_MIN_SIZE 65536
 
 /* ------------------------------ Structures ------------------------------- */
 
 struct makefile {
-  struct rule *rules;
+  struct rule *rules;  // All rules in file order
+  size_t n_rules;
+  struct rule **index; // Open addressing table over the targets
+  size_t index_cap;    // Number of slots in index, always a power of two
+  struct pool *pools;  // Declared pools in file order
+  size_t n_pools;
+  char **words;        // Word pointers that prereq and cmd are slices of
+  size_t n_words;
+  size_t size;    // Size of the block holding the makefile and all its data
+  size_t map_len; // Length of the mapping if loaded from a graph file, or 0
 };
 
 struct rule {
   char *target;
+  uint64_t hash; // Hash of target, computed once when the rule is parsed
   char **prereq;
   char **cmd;
-  rule *next;
+  char **attrs; // Alternating keys and values
+};
+
+struct pool {
+  char *name;
+  int depth;
+};
+
+/*
+ * Header of a precompiled graph file. The makefile block follows directly,
+ * with every pointer stored as an offset from the start of the block.
+ */
+struct graph_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order; // GRAPH_BYTE_ORDER as written by this machine
+  uint32_t ptr_size;
+  int64_t src_size;
+  int64_t src_mtime_sec;
+  int64_t src_mtime_nsec;
+  uint64_t src_hash;
+  uint64_t block_size;
+  uint64_t block_hash; // Hash of the block with its pointers as offsets
+};
+
+/*
+ * State of one pass over the input. In the counting pass the output pointers
+ * are NULL and only the counters are updated.
+ */
+struct parse {
+  const char *p;   // Current position in the input
+  const char *end; // End of the input
+
+  rule *rules;
+  struct pool *pools;
+  char **words; // Shared array that prereq and cmd arrays point into
+  char *strs;   // Bytes of all strings, NUL-terminated
+
+  size_t n_rules;
+  size_t n_pools;
+  size_t n_words;
+  size_t n_strs;
 };
 
 /* ------------------ Declarations of internal functions ------------------ */
 
-static rule *parse_rule(FILE *fp, bool *err);
-static char *extract_target(char **p, char *buf, FILE *fp, bool *err);
-static char *parse_prereqs(char **p, char **prereq, size_t *n_prereq);
-static char *advance_until_cmd(char *buf, FILE *fp);
-static size_t parse_cmd(char **cmd, char **p);
-static rule *create_rule(char *target, char **prereq, char **cmd);
-static char **dupe_str_array(size_t n, char **a);
-static char *next_line(char buf[MAX_LINE], FILE *fp);
-static char *parse_word(char **p, char *delim);
-static void skipwhite(char **p);
-static bool expect(char **p, char c);
-static bool is_blank_line(const char *s);
-static void free_arr(char **arr);
-static void del_rules(struct rule *rules);
-static void err0(bool *err);
-static void err1(char *target, bool *err);
-static void err2(char *prereq[], size_t n_prereq, char *target, bool *err);
+static char *read_input(FILE *fp, size_t *len, bool *mapped);
+static bool parse_rules(struct parse *ps);
+static bool parse_rule(struct parse *ps);
+static bool is_pool_line(const struct parse *ps);
+static bool parse_pool(struct parse *ps);
+static bool parse_attr(struct parse *ps);
+static bool expect_eol(struct parse *ps);
+static bool next_line(struct parse *ps);
+static void parse_words(struct parse *ps);
+static void emit_slot(struct parse *ps, char *word);
+static char *emit_word(struct parse *ps, const char *word, size_t n);
+static size_t word_len(const struct parse *ps, char delim);
+static void skipwhite(struct parse *ps);
+static bool expect(struct parse *ps, char c);
+static bool is_blank_line(const char *s, const char *end);
+static void build_index(makefile *m);
+static char *graph_path(const char *path);
+static makefile *load_graph(const char *gpath, const struct stat *st,
+                            uint64_t hash);
+static void save_graph(const makefile *m, const char *gpath,
+                       const struct stat *st, uint64_t hash);
+static bool relocate(makefile *m, uintptr_t from, uintptr_t to);
 
 /* -------------------------- External functions -------------------------- */
 
 makefile *parse_makefile(FILE *fp) {
-  makefile *m = malloc(sizeof *m);
-  rule **tailp = &m->rules;
+  size_t len;
+  bool mapped;
+  char *buf = read_input(fp, &len, &mapped);
+  if (buf == NULL) {
+    return NULL;
+  }
+
+  // Counting pass
+  struct parse count = {.p = buf, .end = buf + len};
+  makefile *m = NULL;
+
+  if (parse_rules(&count) && count.n_rules > 0) {
+    size_t index_cap = 16;
+    while (index_cap < 2 * count.n_rules) {
+      index_cap *= 2;
+    }
 
-  bool err = false;
-  while ((*tailp = parse_rule(fp, &err)) != NULL) {
-    tailp = &(*tailp)->next;
+    // Everything goes in one block, ordered so each part stays aligned
+    size_t size = sizeof *m + count.n_rules * sizeof(rule) +
+                  index_cap * sizeof(rule *) +
+                  count.n_pools * sizeof(struct pool) +
+                  count.n_words * sizeof(char *) + count.n_strs;
+    m = malloc(size);
+
+    if (m != NULL) {
+      m->rules = (rule *)(m + 1);
+      m->n_rules = count.n_rules;
+      m->index = (rule **)(m->rules + m->n_rules);
+      m->index_cap = index_cap;
+      m->pools = (struct pool *)(m->index + index_cap);
+      m->n_pools = count.n_pools;
+      m->words = (char **)(m->pools + m->n_pools);
+      m->n_words = count.n_words;
+      m->size = size;
+      m->map_len = 0;
+
+      // Filling pass over the same input
+      struct parse fill = {
+          .p = buf,
+          .end = buf + len,
+          .rules = m->rules,
+          .pools = m->pools,
+          .words = m->words,
+      };
+      fill.strs = (char *)(fill.words + count.n_words);
+
+      parse_rules(&fill);
+      build_index(m);
+    }
   }
-  *tailp = NULL;
 
-  if (m->rules == NULL || err) {
-    makefile_del(m);
-    return NULL;
+  if (mapped) {
+    munmap(buf, len);
+  } else {
+    free(buf);
+  }
+
+  return m;
+}
+
+makefile *parse_makefile_cached(FILE *fp, const char *path) {
+  struct stat st;
+  uint64_t hash;
+
+  if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < GRAPH_MIN_SIZE || hash_file(path, &hash) != 0) {
+    return parse_makefile(fp);
+  }
+
+  char *gpath = graph_path(path);
+  if (gpath == NULL) {
+    return parse_makefile(fp);
   }
 
+  makefile *m = load_graph(gpath, &st, hash);
+  if (m == NULL) {
+    m = parse_makefile(fp);
+    if (m != NULL) {
+      save_graph(m, gpath, &st, hash);
+    }
+  }
+
+  free(gpath);
   return m;
 }
 
 const char *makefile_default_target(makefile *m) { return m->rules->target; }
 
 rule *makefile_rule(makefile *m, const char *target) {
-  rule *i = m->rules;
-  while (i != NULL) {
-    if (strcmp(i->target, target) == 0) {
-      return i;
+  uint64_t hash = hash_str(target);
+  size_t mask = m->index_cap - 1;
+
+  // Linear probing, an empty slot ends the search
+  for (size_t i = hash & mask; m->index[i] != NULL; i = (i + 1) & mask) {
+    rule *r = m->index[i];
+    if (r->hash == hash && strcmp(r->target, target) == 0) {
+      return r;
     }
-    i = i->next;
   }
 
   return NULL;
@@ -95,262 +247,394 @@ const char **rule_prereq(rule *rule) { return (const char **)rule->prereq; }
 
 char **rule_cmd(rule *rule) { return rule->cmd; }
 
+const char *rule_attr(rule *rule, const char *key) {
+  for (char **a = rule->attrs; *a != NULL; a += 2) {
+    if (strcmp(a[0], key) == 0) {
+      return a[1];
+    }
+  }
+
+  return NULL;
+}
+
+int makefile_pool_depth(makefile *m, const char *name) {
+  for (size_t i = 0; i < m->n_pools; i++) {
+    if (strcmp(m->pools[i].name, name) == 0) {
+      return m->pools[i].depth;
+    }
+  }
+
+  return -1;
+}
+
 void makefile_del(makefile *make) {
-  del_rules(make->rules);
-  free(make);
+  if (make->map_len > 0) {
+    munmap((char *)make - sizeof(struct graph_header), make->map_len);
+  } else {
+    free(make);
+  }
 }
 
 /* -------------------------- Internal functions -------------------------- */
 
 /**
- * Parse a rule.
+ * Get the rest of the file into memory. Regular files are mapped, anything
+ * else is read until end of file.
  *
- * @param fp    File to read from.
- * @param err   Pointer to flag which gets set to true on error.
- * @return      A parsed rule or NULL.
+ * @param fp      File to read.
+ * @param len     Filled with the number of bytes.
+ * @param mapped  Set to true if the buffer must be freed with munmap.
+ * @return        The contents, NULL on failure. An empty file gives a
+ *                non-NULL buffer of length 0.
  */
-static rule *parse_rule(FILE *fp, bool *err) {
-  // Buffer variables
-  char buf[MAX_LINE];
-  char *p;
-
-  // Variables to fill
-  char *prereq[MAX_PREREQ];
-  size_t n_prereq;
-  char *cmd[MAX_CMD];
-
-  char *target = extract_target(&p, buf, fp, err);
-  if (target == NULL) {
-    return NULL;
+static char *read_input(FILE *fp, size_t *len, bool *mapped) {
+  struct stat st;
+  int fd = fileno(fp);
+  long off = ftell(fp);
+
+  // Only a file read from its start can be mapped as is
+  *mapped = false;
+  if (fd != -1 && off == 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > 0) {
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      *mapped = true;
+      *len = st.st_size;
+      return map;
+    }
   }
 
-  p = parse_prereqs(&p, prereq, &n_prereq);
-  if (p == NULL) {
-    err2(prereq, n_prereq, target, err);
-    return NULL;
+  size_t cap = READ_CHUNK;
+  char *buf = malloc(cap);
+  *len = 0;
+
+  size_t n;
+  while (buf != NULL && (n = fread(buf + *len, 1, cap - *len, fp)) > 0) {
+    *len += n;
+    if (*len == cap) {
+      char *tmp = realloc(buf, cap *= 2);
+      if (tmp == NULL) {
+        free(buf);
+      }
+      buf = tmp;
+    }
   }
 
-  p = advance_until_cmd(buf, fp);
-  if (p == NULL) {
-    err2(prereq, n_prereq, target, err);
+  if (buf != NULL && ferror(fp)) {
+    free(buf);
     return NULL;
   }
 
-  size_t n_words = parse_cmd(cmd, &p);
+  return buf;
+}
 
-  rule *r = create_rule(target, dupe_str_array(n_prereq, prereq),
-                        dupe_str_array(n_words, cmd));
+/**
+ * Parse all rules and pool declarations in the input.
+ *
+ * @param ps    State of the pass.
+ * @return      True if the input is a valid makefile, false on error.
+ */
+static bool parse_rules(struct parse *ps) {
+  while (next_line(ps)) {
+    if (!(is_pool_line(ps) ? parse_pool(ps) : parse_rule(ps))) {
+      return false;
+    }
+  }
 
-  return r;
+  return true;
 }
 
 /**
- * Extract target from next line in fp, updates p to point to the first
- * non-blank character after ':' in buf. Also reads in a full line to buf from
- * fp.
+ * Parse a rule starting at the current position, which must be the start of
+ * a non-blank line.
  *
- * @param p   Pointer that keeps info about the current place in line.
- * @param buf Buffer that should be filled with one line from fp.
- * @param fp  File pointer from where the next line should be red.
- * @param err Pointer to bool that keeps track if error occured.
- * @return    Target if line is as expected, NULL if error.
+ * @param ps    State of the pass.
+ * @return      True if a rule was parsed, false on error.
  */
-static char *extract_target(char **p, char *buf, FILE *fp, bool *err) {
-  // read line with target and prerequisites
-  if ((*p = next_line(buf, fp)) == NULL) {
-    return NULL;
+static bool parse_rule(struct parse *ps) {
+  // line cannot begin with whitespace
+  if (isspace(*ps->p)) {
+    return false;
   }
 
-  // line cannot begin with whitespace
-  if (isspace(**p)) {
-    err0(err);
-    return NULL;
+  size_t n = word_len(ps, ':');
+  if (n == 0) {
+    return false;
   }
 
-  char *target = parse_word(p, ":");
+  rule *r = ps->rules ? &ps->rules[ps->n_rules] : NULL;
+  char *target = emit_word(ps, ps->p, n);
+  ps->p += n;
 
-  skipwhite(p);
+  skipwhite(ps);
+  if (!expect(ps, ':')) {
+    return false;
+  }
+  skipwhite(ps);
 
-  if (!expect(p, ':')) {
-    err1(target, err);
-    return NULL;
+  // Prerequisites until end of line
+  char **prereq = ps->words ? &ps->words[ps->n_words] : NULL;
+  parse_words(ps);
+
+  if (!expect(ps, '\n')) {
+    return false;
+  }
+
+  // command has to begin with tab
+  if (!next_line(ps) || !expect(ps, '\t')) {
+    return false;
   }
+  skipwhite(ps);
 
-  skipwhite(p);
+  char **cmd = ps->words ? &ps->words[ps->n_words] : NULL;
+  parse_words(ps);
+
+  // Attribute lines are indented like the command
+  char **attrs = ps->words ? &ps->words[ps->n_words] : NULL;
+  while (next_line(ps) && *ps->p == '\t') {
+    if (!parse_attr(ps)) {
+      return false;
+    }
+  }
+  emit_slot(ps, NULL);
+
+  if (r != NULL) {
+    r->target = target;
+    r->hash = hash_str(target);
+    r->prereq = prereq;
+    r->cmd = cmd;
+    r->attrs = attrs;
+  }
+  ps->n_rules++;
 
-  return target;
+  return true;
 }
 
 /**
- * Parse prerequisites and andvance p to end of line
+ * Check if the line at the current position declares a pool. A line
+ * starting with the word pool is a rule if a ':' follows the word.
  *
- * @param prereq    Array to fill with prerequisites, should be previously
- *                  allocated.
- * @param n_prereq  Pointer to number of prerequisites that is filled with
- *                  number of prerequisites.
- * @param p         Pointer to place in string that is updated to end of line.
- * @return          Pointer to end of line in buffer, NULL if error.
+ * @param ps    State of the pass.
+ * @return      True if the line is a pool declaration.
  */
-static char *parse_prereqs(char **p, char **prereq, size_t *n_prereq) {
-  *n_prereq = 0;
-  while (*n_prereq < MAX_PREREQ &&
-         (prereq[*n_prereq] = parse_word(p, "")) != NULL) {
-    (*n_prereq)++;
-    skipwhite(p);
+static bool is_pool_line(const struct parse *ps) {
+  size_t n = word_len(ps, ':');
+  if (n != 4 || memcmp(ps->p, "pool", 4) != 0) {
+    return false;
   }
 
-  if (!expect(p, '\n')) {
-    return NULL;
+  const char *p = ps->p + n;
+  while (p < ps->end && (*p == ' ' || *p == '\t')) {
+    p++;
   }
 
-  return *p;
+  return p < ps->end && *p != ':';
 }
 
 /**
- * Advance until start of a command by reaing next row in fp.
+ * Parse a pool declaration, "pool NAME = DEPTH" where DEPTH is a positive
+ * number.
  *
- * @param buf   Pointer to the buffer to fill, must be allocated before.
- * @param fp    File pointer to the file that should be red .
- * @return      Pointer to place in buf where command starts, NULL if error.
+ * @param ps    State of the pass.
+ * @return      True if a pool was parsed, false on error.
  */
-static char *advance_until_cmd(char *buf, FILE *fp) {
-  char *p;
-  if ((p = next_line(buf, fp)) == NULL) {
-    return NULL;
+static bool parse_pool(struct parse *ps) {
+  ps->p += 4;
+  skipwhite(ps);
+
+  size_t n = word_len(ps, '=');
+  if (n == 0) {
+    return false;
   }
+  char *name = emit_word(ps, ps->p, n);
+  ps->p += n;
 
-  // command has to begin with tab
-  if (!expect(&p, '\t')) {
-    return NULL;
+  skipwhite(ps);
+  if (!expect(ps, '=')) {
+    return false;
   }
+  skipwhite(ps);
 
-  skipwhite(&p);
+  long depth = 0;
+  const char *digits = ps->p;
+  while (ps->p < ps->end && isdigit(*ps->p) && depth <= INT_MAX) {
+    depth = 10 * depth + (*ps->p++ - '0');
+  }
+  if (ps->p == digits || depth < 1 || depth > INT_MAX || !expect_eol(ps)) {
+    return false;
+  }
 
-  return p;
+  if (ps->pools != NULL) {
+    ps->pools[ps->n_pools].name = name;
+    ps->pools[ps->n_pools].depth = depth;
+  }
+  ps->n_pools++;
+
+  return true;
 }
 
 /**
- * Parse a command and insert words into **cmd.
+ * Parse an attribute line, a tab followed by "key = value", into a key and a
+ * value word.
  *
- * @param cmd     Array of words in a command that is previous allocated.
- * @param p       Pointer to current adress in the line to parse.
- * @return        Number of words that is parsed in command, ie the length of
- * the array cmd.
+ * @param ps    State of the pass, at the tab.
+ * @return      True if an attribute was parsed, false on error.
  */
-static size_t parse_cmd(char **cmd, char **p) {
-  size_t n_words = 0;
-  while (n_words < MAX_CMD && (cmd[n_words] = parse_word(p, "")) != NULL) {
-    n_words++;
-    skipwhite(p);
+static bool parse_attr(struct parse *ps) {
+  ps->p++;
+  skipwhite(ps);
+
+  size_t n = word_len(ps, '=');
+  if (n == 0) {
+    return false;
+  }
+  emit_slot(ps, emit_word(ps, ps->p, n));
+  ps->p += n;
+
+  skipwhite(ps);
+  if (!expect(ps, '=')) {
+    return false;
+  }
+  skipwhite(ps);
+
+  n = word_len(ps, ' ');
+  if (n == 0) {
+    return false;
   }
+  emit_slot(ps, emit_word(ps, ps->p, n));
+  ps->p += n;
 
-  return n_words;
+  return expect_eol(ps);
 }
 
 /**
- * Creates a rule given a target, a prereq string and a cmd_str.
+ * Check that only whitespace is left on the current line.
  *
- * @param target	Target in makefile.
- * @param prereq	Pointer to array with prerequisites.
- * @param cmd		Pointer to commands to run.
- * @return 			A rule that is allocated.
- * @note 			Rule must be freed when not needed anymore.
+ * @param ps    State of the pass.
+ * @return      True at the end of the line or input.
  */
-static rule *create_rule(char *target, char **prereq, char **cmd) {
-  rule *r = malloc(sizeof *r);
-  r->target = target;
-  r->prereq = prereq;
-  r->cmd = cmd;
-
-  return r;
+static bool expect_eol(struct parse *ps) {
+  skipwhite(ps);
+  return ps->p == ps->end || *ps->p == '\n';
 }
 
 /**
- * Duplicate an array of strings.
+ * Skip the rest of the current line if p is at its end, and any blank lines
+ * after it, so that p points to the start of the next non-blank line.
  *
- * @param n     Size of array to duplicate.
- * @param a     Array to duplicate.
- * @return      NULL-terminated array which should be freed using free.
+ * @param ps    State of the pass.
+ * @return      True if there is another non-blank line, false at end of
+ *              input.
  */
-static char **dupe_str_array(size_t n, char **a) {
-  char **ret = malloc((n + 1) * sizeof *ret);
+static bool next_line(struct parse *ps) {
+  for (;;) {
+    const char *eol = memchr(ps->p, '\n', ps->end - ps->p);
+    const char *next = eol ? eol + 1 : ps->end;
 
-  for (size_t i = 0; i < n; i++) {
-    ret[i] = a[i];
+    if (ps->p == ps->end) {
+      return false;
+    }
+    if (!is_blank_line(ps->p, next)) {
+      return true;
+    }
+    ps->p = next;
   }
-  ret[n] = NULL;
-
-  return ret;
 }
 
 /**
- * Fills buf with the next line from fp. Returns buf if a line was read and
- * NULL otherwise.
+ * Parse the words up to the end of the line into a NULL-terminated slice of
+ * the shared word array.
  *
- * @param buf   The buffer with the contents of the next line.
- * @param fp    The file to read.
- * @return      The buffer.
+ * @param ps    State of the pass.
  */
-static char *next_line(char buf[MAX_LINE], FILE *fp) {
-  do {
-    if (fgets(buf, MAX_LINE, fp) == NULL) {
-      return NULL;
-    }
-  } while (is_blank_line(buf));
+static void parse_words(struct parse *ps) {
+  size_t n;
+  while ((n = word_len(ps, ' ')) > 0) {
+    emit_slot(ps, emit_word(ps, ps->p, n));
+    ps->p += n;
+    skipwhite(ps);
+  }
 
-  return buf;
+  emit_slot(ps, NULL);
 }
 
 /**
- * Parse a word and update p to point to the first character after the word.
- * The word is delimited by whitespace and any character in delim. The
- * returned string should be freed using free.
+ * Append a pointer to the shared word array. In the counting pass only the
+ * slot is counted.
  *
- * @param p     A pointer to the first character after the word.
- * @param delim A string of delimeters.
- * @return      A string with the word.
+ * @param ps    State of the pass.
+ * @param word  The word, or NULL to end a slice.
  */
-static char *parse_word(char **p, char *delim) {
-  size_t n = 0;
-  while (!isspace((*p)[n]) && strchr(delim, (*p)[n]) == NULL) {
-    n++;
+static void emit_slot(struct parse *ps, char *word) {
+  if (ps->words != NULL) {
+    ps->words[ps->n_words] = word;
   }
+  ps->n_words++;
+}
 
-  if (n == 0) {
-    return NULL;
+/**
+ * Copy a word into the string area. In the counting pass only its size is
+ * counted.
+ *
+ * @param ps    State of the pass.
+ * @param word  Start of the word in the input.
+ * @param n     Length of the word.
+ * @return      The copied string, NULL in the counting pass.
+ */
+static char *emit_word(struct parse *ps, const char *word, size_t n) {
+  char *s = NULL;
+  if (ps->strs != NULL) {
+    s = ps->strs + ps->n_strs;
+    memcpy(s, word, n);
+    s[n] = '\0';
   }
+  ps->n_strs += n + 1;
 
-  char *word = strndup(*p, n);
-  *p += n;
+  return s;
+}
+
+/**
+ * Get the length of the word at the current position. The word is delimited
+ * by whitespace, the end of input and delim.
+ *
+ * @param ps    State of the pass.
+ * @param delim Another character that ends the word, ' ' for none.
+ * @return      Length of the word, 0 if there is none.
+ */
+static size_t word_len(const struct parse *ps, char delim) {
+  const char *p = ps->p;
+  while (p < ps->end && !isspace(*p) && *p != delim) {
+    p++;
+  }
 
-  return word;
+  return p - ps->p;
 }
 
 /**
- * Advance pointer to the next character which is not a space, stops at
- * newline.
+ * Advance to the next character which is not a space, stops at newline.
  *
- * @param p     The pointer to a character.
+ * @param ps    State of the pass.
  */
-static void skipwhite(char **p) {
-  while (isspace(**p) && **p != '\n') {
-    (*p)++;
+static void skipwhite(struct parse *ps) {
+  while (ps->p < ps->end && isspace(*ps->p) && *ps->p != '\n') {
+    ps->p++;
   }
 }
 
 /**
- * Check that the character pointed to by p is c, and increment p if it is.
+ * Check that the current character is c, and advance past it if it is.
  *
- * @param p    The pointer to a character.
+ * @param ps   State of the pass.
  * @param c    The character to compare with.
  * @return     True if equal, false otherwise.
  */
-static bool expect(char **p, char c) {
-  if (**p != c) {
+static bool expect(struct parse *ps, char c) {
+  if (ps->p == ps->end || *ps->p != c) {
     return false;
   }
 
-  (*p)++;
+  ps->p++;
 
   return true;
 }
@@ -358,99 +642,250 @@ static bool expect(char **p, char c) {
 /**
  * Check if line is blank.
  *
- * @param s    The string (line) to check.
+ * @param s    Start of the line.
+ * @param end  End of the line.
  * @return     True if line is blank, false otherwise.
  */
-static bool is_blank_line(const char *s) {
-  size_t i = 0;
-  while (s[i] != '\0') {
-    if (!isspace(s[i])) {
+static bool is_blank_line(const char *s, const char *end) {
+  for (; s < end; s++) {
+    if (!isspace(*s)) {
       return false;
     }
-    i++;
   }
 
   return true;
 }
 
 /**
- * Free an array until NULL found
- * @param arr   Array to free
+ * Build the hash index over the targets of all rules. The table is kept at
+ * most half full so that probe sequences stay short. If a target has several
+ * rules the first one wins.
+ *
+ * @param m     The makefile with its rules and an index of index_cap slots.
  */
-static void free_arr(char **arr) {
-  size_t i = 0;
-  while (arr[i] != NULL) {
-    free(arr[i]);
-    i++;
+static void build_index(makefile *m) {
+  size_t mask = m->index_cap - 1;
+
+  memset(m->index, 0, m->index_cap * sizeof *m->index);
+  for (size_t j = 0; j < m->n_rules; j++) {
+    rule *r = &m->rules[j];
+    size_t i = r->hash & mask;
+    while (m->index[i] != NULL && (m->index[i]->hash != r->hash ||
+                                   strcmp(m->index[i]->target, r->target))) {
+      i = (i + 1) & mask;
+    }
+
+    if (m->index[i] == NULL) {
+      m->index[i] = r;
+    }
   }
 }
 
 /**
- * Recursively delete a list of rules.
+ * Get the path of the precompiled graph for a makefile, a hidden file in the
+ * same directory.
  *
- * @param rules   The rules to delete.
+ * @param path  Path of the makefile.
+ * @return      Allocated path of the graph file, NULL on failure.
  */
-static void del_rules(struct rule *rules) {
-  if (rules == NULL) {
-    return;
+static char *graph_path(const char *path) {
+  char *dir_copy = strdup(path);
+  char *base_copy = strdup(path);
+  char *gpath = NULL;
+
+  if (dir_copy != NULL && base_copy != NULL) {
+    const char *dir = dirname(dir_copy);
+    const char *base = basename(base_copy);
+    size_t len = strlen(dir) + strlen(base) + 7;
+
+    gpath = malloc(len);
+    if (gpath != NULL) {
+      snprintf(gpath, len, "%s/.%s.mmc", dir, base);
+    }
   }
 
-  free(rules->target);
+  free(dir_copy);
+  free(base_copy);
+  return gpath;
+}
 
-  free_arr(rules->prereq);
-  free(rules->prereq);
+/**
+ * Map a precompiled graph and relocate it to where it was mapped. The
+ * mapping is private, so relocating does not change the file. The block is
+ * hashed before it is used, so a damaged file is parsed again instead.
+ *
+ * @param gpath Path of the graph file.
+ * @param st    Stat data of the makefile.
+ * @param hash  Content hash of the makefile.
+ * @return      The makefile, NULL if there is no graph file or it does not
+ *              belong to this version of the makefile.
+ */
+static makefile *load_graph(const char *gpath, const struct stat *st,
+                            uint64_t hash) {
+  int fd = open(gpath, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
 
-  free_arr(rules->cmd);
-  free(rules->cmd);
+  struct stat gst;
+  if (fstat(fd, &gst) != 0 ||
+      (size_t)gst.st_size < sizeof(struct graph_header) + sizeof(makefile)) {
+    close(fd);
+    return NULL;
+  }
 
-  del_rules(rules->next);
+  char *map =
+      mmap(NULL, gst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
 
-  free(rules);
-}
+  struct graph_header *h = (struct graph_header *)map;
+  makefile *m = (makefile *)(h + 1);
+
+  if (memcmp(h->magic, GRAPH_MAGIC, 4) != 0 || h->version != GRAPH_VERSION ||
+      h->byte_order != GRAPH_BYTE_ORDER || h->ptr_size != sizeof(void *) ||
+      h->src_size != st->st_size || h->src_mtime_sec != st->st_mtim.tv_sec ||
+      h->src_mtime_nsec != st->st_mtim.tv_nsec || h->src_hash != hash ||
+      h->block_size != gst.st_size - sizeof *h || m->size != h->block_size ||
+      hash_bytes(m, h->block_size, 0) != h->block_hash ||
+      !relocate(m, 0, (uintptr_t)m)) {
+    munmap(map, gst.st_size);
+    return NULL;
+  }
+  m->map_len = gst.st_size;
 
-/* ------------------------ Internal error handling ------------------------ */
+  return m;
+}
 
 /**
- * Sets err to true, lowest order of error cleanup
+ * Write a precompiled graph for a makefile. The file is written under a
+ * temporary name and renamed into place. Failing to write it is not an
+ * error, the makefile is just parsed again next time.
  *
- * @note There exists 3 levels of error cleanup, err0, err1, and err2.
- * When err2 is called, it means that err2 is performed, then err1, and lastly
- * err0. If err0 is called, only err0 is executed.
- * @param err Pointer to bool with error
- * @return
+ * @param m     The parsed makefile.
+ * @param gpath Path of the graph file.
+ * @param st    Stat data of the makefile.
+ * @param hash  Content hash of the makefile.
  */
-static void err0(bool *err) { *err = true; }
+static void save_graph(const makefile *m, const char *gpath,
+                       const struct stat *st, uint64_t hash) {
+  struct graph_header h = {
+      .magic = GRAPH_MAGIC,
+      .version = GRAPH_VERSION,
+      .byte_order = GRAPH_BYTE_ORDER,
+      .ptr_size = sizeof(void *),
+      .src_size = st->st_size,
+      .src_mtime_sec = st->st_mtim.tv_sec,
+      .src_mtime_nsec = st->st_mtim.tv_nsec,
+      .src_hash = hash,
+      .block_size = m->size,
+  };
+
+  makefile *copy = malloc(m->size);
+  size_t tmp_len = strlen(gpath) + 8;
+  char *tmp = malloc(tmp_len);
+  if (copy == NULL || tmp == NULL) {
+    free(copy);
+    free(tmp);
+    return;
+  }
 
-/**
- * Middle order of cleanup, frees target and calls err0()
- *
- * @note There exists 3 levels of error cleanup, err0, err1, and err2.
- * When err2 is called, it means that err2 is performed, then err1, and lastly
- * err0. If err0 is called, only err0 is executed.
- * @param target    Allocated target to free
- * @param err       Pointer to bool that tells if error occured
- * @return
- */
-static void err1(char *target, bool *err) {
-  free(target);
-  err0(err);
+  // Turn the pointers of the copy into offsets from its start
+  memcpy(copy, m, m->size);
+  copy->map_len = 0;
+  relocate(copy, (uintptr_t)m, 0);
+  h.block_hash = hash_bytes(copy, m->size, 0);
+
+  snprintf(tmp, tmp_len, "%s.XXXXXX", gpath);
+  int fd = mkstemp(tmp);
+  if (fd != -1) {
+    FILE *out = fdopen(fd, "w");
+    bool ok = out != NULL && fwrite(&h, sizeof h, 1, out) == 1 &&
+              fwrite(copy, m->size, 1, out) == 1;
+    if (out == NULL) {
+      close(fd);
+    } else if (fclose(out) != 0) {
+      ok = false;
+    }
+
+    if (!ok || rename(tmp, gpath) != 0) {
+      unlink(tmp);
+    }
+  }
+
+  free(copy);
+  free(tmp);
 }
 
 /**
- * Highest order of cleanup, frees prereqs and calls err1()
+ * Move every pointer in a makefile block from one base address to another.
+ * With from set to 0 the pointers are offsets, which are checked to be
+ * inside the block, and the counts are checked before the layout is
+ * computed from them.
  *
- * @note There exists 3 levels of error cleanup, err0, err1, and err2.
- * When err2 is called, it means that err2 is performed, then err1, and lastly
- * err0. If err0 is called, only err0 is executed.
- * @param prereq    Allocated array of prereqs to free
- * @param n_prereq  Number of elements in prereq to free
- * @param target    Allocated target to free
- * @param err       Pointer to bool that tells if error occured
- * @return
+ * @param m     The makefile block, laid out as by parse_makefile.
+ * @param from  Base address the pointers are relative to now.
+ * @param to    Base address they should be relative to.
+ * @return      False if an offset or a count does not fit the block.
  */
-static void err2(char *prereq[], size_t n_prereq, char *target, bool *err) {
-  for (size_t i = 0; i < n_prereq; i++) {
-    free(prereq[i]);
+static bool relocate(makefile *m, uintptr_t from, uintptr_t to) {
+  // Each part is at most the block, so adding them up cannot overflow
+  if (from == 0 && (m->n_rules > m->size / sizeof(rule) ||
+                    m->index_cap > m->size / sizeof(rule *) ||
+                    m->n_pools > m->size / sizeof(struct pool) ||
+                    m->n_words > m->size / sizeof(char *) ||
+                    m->index_cap == 0 ||
+                    (m->index_cap & (m->index_cap - 1)) != 0)) {
+    return false;
+  }
+
+  // The layout follows from the counts, which are not pointers
+  size_t fixed = sizeof *m + m->n_rules * sizeof(rule) +
+                 m->index_cap * sizeof(rule *) +
+                 m->n_pools * sizeof(struct pool) + m->n_words * sizeof(char *);
+  if (fixed > m->size) {
+    return false;
+  }
+
+  rule *rules = (rule *)(m + 1);
+  rule **index = (rule **)(rules + m->n_rules);
+  struct pool *pools = (struct pool *)(index + m->index_cap);
+  char **words = (char **)(pools + m->n_pools);
+
+#define RELOC(p)                                                               \
+  do {                                                                         \
+    if ((p) != NULL) {                                                         \
+      uintptr_t off = (uintptr_t)(p) - from;                                   \
+      if (from == 0 && off >= m->size) {                                       \
+        return false;                                                          \
+      }                                                                        \
+      (p) = (void *)(off + to);                                                \
+    }                                                                          \
+  } while (0)
+
+  RELOC(m->rules);
+  RELOC(m->index);
+  RELOC(m->pools);
+  RELOC(m->words);
+  for (size_t i = 0; i < m->n_rules; i++) {
+    RELOC(rules[i].target);
+    RELOC(rules[i].prereq);
+    RELOC(rules[i].cmd);
+    RELOC(rules[i].attrs);
+  }
+  for (size_t i = 0; i < m->n_pools; i++) {
+    RELOC(pools[i].name);
   }
-  err1(target, err);
+  for (size_t i = 0; i < m->index_cap; i++) {
+    RELOC(index[i]);
+  }
+  for (size_t i = 0; i < m->n_words; i++) {
+    RELOC(words[i]);
+  }
+
+#undef RELOC
+
+  return true;
 }
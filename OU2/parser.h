@@ -30,6 +30,19 @@ typedef struct rule rule;
  */
 makefile *parse_makefile(FILE *fp);
 
+/**
+ * Parse a makefile like parse_makefile, but keep a precompiled copy of the
+ * parsed graph in a file next to the makefile. When the makefile has the
+ * same size, mtime and contents as when the copy was written, the copy is
+ * mapped into memory and used without parsing. Otherwise the makefile is
+ * parsed and the copy rewritten. Small makefiles are always parsed.
+ *
+ * @param fp    The file to parse, opened at its start.
+ * @param path  Path of the file, used to place the precompiled copy.
+ * @return      A pointer to a structure of the type makefile, or NULL.
+ */
+makefile *parse_makefile_cached(FILE *fp, const char *path);
+
 /**
  * Returns a pointer to the name of the default target for a makefile. (The
  * default target is the target for the first rule.)
@@ -69,6 +82,29 @@ const char **rule_prereq(rule *rule);
  */
 char **rule_cmd(rule *rule);
 
+/**
+ * Returns the value of an attribute of a rule. Attributes are given on lines
+ * of the form "key = value", indented with a tab, after the command of the
+ * rule.
+ *
+ * @param rule  A pointer to the rule.
+ * @param key   Name of the attribute.
+ * @return      A pointer to the value, or NULL if the rule does not set the
+ *              attribute.
+ */
+const char *rule_attr(rule *rule, const char *key);
+
+/**
+ * Returns the depth of a pool declared in the makefile with a line of the
+ * form "pool NAME = DEPTH". At most DEPTH jobs of rules with the attribute
+ * "pool = NAME" run at once.
+ *
+ * @param make  A pointer to a structue of type makefile.
+ * @param name  Name of the pool.
+ * @return      The depth of the pool, or -1 if it is not declared.
+ */
+int makefile_pool_depth(makefile *make, const char *name);
+
 /**
  * Free the memory of a structure of the type makefile. This will also
  * deallocate the memory for rules returned by makefile_rule.
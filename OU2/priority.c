@@ -0,0 +1,202 @@
+#include "priority.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Running node of the simulation
+struct event {
+  int64_t end_us;
+  size_t node;
+};
+
+static void ready_push(const graph *g, const double *rank, size_t *heap,
+                       size_t *n, size_t i);
+static size_t ready_pop(const graph *g, const double *rank, size_t *heap,
+                        size_t *n);
+static void event_push(struct event *heap, size_t *n, struct event e);
+static struct event event_pop(struct event *heap, size_t *n);
+
+void priority_ranks(const graph *g, const int64_t *dur_us, double *rank) {
+  // Targets without history weigh as much as an average known recipe
+  double known = 0;
+  size_t n_known = 0;
+  for (size_t i = 0; i < g->n; i++) {
+    if (dur_us[i] > 0) {
+      known += dur_us[i];
+      n_known++;
+    }
+  }
+  double unknown = n_known > 0 ? known / n_known : 1;
+
+  // Dependents always have higher node numbers than their prerequisites
+  for (size_t i = g->n; i-- > 0;) {
+    double longest = 0;
+    for (size_t e = g->dependent_off[i]; e < g->dependent_off[i + 1]; e++) {
+      if (rank[g->dependents[e]] > longest) {
+        longest = rank[g->dependents[e]];
+      }
+    }
+    rank[i] = longest + (dur_us[i] == PRIORITY_UNKNOWN ? unknown : dur_us[i]);
+  }
+}
+
+bool priority_before(const graph *g, const double *rank, size_t a, size_t b) {
+  if (rank) {
+    if (rank[a] != rank[b]) {
+      return rank[a] > rank[b];
+    }
+    size_t deps_a = g->dependent_off[a + 1] - g->dependent_off[a];
+    size_t deps_b = g->dependent_off[b + 1] - g->dependent_off[b];
+    if (deps_a != deps_b) {
+      return deps_a > deps_b;
+    }
+  }
+
+  return a < b;
+}
+
+int64_t priority_makespan(const graph *g, const int64_t *dur_us,
+                          const double *rank, size_t slots) {
+  size_t *pending = malloc(g->n * sizeof *pending);
+  size_t *ready = malloc(g->n * sizeof *ready);
+  struct event *running = malloc(g->n * sizeof *running);
+  int64_t now = -1;
+
+  if (!pending || !ready || !running) {
+    perror("malloc");
+    goto out;
+  }
+
+  size_t n_ready = 0;
+  size_t n_running = 0;
+  if (slots == 0) {
+    slots = 1;
+  }
+  for (size_t i = 0; i < g->n; i++) {
+    pending[i] = graph_n_prereq(g, i);
+    if (pending[i] == 0) {
+      ready_push(g, rank, ready, &n_ready, i);
+    }
+  }
+
+  now = 0;
+  while (n_ready > 0 || n_running > 0) {
+    while (n_ready > 0 && n_running < slots) {
+      size_t i = ready_pop(g, rank, ready, &n_ready);
+      event_push(running, &n_running, (struct event){now + dur_us[i], i});
+    }
+
+    struct event e = event_pop(running, &n_running);
+    now = e.end_us;
+
+    for (size_t j = g->dependent_off[e.node]; j < g->dependent_off[e.node + 1];
+         j++) {
+      size_t d = g->dependents[j];
+      if (--pending[d] == 0) {
+        ready_push(g, rank, ready, &n_ready, d);
+      }
+    }
+  }
+
+out:
+  free(pending);
+  free(ready);
+  free(running);
+  return now;
+}
+
+/*
+ * ready_push - Adds a node to a heap ordered by priority_before
+ *
+ * @param g     The graph
+ * @param rank  Ranks or NULL
+ * @param heap  The heap
+ * @param n     Number of nodes in the heap, updated
+ * @param i     Node number
+ * */
+static void ready_push(const graph *g, const double *rank, size_t *heap,
+                       size_t *n, size_t i) {
+  size_t pos = (*n)++;
+  while (pos > 0 && priority_before(g, rank, i, heap[(pos - 1) / 2])) {
+    heap[pos] = heap[(pos - 1) / 2];
+    pos = (pos - 1) / 2;
+  }
+  heap[pos] = i;
+}
+
+/*
+ * ready_pop - Removes the first node from a heap ordered by priority_before
+ *
+ * @param g     The graph
+ * @param rank  Ranks or NULL
+ * @param heap  The heap, not empty
+ * @param n     Number of nodes in the heap, updated
+ *
+ * @return Node number
+ * */
+static size_t ready_pop(const graph *g, const double *rank, size_t *heap,
+                        size_t *n) {
+  size_t top = heap[0];
+  size_t last = heap[--*n];
+  size_t pos = 0;
+
+  while (2 * pos + 1 < *n) {
+    size_t child = 2 * pos + 1;
+    if (child + 1 < *n &&
+        priority_before(g, rank, heap[child + 1], heap[child])) {
+      child++;
+    }
+    if (!priority_before(g, rank, heap[child], last)) {
+      break;
+    }
+    heap[pos] = heap[child];
+    pos = child;
+  }
+  heap[pos] = last;
+
+  return top;
+}
+
+/*
+ * event_push - Adds a running node to a heap ordered by end time
+ *
+ * @param heap  The heap
+ * @param n     Number of events in the heap, updated
+ * @param e     The event
+ * */
+static void event_push(struct event *heap, size_t *n, struct event e) {
+  size_t pos = (*n)++;
+  while (pos > 0 && heap[(pos - 1) / 2].end_us > e.end_us) {
+    heap[pos] = heap[(pos - 1) / 2];
+    pos = (pos - 1) / 2;
+  }
+  heap[pos] = e;
+}
+
+/*
+ * event_pop - Removes the running node that ends first
+ *
+ * @param heap  The heap, not empty
+ * @param n     Number of events in the heap, updated
+ *
+ * @return The event
+ * */
+static struct event event_pop(struct event *heap, size_t *n) {
+  struct event top = heap[0];
+  struct event last = heap[--*n];
+  size_t pos = 0;
+
+  while (2 * pos + 1 < *n) {
+    size_t child = 2 * pos + 1;
+    if (child + 1 < *n && heap[child + 1].end_us < heap[child].end_us) {
+      child++;
+    }
+    if (heap[child].end_us >= last.end_us) {
+      break;
+    }
+    heap[pos] = heap[child];
+    pos = child;
+  }
+  heap[pos] = last;
+
+  return top;
+}
@@ -0,0 +1,59 @@
+/**
+ * Order in which ready targets are started by a parallel build. Targets are
+ * ranked by the expected length of the longest chain of recipes from the
+ * target to a goal, so the chain that bounds the build time starts first.
+ * Expected durations come from earlier runs; targets without history count
+ * as an average recipe, and ties go to the target more others wait for.
+ *
+ * @file priority.h
+ */
+
+#ifndef PRIORITY_H
+#define PRIORITY_H
+
+#include "graph.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Expected duration of a target with no recorded history
+#define PRIORITY_UNKNOWN (-1)
+
+/*
+ * priority_ranks - Computes the rank of every node, the expected time from
+ * starting the node until the goal that depends on it can finish
+ *
+ * @param g         The graph
+ * @param dur_us    Expected duration of each node in microseconds, 0 for
+ *                  nodes without a recipe, PRIORITY_UNKNOWN without history
+ * @param rank      Array of g->n ranks to fill
+ * */
+void priority_ranks(const graph *g, const int64_t *dur_us, double *rank);
+
+/*
+ * priority_before - Compares two ready nodes
+ *
+ * @param g     The graph
+ * @param rank  Ranks from priority_ranks, or NULL for node order
+ * @param a     Node number
+ * @param b     Node number
+ *
+ * @return true if a should start before b
+ * */
+bool priority_before(const graph *g, const double *rank, size_t a, size_t b);
+
+/*
+ * priority_makespan - Simulates a build of the whole graph with a number of
+ * job slots, where a free slot always takes the first ready node
+ *
+ * @param g         The graph
+ * @param dur_us    Duration of each node in microseconds
+ * @param rank      Ranks deciding which node is first, or NULL for node
+ *                  order
+ * @param slots     Number of job slots
+ *
+ * @return Simulated wall time in microseconds, -1 on allocation failure
+ * */
+int64_t priority_makespan(const graph *g, const int64_t *dur_us,
+                          const double *rank, size_t slots);
+
+#endif
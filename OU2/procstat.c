@@ -0,0 +1,57 @@
+#include "procstat.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+int procstat_loadavg(double *out) {
+  FILE *f = fopen("/proc/loadavg", "r");
+  if (!f) {
+    return -1;
+  }
+
+  int n = fscanf(f, "%lf", out);
+  fclose(f);
+  return n == 1 ? 0 : -1;
+}
+
+int procstat_mem_available(uint64_t *out) {
+  FILE *f = fopen("/proc/meminfo", "r");
+  if (!f) {
+    return -1;
+  }
+
+  char line[256];
+  uint64_t kib;
+  int status = -1;
+  while (fgets(line, sizeof line, f)) {
+    if (sscanf(line, "MemAvailable: %" SCNu64 " kB", &kib) == 1) {
+      *out = kib * 1024;
+      status = 0;
+      break;
+    }
+  }
+
+  fclose(f);
+  return status;
+}
+
+int procstat_rss(pid_t pid, uint64_t *out) {
+  char path[64];
+  snprintf(path, sizeof path, "/proc/%ld/statm", (long)pid);
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+
+  // Sizes are in pages, the second field is the resident set
+  uint64_t size, resident;
+  int n = fscanf(f, "%" SCNu64 " %" SCNu64, &size, &resident);
+  fclose(f);
+  if (n != 2) {
+    return -1;
+  }
+
+  *out = resident * (uint64_t)sysconf(_SC_PAGESIZE);
+  return 0;
+}
@@ -0,0 +1,43 @@
+/**
+ * System load and memory figures from /proc, used to decide whether the
+ * machine has room for another job.
+ *
+ * @file procstat.h
+ */
+
+#ifndef PROCSTAT_H
+#define PROCSTAT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * procstat_loadavg - Reads the one minute load average
+ *
+ * @param out   Filled with the load average on success
+ *
+ * @return 0 on success, -1 on failure
+ * */
+int procstat_loadavg(double *out);
+
+/*
+ * procstat_mem_available - Reads how much memory can be allocated without
+ * swapping, MemAvailable in /proc/meminfo
+ *
+ * @param out   Filled with the size in bytes on success
+ *
+ * @return 0 on success, -1 on failure
+ * */
+int procstat_mem_available(uint64_t *out);
+
+/*
+ * procstat_rss - Reads the resident set size of a process
+ *
+ * @param pid   The process
+ * @param out   Filled with the size in bytes on success
+ *
+ * @return 0 on success, -1 on failure
+ * */
+int procstat_rss(pid_t pid, uint64_t *out);
+
+#endif
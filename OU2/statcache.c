@@ -0,0 +1,279 @@
+#include "statcache.h"
+#include "hash.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct entry {
+  char *path; // NULL marks an empty slot
+  uint64_t hash;
+  bool valid;
+  struct file_info info;
+};
+
+// Stat calls mostly wait on the file system, so use more threads than CPUs
+#define PREFETCH_THREADS 16
+
+// Entries a prefetch thread claims at a time
+#define PREFETCH_CHUNK 16
+
+struct prefetch_job {
+  struct entry **entries;
+  size_t n;
+  size_t next; // Index of the next entry to fill, protected by lock
+  pthread_mutex_t lock;
+};
+
+struct statcache {
+  struct entry *entries;
+  size_t cap; // Always a power of two
+  size_t size;
+};
+
+static struct entry *find_slot(struct entry *entries, size_t cap,
+                               const char *path, uint64_t hash);
+static int grow(statcache *sc);
+static void fill(struct entry *e);
+static void *prefetch_worker(void *arg);
+
+statcache *statcache_new(void) {
+  statcache *sc = malloc(sizeof *sc);
+  if (!sc) {
+    return NULL;
+  }
+
+  sc->cap = 256;
+  sc->size = 0;
+  sc->entries = calloc(sc->cap, sizeof *sc->entries);
+  if (!sc->entries) {
+    free(sc);
+    return NULL;
+  }
+
+  return sc;
+}
+
+void statcache_del(statcache *sc) {
+  if (!sc) {
+    return;
+  }
+
+  for (size_t i = 0; i < sc->cap; i++) {
+    free(sc->entries[i].path);
+  }
+  free(sc->entries);
+  free(sc);
+}
+
+const struct file_info *statcache_get(statcache *sc, const char *path) {
+  uint64_t hash = hash_str(path);
+  struct entry *e = find_slot(sc->entries, sc->cap, path, hash);
+
+  if (!e->path) {
+    // Keep the table at most half full
+    if (2 * (sc->size + 1) > sc->cap) {
+      if (grow(sc) != 0) {
+        return NULL;
+      }
+      e = find_slot(sc->entries, sc->cap, path, hash);
+    }
+
+    e->path = strdup(path);
+    if (!e->path) {
+      return NULL;
+    }
+    e->hash = hash;
+    e->valid = false;
+    sc->size++;
+  }
+
+  if (!e->valid) {
+    fill(e);
+  }
+
+  return &e->info;
+}
+
+int statcache_prefetch(statcache *sc, const char **paths, size_t n) {
+  // Grow first so entry pointers stay valid while the threads run
+  while (2 * (sc->size + n) > sc->cap) {
+    if (grow(sc) != 0) {
+      return -1;
+    }
+  }
+
+  struct entry **todo = malloc((n + 1) * sizeof *todo);
+  if (!todo) {
+    return -1;
+  }
+
+  size_t n_todo = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t hash = hash_str(paths[i]);
+    struct entry *e = find_slot(sc->entries, sc->cap, paths[i], hash);
+
+    if (!e->path) {
+      if (!(e->path = strdup(paths[i]))) {
+        free(todo);
+        return -1;
+      }
+      e->hash = hash;
+      e->valid = false;
+      sc->size++;
+    } else if (e->valid) {
+      continue;
+    }
+
+    // Mark the entry so a path listed twice is only stat'ed once
+    e->valid = true;
+    todo[n_todo++] = e;
+  }
+
+  struct prefetch_job job = {.entries = todo, .n = n_todo};
+  pthread_mutex_init(&job.lock, NULL);
+
+  size_t n_threads = (n_todo + PREFETCH_CHUNK - 1) / PREFETCH_CHUNK;
+  if (n_threads > PREFETCH_THREADS) {
+    n_threads = PREFETCH_THREADS;
+  }
+
+  // The calling thread works too, so only start the extra ones
+  pthread_t threads[PREFETCH_THREADS];
+  size_t started = 0;
+  while (started + 1 < n_threads &&
+         pthread_create(&threads[started], NULL, prefetch_worker, &job) == 0) {
+    started++;
+  }
+
+  prefetch_worker(&job);
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&job.lock);
+  free(todo);
+
+  return 0;
+}
+
+void statcache_invalidate(statcache *sc, const char *path) {
+  struct entry *e = find_slot(sc->entries, sc->cap, path, hash_str(path));
+  if (e->path) {
+    e->valid = false;
+  }
+}
+
+void statcache_set_hash(statcache *sc, const char *path, uint64_t hash) {
+  struct entry *e = find_slot(sc->entries, sc->cap, path, hash_str(path));
+  if (e->path && e->valid) {
+    e->info.hashed = true;
+    e->info.hash = hash;
+  }
+}
+
+bool file_newer(const struct file_info *a, const struct file_info *b) {
+  if (a->mtime.tv_sec != b->mtime.tv_sec) {
+    return a->mtime.tv_sec > b->mtime.tv_sec;
+  }
+
+  return a->mtime.tv_nsec > b->mtime.tv_nsec;
+}
+
+/*
+ * find_slot - Finds the slot holding path, or the empty slot where it would
+ * be inserted, using linear probing
+ *
+ * @param entries   The table
+ * @param cap       Number of slots in the table
+ * @param path      The path to look for
+ * @param hash      Hash of path
+ *
+ * @return Pointer to the slot
+ * */
+static struct entry *find_slot(struct entry *entries, size_t cap,
+                               const char *path, uint64_t hash) {
+  size_t mask = cap - 1;
+  size_t i = hash & mask;
+
+  while (entries[i].path &&
+         (entries[i].hash != hash || strcmp(entries[i].path, path) != 0)) {
+    i = (i + 1) & mask;
+  }
+
+  return &entries[i];
+}
+
+/*
+ * grow - Doubles the size of the table and rehashes all entries
+ *
+ * @param sc    The cache
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int grow(statcache *sc) {
+  size_t cap = sc->cap * 2;
+  struct entry *entries = calloc(cap, sizeof *entries);
+  if (!entries) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < sc->cap; i++) {
+    struct entry *old = &sc->entries[i];
+    if (old->path) {
+      *find_slot(entries, cap, old->path, old->hash) = *old;
+    }
+  }
+
+  free(sc->entries);
+  sc->entries = entries;
+  sc->cap = cap;
+
+  return 0;
+}
+
+/*
+ * prefetch_worker - Thread function that fills entries of a shared job, a
+ * chunk at a time, until there are none left
+ *
+ * @param arg   Pointer to the struct prefetch_job
+ *
+ * @return NULL
+ * */
+static void *prefetch_worker(void *arg) {
+  struct prefetch_job *job = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    size_t start = job->next;
+    job->next += PREFETCH_CHUNK;
+    pthread_mutex_unlock(&job->lock);
+
+    if (start >= job->n) {
+      return NULL;
+    }
+
+    size_t end = start + PREFETCH_CHUNK < job->n ? start + PREFETCH_CHUNK
+                                                 : job->n;
+    for (size_t i = start; i < end; i++) {
+      fill(job->entries[i]);
+    }
+  }
+}
+
+/*
+ * fill - Stats the file of an entry and stores the result
+ *
+ * @param e     The entry
+ * */
+static void fill(struct entry *e) {
+  struct stat st;
+
+  e->info = (struct file_info){0};
+  if (stat(e->path, &st) == 0) {
+    e->info.exists = true;
+    e->info.mtime = st.st_mtim;
+    e->info.size = st.st_size;
+  }
+  e->valid = true;
+}
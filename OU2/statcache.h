@@ -0,0 +1,95 @@
+/**
+ * Per-run cache of file metadata. Every path is stat'ed at most once unless
+ * its entry is invalidated, which is done for a target after its recipe has
+ * run.
+ *
+ * @file statcache.h
+ */
+
+#ifndef STATCACHE_H
+#define STATCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct statcache statcache;
+
+struct file_info {
+  bool exists;
+  struct timespec mtime; // Only valid if exists is true
+  int64_t size;          // Only valid if exists is true
+  bool hashed;           // Set once hash holds the content hash
+  uint64_t hash;
+};
+
+/*
+ * statcache_new - Creates an empty stat cache
+ *
+ * @return Pointer to the cache or NULL on allocation failure
+ * */
+statcache *statcache_new(void);
+
+/*
+ * statcache_del - Frees the cache and all its entries
+ *
+ * @param sc    The cache
+ * */
+void statcache_del(statcache *sc);
+
+/*
+ * statcache_get - Looks up the metadata of a path, calling stat only if the
+ * path has no valid entry in the cache
+ *
+ * @param sc    The cache
+ * @param path  Path of the file
+ *
+ * @return Pointer to the cached metadata, valid until the next call that
+ * modifies the cache. NULL on allocation failure.
+ * */
+const struct file_info *statcache_get(statcache *sc, const char *path);
+
+/*
+ * statcache_prefetch - Stats every path that has no valid entry yet, with
+ * several threads so slow file systems answer many requests at once
+ *
+ * @param sc        The cache
+ * @param paths     Paths of the files
+ * @param n         Number of paths
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+int statcache_prefetch(statcache *sc, const char **paths, size_t n);
+
+/*
+ * statcache_invalidate - Marks the entry of a path as stale so the next
+ * lookup stats the file again
+ *
+ * @param sc    The cache
+ * @param path  Path of the file
+ * */
+void statcache_invalidate(statcache *sc, const char *path);
+
+/*
+ * statcache_set_hash - Stores the content hash of a path. The hash is
+ * dropped together with the rest of the entry when it is invalidated.
+ *
+ * @param sc    The cache
+ * @param path  Path of the file, must have been looked up before
+ * @param hash  The content hash
+ * */
+void statcache_set_hash(statcache *sc, const char *path, uint64_t hash);
+
+/*
+ * file_newer - Compares the modification times of two existing files with
+ * nanosecond precision
+ *
+ * @param a     Metadata of the first file
+ * @param b     Metadata of the second file
+ *
+ * @return true if a was modified after b
+ * */
+bool file_newer(const struct file_info *a, const struct file_info *b);
+
+#endif
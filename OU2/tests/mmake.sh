@@ -0,0 +1,136 @@
+#!/bin/bash
+# Regression tests of mmake. Each case builds a small mmakefile in a new
+# directory and checks the exit status, output or files of the run.
+#
+# Usage: tests/mmake.sh [MMAKE]
+
+MMAKE=$(realpath "${1:-./mmake}")
+FAILED=0
+
+ROOT=$(mktemp -d)
+trap 'rm -rf "$ROOT"' EXIT
+
+# start NAME - Makes and enters the directory of a case
+start() {
+    NAME=$1
+    mkdir "$ROOT/$NAME" && cd "$ROOT/$NAME" || exit 1
+}
+
+# expect DESCRIPTION CONDITION... - Passes the case if CONDITION succeeds
+expect() {
+    local what=$1
+    shift
+    if "$@"; then
+        echo "ok   $NAME: $what"
+    else
+        echo "FAIL $NAME: $what"
+        FAILED=1
+    fi
+}
+
+# A directory prerequisite is hashed by its stat data, it can not be read
+start dir-prereq
+mkdir d
+printf 'out: d\n\ttouch out\n' >mmakefile
+"$MMAKE" -H -c cache >/dev/null 2>err
+expect "builds with -H -c" [ $? = 0 -a -f out ]
+"$MMAKE" -H -c cache >/dev/null 2>>err
+expect "up to date on the next run" [ $? = 0 ]
+grep -q "Could not hash" err
+expect "no hash errors" [ $? = 1 ]
+
+# A partial last record is only cut while no other mmake has the log open
+start db-repair
+echo x >in
+printf 'out: in\n\tcp in out\n' >mmakefile
+"$MMAKE" -H >/dev/null
+size=$(stat -c %s .mmake_db)
+printf 'xxxxx' >>.mmake_db
+flock -s .mmake_db sleep 1 &
+sleep 0.3
+"$MMAKE" -H >/dev/null
+expect "keeps the log while it is locked" [ "$(stat -c %s .mmake_db)" = $((size + 5)) ]
+wait
+"$MMAKE" -H >/dev/null
+expect "cuts the partial record" [ "$(stat -c %s .mmake_db)" = "$size" ]
+printf 'JUNKJUNKJUNK' >.mmake_db
+"$MMAKE" -H >/dev/null 2>err
+"$MMAKE" -H >/dev/null 2>>err
+expect "warns once about a bad header" [ "$(grep -c damaged err)" = 1 ]
+
+# -B stores its outputs under the same key as a normal build
+start force-cache
+echo x >in
+printf 'out: in\n\tcp in out\n' >mmakefile
+"$MMAKE" -c cache >/dev/null 2>&1
+"$MMAKE" -B -c cache >/dev/null 2>&1
+expect "one cache entry" [ "$(find cache -type f | wc -l)" = 1 ]
+
+# A directory target is not stored in the cache
+start dir-target
+printf 'out:\n\tmkdir -p out\n' >mmakefile
+"$MMAKE" -c cache >/dev/null 2>err
+grep -q "could not store" err
+expect "no store error" [ $? = 1 ]
+
+# -q tells out of date targets and errors apart
+start question
+echo x >in
+printf 'out: in\n\tcp in out\n' >mmakefile
+"$MMAKE" -q
+expect "1 when out of date" [ $? = 1 ]
+"$MMAKE" >/dev/null
+"$MMAKE" -q
+expect "0 when up to date" [ $? = 0 ]
+"$MMAKE" -q nothere 2>/dev/null
+expect "2 without a rule" [ $? = 2 ]
+
+# watch ARGS... - Runs mmake --watch in the background until unwatch
+watch() {
+    "$MMAKE" --watch "$@" >watch.log 2>&1 &
+    WATCH_PID=$!
+    sleep 1
+}
+
+# unwatch - Stops the mmake started by watch
+unwatch() {
+    kill "$WATCH_PID"
+    wait "$WATCH_PID" 2>/dev/null
+}
+
+# A header that only the depfile lists is watched as well
+start watch-depfile
+printf '#!/bin/sh\ncat a.c h.h >out\necho "out: a.c h.h" >out.d\n' >gen.sh
+chmod +x gen.sh
+echo a >a.c
+echo h1 >h.h
+printf 'out: a.c\n\t./gen.sh\n\tdepfile = out.d\n' >mmakefile
+"$MMAKE" >/dev/null
+watch
+echo h2 >h.h
+sleep 1
+unwatch
+expect "rebuilds when the header changes" grep -q h2 out
+
+# Events match however the makefile writes a path
+start watch-paths
+echo x >in
+printf 'out: ./in\n\tcp in out\n' >mmakefile
+watch
+echo y >in
+sleep 1
+unwatch
+expect "rebuilds when ./in changes" grep -q y out
+
+# The writes of a build do not start another pass. all never exists, so
+# every pass runs it.
+start watch-own-writes
+echo x >in
+printf 'all: out\n\techo pass\nout: in\n\tcp in out\n' >mmakefile
+watch
+echo y >in
+sleep 1
+unwatch
+expect "one pass per change" [ "$(grep -cx pass watch.log)" = 2 ]
+
+exit $FAILED
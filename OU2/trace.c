@@ -0,0 +1,497 @@
+#include "trace.h"
+#include "hash.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Marks the end of a critical path and a missing record
+#define NO_RECORD SIZE_MAX
+
+enum visit { UNVISITED, VISITING, DONE };
+
+struct record {
+  char *target;
+  enum trace_status status;
+  int64_t start_us; // Relative to the start of the trace
+  int64_t dur_us;
+  bool ran; // Set if a recipe ran and the usage fields are valid
+  int64_t user_us;
+  int64_t sys_us;
+  long max_rss_kb;
+  int tid;
+  int64_t path_us;  // Longest path through the graph ending at this target
+  size_t path_prev; // Prerequisite before this target on that path
+  enum visit visit;
+};
+
+struct trace {
+  FILE *out;
+  struct timespec t0;
+  struct record *recs;
+  size_t n;
+  size_t cap;
+  size_t *index;    // Record number + 1 per slot, 0 marks an empty slot
+  size_t index_cap; // Always a power of two
+  bool failed;      // A record was lost to an allocation failure
+  int64_t fifo_us;  // Simulated makespans from trace_schedule
+  int64_t used_us;
+  size_t jobs; // 0 if no parallel build was recorded
+};
+
+// Frame of the iterative depth-first search in critical_paths
+struct frame {
+  size_t rec;
+  const char **prereq;
+  size_t next;
+};
+
+// Entry of the slowest recipe list
+struct slow {
+  int64_t dur_us;
+  size_t rec;
+};
+
+static const char *no_prereq[] = {NULL};
+
+static size_t *find_slot(trace *t, const char *target);
+static size_t find_record(trace *t, const char *target);
+static int grow(trace *t);
+static int64_t elapsed_us(const struct timespec *from,
+                          const struct timespec *to);
+static int64_t timeval_us(const struct timeval *tv);
+static const char **record_prereq(makefile *mf, const struct record *r);
+static int critical_paths(trace *t, makefile *mf);
+static void write_events(trace *t);
+static void write_json_str(FILE *out, const char *str);
+static void print_summary(trace *t);
+static int cmp_slow(const void *a, const void *b);
+
+static const char *status_names[] = {
+    [TRACE_SKIPPED] = "skipped",
+    [TRACE_REBUILT] = "rebuilt",
+    [TRACE_RESTORED] = "restored",
+    [TRACE_FAILED] = "failed",
+};
+
+trace *trace_open(const char *path) {
+  trace *t = calloc(1, sizeof *t);
+  if (!t) {
+    perror("calloc");
+    return NULL;
+  }
+
+  t->index_cap = 256;
+  t->index = calloc(t->index_cap, sizeof *t->index);
+  if (!t->index) {
+    perror("calloc");
+    free(t);
+    return NULL;
+  }
+
+  if (!(t->out = fopen(path, "w"))) {
+    perror(path);
+    free(t->index);
+    free(t);
+    return NULL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t->t0);
+  return t;
+}
+
+void trace_target(trace *t, const char *target, enum trace_status status,
+                  const struct timespec *start, const struct rusage *usage,
+                  int tid) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  size_t *slot = find_slot(t, target);
+  if (*slot != 0) {
+    return;
+  }
+
+  // Keep the index at most half full and room for one more record
+  if (2 * (t->n + 1) > t->index_cap || t->n == t->cap) {
+    if (grow(t) != 0) {
+      t->failed = true;
+      return;
+    }
+    slot = find_slot(t, target);
+  }
+
+  struct record *r = &t->recs[t->n];
+  if (!(r->target = strdup(target))) {
+    t->failed = true;
+    return;
+  }
+
+  r->status = status;
+  r->start_us = elapsed_us(&t->t0, start);
+  r->dur_us = elapsed_us(start, &end);
+  r->tid = tid;
+  r->ran = usage != NULL;
+  if (usage) {
+    r->user_us = timeval_us(&usage->ru_utime);
+    r->sys_us = timeval_us(&usage->ru_stime);
+    r->max_rss_kb = usage->ru_maxrss;
+  }
+  r->path_prev = NO_RECORD;
+  r->visit = UNVISITED;
+
+  *slot = ++t->n;
+}
+
+void trace_schedule(trace *t, int64_t fifo_us, int64_t used_us, size_t jobs) {
+  t->fifo_us += fifo_us;
+  t->used_us += used_us;
+  if (jobs > t->jobs) {
+    t->jobs = jobs;
+  }
+}
+
+int trace_close(trace *t, makefile *mf, bool report) {
+  if (!t) {
+    return 0;
+  }
+
+  int status = 0;
+  if (t->failed) {
+    fprintf(stderr, "mmake: Out of memory, trace is incomplete\n");
+  }
+
+  write_events(t);
+  if (ferror(t->out)) {
+    fprintf(stderr, "mmake: Could not write trace\n");
+    status = -1;
+  }
+  if (fclose(t->out) != 0) {
+    perror("fclose");
+    status = -1;
+  }
+
+  if (report && t->n > 0) {
+    if (critical_paths(t, mf) == 0) {
+      print_summary(t);
+    } else {
+      status = -1;
+    }
+  }
+
+  for (size_t i = 0; i < t->n; i++) {
+    free(t->recs[i].target);
+  }
+  free(t->recs);
+  free(t->index);
+  free(t);
+
+  return status;
+}
+
+/*
+ * find_slot - Finds the index slot of a target, or the empty slot where it
+ * would be inserted, using linear probing
+ *
+ * @param t         The trace
+ * @param target    Name of the target
+ *
+ * @return Pointer to the slot
+ * */
+static size_t *find_slot(trace *t, const char *target) {
+  size_t mask = t->index_cap - 1;
+  size_t i = hash_str(target) & mask;
+
+  while (t->index[i] != 0 &&
+         strcmp(t->recs[t->index[i] - 1].target, target) != 0) {
+    i = (i + 1) & mask;
+  }
+
+  return &t->index[i];
+}
+
+/*
+ * find_record - Looks up the record of a target
+ *
+ * @param t         The trace
+ * @param target    Name of the target
+ *
+ * @return Record number, NO_RECORD if the target was not recorded
+ * */
+static size_t find_record(trace *t, const char *target) {
+  size_t slot = *find_slot(t, target);
+  return slot == 0 ? NO_RECORD : slot - 1;
+}
+
+/*
+ * grow - Makes room for another record, doubling the record array and the
+ * index as needed
+ *
+ * @param t     The trace
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int grow(trace *t) {
+  if (t->n == t->cap) {
+    size_t cap = t->cap ? 2 * t->cap : 256;
+    struct record *recs = realloc(t->recs, cap * sizeof *recs);
+    if (!recs) {
+      return -1;
+    }
+    t->recs = recs;
+    t->cap = cap;
+  }
+
+  if (2 * (t->n + 1) > t->index_cap) {
+    size_t cap = 2 * t->index_cap;
+    size_t *index = calloc(cap, sizeof *index);
+    if (!index) {
+      return -1;
+    }
+
+    free(t->index);
+    t->index = index;
+    t->index_cap = cap;
+    for (size_t i = 0; i < t->n; i++) {
+      *find_slot(t, t->recs[i].target) = i + 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * elapsed_us - Computes the time between two timestamps
+ *
+ * @param from  The earlier timestamp
+ * @param to    The later timestamp
+ *
+ * @return Elapsed time in microseconds
+ * */
+static int64_t elapsed_us(const struct timespec *from,
+                          const struct timespec *to) {
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+         (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/*
+ * timeval_us - Converts a timeval to microseconds
+ *
+ * @param tv    The time
+ *
+ * @return The time in microseconds
+ * */
+static int64_t timeval_us(const struct timeval *tv) {
+  return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/*
+ * record_prereq - Gets the prerequisites of a recorded target
+ *
+ * @param mf    The makefile
+ * @param r     The record
+ *
+ * @return NULL-terminated array of prerequisites
+ * */
+static const char **record_prereq(makefile *mf, const struct record *r) {
+  rule *rule = makefile_rule(mf, r->target);
+  return rule ? rule_prereq(rule) : no_prereq;
+}
+
+/*
+ * critical_paths - Computes for every recorded target the longest chain of
+ * recorded durations through its prerequisites that ends at the target.
+ * The graph is walked iteratively since a chain of rules can be deeper than
+ * the stack allows.
+ *
+ * @param t     The trace
+ * @param mf    The makefile the targets came from
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int critical_paths(trace *t, makefile *mf) {
+  // Every record is pushed at most once
+  struct frame *stack = malloc(t->n * sizeof *stack);
+  if (!stack) {
+    perror("malloc");
+    return -1;
+  }
+
+  for (size_t root = 0; root < t->n; root++) {
+    if (t->recs[root].visit != UNVISITED) {
+      continue;
+    }
+
+    size_t sp = 0;
+    stack[sp++] = (struct frame){root, record_prereq(mf, &t->recs[root]), 0};
+    t->recs[root].visit = VISITING;
+
+    while (sp > 0) {
+      struct frame *f = &stack[sp - 1];
+
+      // Descend into the next prerequisite that has not been seen yet
+      if (f->prereq[f->next] != NULL) {
+        size_t p = find_record(t, f->prereq[f->next++]);
+        if (p != NO_RECORD && t->recs[p].visit == UNVISITED) {
+          t->recs[p].visit = VISITING;
+          stack[sp++] = (struct frame){p, record_prereq(mf, &t->recs[p]), 0};
+        }
+        continue;
+      }
+
+      // All prerequisites are done, a VISITING one is part of a cycle
+      struct record *r = &t->recs[f->rec];
+      int64_t longest = 0;
+      for (size_t i = 0; f->prereq[i] != NULL; i++) {
+        size_t p = find_record(t, f->prereq[i]);
+        if (p != NO_RECORD && t->recs[p].visit == DONE &&
+            t->recs[p].path_us > longest) {
+          longest = t->recs[p].path_us;
+          r->path_prev = p;
+        }
+      }
+      r->path_us = longest + r->dur_us;
+      r->visit = DONE;
+      sp--;
+    }
+  }
+
+  free(stack);
+  return 0;
+}
+
+/*
+ * write_events - Writes every record as a complete ("X") trace event
+ *
+ * @param t     The trace
+ * */
+static void write_events(trace *t) {
+  long pid = (long)getpid();
+
+  fprintf(t->out, "{\"traceEvents\":[");
+  for (size_t i = 0; i < t->n; i++) {
+    const struct record *r = &t->recs[i];
+
+    fprintf(t->out, "%s\n{\"name\":", i == 0 ? "" : ",");
+    write_json_str(t->out, r->target);
+    fprintf(t->out,
+            ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+            "\"pid\":%ld,\"tid\":%d,\"args\":{\"status\":\"%s\"",
+            status_names[r->status], (long long)r->start_us,
+            (long long)r->dur_us, pid, r->tid, status_names[r->status]);
+    if (r->ran) {
+      fprintf(t->out,
+              ",\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%ld",
+              r->user_us / 1000.0, r->sys_us / 1000.0, r->max_rss_kb);
+    }
+    fprintf(t->out, "}}");
+  }
+  fprintf(t->out, "\n],\"displayTimeUnit\":\"ms\"");
+  if (t->jobs > 0) {
+    fprintf(t->out,
+            ",\"otherData\":{\"jobs\":%zu,\"makespan_fifo_us\":%lld,"
+            "\"makespan_scheduled_us\":%lld}",
+            t->jobs, (long long)t->fifo_us, (long long)t->used_us);
+  }
+  fprintf(t->out, "}\n");
+}
+
+/*
+ * write_json_str - Writes a string as a quoted JSON string
+ *
+ * @param out   The stream to write to
+ * @param str   The string
+ * */
+static void write_json_str(FILE *out, const char *str) {
+  putc('"', out);
+  for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(out, "\\%c", *c);
+    } else if (*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    } else {
+      putc(*c, out);
+    }
+  }
+  putc('"', out);
+}
+
+/*
+ * print_summary - Prints the critical path in build order and the slowest
+ * recipes to stderr
+ *
+ * @param t     The trace, after critical_paths
+ * */
+static void print_summary(trace *t) {
+  size_t end = 0;
+  for (size_t i = 1; i < t->n; i++) {
+    if (t->recs[i].path_us > t->recs[end].path_us) {
+      end = i;
+    }
+  }
+
+  // The path is linked from its last target, print it from the first
+  size_t len = 0;
+  for (size_t i = end; i != NO_RECORD; i = t->recs[i].path_prev) {
+    len++;
+  }
+  size_t *path = malloc(len * sizeof *path);
+  struct slow *slow = malloc(t->n * sizeof *slow);
+  if (!path || !slow) {
+    perror("malloc");
+    free(path);
+    free(slow);
+    return;
+  }
+
+  size_t k = len;
+  for (size_t i = end; i != NO_RECORD; i = t->recs[i].path_prev) {
+    path[--k] = i;
+  }
+
+  fprintf(stderr, "mmake: critical path %.3f s over %zu targets\n",
+          t->recs[end].path_us / 1e6, len);
+  for (size_t i = 0; i < len; i++) {
+    const struct record *r = &t->recs[path[i]];
+    fprintf(stderr, "mmake:   %10.3f s  %-8s %s\n", r->dur_us / 1e6,
+            status_names[r->status], r->target);
+  }
+
+  size_t n_slow = 0;
+  for (size_t i = 0; i < t->n; i++) {
+    if (t->recs[i].ran) {
+      slow[n_slow++] = (struct slow){t->recs[i].dur_us, i};
+    }
+  }
+  qsort(slow, n_slow, sizeof *slow, cmp_slow);
+
+  if (n_slow > 0) {
+    fprintf(stderr, "mmake: slowest recipes\n");
+  }
+  for (size_t i = 0; i < n_slow && i < TRACE_TOP; i++) {
+    const struct record *r = &t->recs[slow[i].rec];
+    fprintf(stderr, "mmake:   %10.3f s  cpu %.3f s  rss %ld KiB  %s\n",
+            r->dur_us / 1e6, (r->user_us + r->sys_us) / 1e6, r->max_rss_kb,
+            r->target);
+  }
+
+  if (t->jobs > 0) {
+    fprintf(stderr,
+            "mmake: makespan at %zu jobs %.3f s critical path first, "
+            "%.3f s in file order, %.3f s saved\n",
+            t->jobs, t->used_us / 1e6, t->fifo_us / 1e6,
+            (t->fifo_us - t->used_us) / 1e6);
+  }
+
+  free(path);
+  free(slow);
+}
+
+/*
+ * cmp_slow - Orders slowest recipe entries by descending duration
+ * */
+static int cmp_slow(const void *a, const void *b) {
+  const struct slow *x = a;
+  const struct slow *y = b;
+  return (x->dur_us < y->dur_us) - (x->dur_us > y->dur_us);
+}
@@ -0,0 +1,84 @@
+/**
+ * Build tracing. Records when each target was checked or built, how it was
+ * brought up to date and the resources its recipe used. The trace is
+ * written as Chrome trace-event JSON, which Perfetto and chrome://tracing
+ * can load, and summarized as the critical path through the dependency
+ * graph and the slowest recipes.
+ *
+ * @file trace.h
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "parser.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Number of recipes listed in the summary
+#define TRACE_TOP 10
+
+enum trace_status {
+  TRACE_SKIPPED,  // Target was up to date
+  TRACE_REBUILT,  // Recipe ran
+  TRACE_RESTORED, // Target was restored from the action cache
+  TRACE_FAILED,   // Recipe failed
+};
+
+typedef struct trace trace;
+
+/*
+ * trace_open - Starts a trace. The file is created right away so a bad path
+ * is reported before anything is built.
+ *
+ * @param path  Path of the JSON file written by trace_close
+ *
+ * @return Pointer to the trace or NULL on failure
+ * */
+trace *trace_open(const char *path);
+
+/*
+ * trace_target - Records a target. Only the first record of a target is
+ * kept, later visits of the same target are ignored.
+ *
+ * @param t         The trace
+ * @param target    Name of the target
+ * @param status    How the target was brought up to date
+ * @param start     CLOCK_MONOTONIC time the target's own work started, after
+ *                  its prerequisites were built. The end is taken as now.
+ * @param usage     Resource usage of the recipe from wait4, NULL if no
+ *                  recipe ran
+ * @param tid       Trace thread the target is shown on, the job slot of a
+ *                  recipe
+ * */
+void trace_target(trace *t, const char *target, enum trace_status status,
+                  const struct timespec *start, const struct rusage *usage,
+                  int tid);
+
+/*
+ * trace_schedule - Records the simulated makespan of a build in node order
+ * and in the order mmake used, for the summary. Several builds add up.
+ *
+ * @param t         The trace
+ * @param fifo_us   Makespan in node order
+ * @param used_us   Makespan in the order used
+ * @param jobs      Number of job slots of the simulation
+ * */
+void trace_schedule(trace *t, int64_t fifo_us, int64_t used_us, size_t jobs);
+
+/*
+ * trace_close - Writes the trace file, prints the summary and frees the
+ * trace
+ *
+ * @param t         The trace, may be NULL
+ * @param mf        The makefile the targets came from
+ * @param report    Print the critical path and slowest recipes to stderr
+ *
+ * @return 0 on success, -1 if the trace could not be written
+ * */
+int trace_close(trace *t, makefile *mf, bool report);
+
+#endif
@@ -0,0 +1,818 @@
+#include "watch.h"
+#include "graph.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Events that can make a file newer, older, appear or disappear
+#define WATCH_MASK                                                             \
+  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE |      \
+   IN_ATTRIB | IN_ONLYDIR)
+
+// Directory with an inotify watch
+struct dir {
+  char *path;
+  int wd;
+};
+
+// A file whose changes mark a node dirty: the file of the node itself, or
+// a prerequisite the depfile of the node listed at its last build, which is
+// not a node of the graph
+struct file {
+  char *path;   // Normalized, the way events are compared
+  char *name;   // As written, the way the stat cache knows it
+  size_t node;
+  bool listed;  // From a depfile
+};
+
+// What a build left a target as, to tell its own writes from later changes
+struct stamp {
+  bool exists;
+  struct timespec mtime;
+  off_t size;
+};
+
+struct watch {
+  struct build_state *s;
+  const char *path;  // Path of the makefile as given
+  char *mf_path;     // The same path, normalized
+  const char **goals;
+  size_t n_goals;
+  int fd;            // inotify instance
+  int sig_fd;        // signalfd for SIGINT and SIGTERM
+  struct dir *dirs;
+  size_t n_dirs;
+  size_t cap_dirs;
+  graph *g;          // NULL while the makefile has a cycle
+  bool *dirty;       // Per node, may be out of date. Closed under dependents.
+  size_t *stack;     // Scratch space of mark_dirty
+  struct stamp *stamps; // Per node, targets as the last build left them
+  struct file *files;    // Sorted by path
+  size_t n_files;
+  size_t cap_files;
+  bool any_dirty;    // A build is due
+  bool reload;       // The makefile changed
+  bool rescan;       // Directories may need watches
+  bool missing;      // Some directory did not exist at the last scan
+};
+
+static int load_graph(struct watch *w);
+static int load_files(struct watch *w);
+static int add_file(struct watch *w, const char *name, size_t node,
+                    bool listed);
+static void forget_files(struct watch *w);
+static void stamp_targets(struct watch *w);
+static bool get_stamp(const char *name, struct stamp *stamp);
+static void reload(struct watch *w);
+static int add_watches(struct watch *w);
+static int add_dir(struct watch *w, char *path);
+static bool wait_events(struct watch *w);
+static int read_events(struct watch *w);
+static void handle_event(struct watch *w, const struct inotify_event *ev);
+static void mark_dirty(struct watch *w, size_t n);
+static void forget_graph(struct watch *w);
+static char *dir_of(const char *path);
+static char *join(const char *dir, const char *name);
+static char *normalize(const char *path);
+static int cmp_str(const void *a, const void *b);
+static int cmp_file(const void *a, const void *b);
+
+int watch_build(struct build_state *s, const char *path, const char **goals,
+                size_t n_goals) {
+  struct watch w = {
+      .s = s,
+      .path = path,
+      .goals = goals,
+      .n_goals = n_goals,
+      .fd = -1,
+      .sig_fd = -1,
+  };
+  int status = EXIT_FAILURE;
+
+  // Signals are read from a signalfd between builds. Recipes start with no
+  // signals blocked, so ^C still stops them and fails the build first.
+  sigset_t sigs, old_mask;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigprocmask(SIG_BLOCK, &sigs, &old_mask);
+
+  if ((w.sig_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+    perror("signalfd");
+    goto out;
+  }
+  if ((w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+    perror("inotify_init1");
+    goto out;
+  }
+
+  if (!(w.mf_path = normalize(path))) {
+    perror("malloc");
+    goto out;
+  }
+
+  if (load_graph(&w) != 0) {
+    goto out;
+  }
+
+  bool announced = false;
+  while (true) {
+    if (w.g && w.any_dirty) {
+      status = build_graph(w.g, w.dirty, s);
+      stamp_targets(&w);
+      // After a failure the same targets are checked again on the next
+      // change
+      if (status == EXIT_SUCCESS) {
+        memset(w.dirty, false, w.g->n * sizeof *w.dirty);
+      }
+      w.any_dirty = false;
+      w.rescan |= w.missing;
+
+      // The build may have read new depfiles
+      if (load_files(&w) != 0) {
+        break;
+      }
+    }
+
+    if (add_watches(&w) != 0) {
+      break;
+    }
+    if (!announced && !s->silent) {
+      fprintf(stderr, "mmake: Watching %zu directories for changes\n",
+              w.n_dirs);
+      announced = true;
+    }
+
+    if (!wait_events(&w)) {
+      break;
+    }
+  }
+
+out:
+  forget_graph(&w);
+  for (size_t i = 0; i < w.n_dirs; i++) {
+    free(w.dirs[i].path);
+  }
+  free(w.dirs);
+  free(w.mf_path);
+  if (w.fd != -1) {
+    close(w.fd);
+  }
+  if (w.sig_fd != -1) {
+    close(w.sig_fd);
+  }
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  return status;
+}
+
+/*
+ * load_graph - Builds the graph of the goals from the current makefile and
+ * marks every node dirty. A cycle leaves no graph until the makefile
+ * changes.
+ *
+ * @param w     The watch
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int load_graph(struct watch *w) {
+  const char **goals = w->goals;
+  size_t n_goals = w->n_goals;
+  const char *default_target;
+
+  if (n_goals == 0) {
+    if (!(default_target = makefile_default_target(w->s->mf))) {
+      fprintf(stderr, "mmake: No targets\n");
+      return 0;
+    }
+    goals = &default_target;
+    n_goals = 1;
+  }
+
+  if (!(w->g = graph_new(w->s->mf, goals, n_goals))) {
+    return 0;
+  }
+
+  w->dirty = malloc(w->g->n * sizeof *w->dirty);
+  w->stack = malloc(w->g->n * sizeof *w->stack);
+  w->stamps = calloc(w->g->n, sizeof *w->stamps);
+  if (!w->dirty || !w->stack || !w->stamps) {
+    perror("malloc");
+    forget_graph(w);
+    return -1;
+  }
+
+  if (load_files(w) != 0) {
+    forget_graph(w);
+    return -1;
+  }
+
+  memset(w->dirty, true, w->g->n * sizeof *w->dirty);
+  w->any_dirty = true;
+  w->rescan = true;
+  return 0;
+}
+
+/*
+ * load_files - Gathers the files of the nodes of the graph and the
+ * prerequisites their depfiles listed, from the build database, and has
+ * their directories watched
+ *
+ * @param w     The watch
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int load_files(struct watch *w) {
+  forget_files(w);
+  if (!w->g) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < w->g->n; i++) {
+    if (add_file(w, w->g->names[i], i, false) != 0) {
+      return -1;
+    }
+
+    // The records are NUL-separated lists
+    size_t len = 0;
+    const char *list = w->g->rules[i] && w->s->db
+                           ? db_get(w->s->db, DB_DEPS, w->g->names[i], &len)
+                           : NULL;
+    for (size_t k = 0; list && k < len; k += strlen(list + k) + 1) {
+      if (add_file(w, list + k, i, true) != 0) {
+        return -1;
+      }
+    }
+  }
+
+  qsort(w->files, w->n_files, sizeof *w->files, cmp_file);
+  w->rescan = true;
+  return 0;
+}
+
+/*
+ * add_file - Appends a file to the unsorted files of the watch
+ *
+ * @param w         The watch
+ * @param name      Name of the file as written
+ * @param node      The node it marks dirty
+ * @param listed    true if a depfile of the node listed it
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int add_file(struct watch *w, const char *name, size_t node,
+                    bool listed) {
+  if (w->n_files == w->cap_files) {
+    size_t cap = w->cap_files ? 2 * w->cap_files : 64;
+    struct file *files = realloc(w->files, cap * sizeof *files);
+    if (!files) {
+      perror("realloc");
+      return -1;
+    }
+    w->files = files;
+    w->cap_files = cap;
+  }
+
+  struct file *f = &w->files[w->n_files];
+  f->path = normalize(name);
+  f->name = strdup(name);
+  if (!f->path || !f->name) {
+    perror("malloc");
+    free(f->path);
+    free(f->name);
+    return -1;
+  }
+  f->node = node;
+  f->listed = listed;
+  w->n_files++;
+  return 0;
+}
+
+/*
+ * forget_files - Frees the files of the watch
+ *
+ * @param w     The watch
+ * */
+static void forget_files(struct watch *w) {
+  for (size_t i = 0; i < w->n_files; i++) {
+    free(w->files[i].path);
+    free(w->files[i].name);
+  }
+  free(w->files);
+  w->files = NULL;
+  w->n_files = 0;
+  w->cap_files = 0;
+}
+
+/*
+ * stamp_targets - Keeps what the build left each target it checked as, so
+ * the events of its own writes are not taken for changes
+ *
+ * @param w     The watch, right after a build
+ * */
+static void stamp_targets(struct watch *w) {
+  for (size_t i = 0; i < w->g->n; i++) {
+    if (w->g->rules[i] && w->dirty[i]) {
+      get_stamp(w->g->names[i], &w->stamps[i]);
+    }
+  }
+}
+
+/*
+ * get_stamp - Reads the stat data of a file that tells a change
+ *
+ * @param name      The file
+ * @param stamp     Filled with its stat data, exists is false if it is not
+ *                  there
+ *
+ * @return The value of stamp->exists
+ * */
+static bool get_stamp(const char *name, struct stamp *stamp) {
+  struct stat st;
+  *stamp = (struct stamp){.exists = stat(name, &st) == 0};
+  if (stamp->exists) {
+    stamp->mtime = st.st_mtim;
+    stamp->size = st.st_size;
+  }
+  return stamp->exists;
+}
+
+/*
+ * reload - Parses the changed makefile and replaces the graph. If the new
+ * makefile can not be read the old one is kept.
+ *
+ * @param w     The watch
+ * */
+static void reload(struct watch *w) {
+  FILE *file = fopen(w->path, "r");
+  if (!file) {
+    perror(w->path);
+    return;
+  }
+
+  makefile *mf = parse_makefile_cached(file, w->path);
+  fclose(file);
+  if (!mf) {
+    fprintf(stderr, "mmake: Keeping the previous %s\n", w->path);
+    return;
+  }
+
+  forget_graph(w);
+  makefile_del(w->s->mf);
+  w->s->mf = mf;
+
+  if (load_graph(w) != 0) {
+    w->any_dirty = false;
+  }
+}
+
+/*
+ * add_watches - Watches the directory of the makefile, of every file in
+ * the graph and of every prerequisite from a depfile. Directories that do
+ * not exist yet are tried again after the next build.
+ *
+ * @param w     The watch
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int add_watches(struct watch *w) {
+  if (!w->rescan) {
+    return 0;
+  }
+
+  size_t n = w->n_files;
+  char **paths = malloc((n + 1) * sizeof *paths);
+  if (!paths) {
+    perror("malloc");
+    return -1;
+  }
+
+  size_t n_paths = 0;
+  int status = 0;
+  for (size_t i = 0; i <= n; i++) {
+    if (!(paths[n_paths++] = dir_of(i < n ? w->files[i].path : w->mf_path))) {
+      perror("malloc");
+      status = -1;
+      goto out;
+    }
+  }
+
+  // Most files share their directory with others
+  qsort(paths, n_paths, sizeof *paths, cmp_str);
+
+  w->missing = false;
+  for (size_t i = 0; i < n_paths; i++) {
+    char *path = paths[i];
+    paths[i] = NULL;
+    if (i + 1 < n_paths && strcmp(path, paths[i + 1]) == 0) {
+      free(path);
+    } else if (add_dir(w, path) != 0) {
+      status = -1;
+      goto out;
+    }
+  }
+  w->rescan = false;
+
+out:
+  for (size_t i = 0; i < n_paths; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+  return status;
+}
+
+/*
+ * add_dir - Adds a watch on a directory unless it has one
+ *
+ * @param w     The watch
+ * @param path  Path of the directory, owned by the watch on success
+ *
+ * @return 0 on success, -1 on allocation failure
+ * */
+static int add_dir(struct watch *w, char *path) {
+  int wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+  if (wd == -1) {
+    if (errno == ENOENT || errno == ENOTDIR) {
+      w->missing = true;
+    } else if (errno == ENOSPC) {
+      fprintf(stderr, "mmake: Too many watches for %s, raise "
+                      "fs.inotify.max_user_watches\n", path);
+    } else {
+      perror(path);
+    }
+    free(path);
+    return 0;
+  }
+
+  // Adding a watch to a watched directory gives back its descriptor
+  for (size_t i = 0; i < w->n_dirs; i++) {
+    if (w->dirs[i].wd == wd) {
+      free(path);
+      return 0;
+    }
+  }
+
+  if (w->n_dirs == w->cap_dirs) {
+    size_t cap = w->cap_dirs ? 2 * w->cap_dirs : 16;
+    struct dir *dirs = realloc(w->dirs, cap * sizeof *dirs);
+    if (!dirs) {
+      perror("realloc");
+      free(path);
+      return -1;
+    }
+    w->dirs = dirs;
+    w->cap_dirs = cap;
+  }
+
+  w->dirs[w->n_dirs++] = (struct dir){.path = path, .wd = wd};
+  return 0;
+}
+
+/*
+ * wait_events - Waits for a change that needs a build. Events are gathered
+ * until none arrived for WATCH_QUIET_MS, so an editor saving several files
+ * or a checkout gives one build.
+ *
+ * @param w     The watch
+ *
+ * @return true if a build is due, false on a signal or error
+ * */
+static bool wait_events(struct watch *w) {
+  struct pollfd fds[] = {
+      {.fd = w->fd, .events = POLLIN},
+      {.fd = w->sig_fd, .events = POLLIN},
+  };
+  int timeout = -1;
+
+  while (true) {
+    int n = poll(fds, 2, timeout);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return false;
+    }
+
+    if (fds[1].revents) {
+      return false;
+    }
+
+    if (n > 0) {
+      if (read_events(w) != 0) {
+        return false;
+      }
+      timeout = WATCH_QUIET_MS;
+      continue;
+    }
+
+    // The burst is over
+    if (w->reload) {
+      w->reload = false;
+      reload(w);
+    }
+    if (w->any_dirty) {
+      return true;
+    }
+    if (add_watches(w) != 0) {
+      return false;
+    }
+    timeout = -1;
+  }
+}
+
+/*
+ * read_events - Handles all queued inotify events
+ *
+ * @param w     The watch
+ *
+ * @return 0 on success, -1 if the events could not be read
+ * */
+static int read_events(struct watch *w) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (true) {
+    ssize_t len = read(w->fd, buf, sizeof buf);
+    if (len == -1) {
+      if (errno == EAGAIN) {
+        return 0;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("inotify");
+      return -1;
+    }
+
+    const struct inotify_event *ev;
+    for (char *p = buf; p < buf + len; p += sizeof *ev + ev->len) {
+      ev = (const struct inotify_event *)p;
+      handle_event(w, ev);
+    }
+  }
+}
+
+/*
+ * handle_event - Marks the file of an event and its dependents dirty and
+ * drops its cached metadata. Events of a target the last build wrote are
+ * ignored.
+ *
+ * @param w     The watch
+ * @param ev    The event
+ * */
+static void handle_event(struct watch *w, const struct inotify_event *ev) {
+  // Events were lost, so anything may have changed
+  if (ev->mask & IN_Q_OVERFLOW) {
+    statcache *stats = statcache_new();
+    if (stats) {
+      statcache_del(w->s->stats);
+      w->s->stats = stats;
+    }
+    if (w->g) {
+      memset(w->dirty, true, w->g->n * sizeof *w->dirty);
+      w->any_dirty = true;
+    }
+    w->reload = true;
+    w->rescan = true;
+    return;
+  }
+
+  size_t d = 0;
+  while (d < w->n_dirs && w->dirs[d].wd != ev->wd) {
+    d++;
+  }
+  if (d == w->n_dirs) {
+    return;
+  }
+
+  // The directory is gone, watch it again if it comes back
+  if (ev->mask & IN_IGNORED) {
+    free(w->dirs[d].path);
+    w->dirs[d] = w->dirs[--w->n_dirs];
+    w->rescan = true;
+    return;
+  }
+
+  if (ev->len == 0) {
+    return;
+  }
+  if ((ev->mask & IN_ISDIR) && w->missing) {
+    w->rescan = true;
+  }
+
+  char *joined = join(w->dirs[d].path, ev->name);
+  char *path = joined ? normalize(joined) : NULL;
+  free(joined);
+  if (!path) {
+    perror("malloc");
+    return;
+  }
+
+  if (strcmp(path, w->mf_path) == 0) {
+    w->reload = true;
+  }
+
+  // Every file with the path, the files are sorted
+  struct file key = {.path = path};
+  struct file *f = w->n_files > 0 ? bsearch(&key, w->files, w->n_files,
+                                            sizeof *w->files, cmp_file)
+                                  : NULL;
+  while (f && f > w->files && strcmp(f[-1].path, path) == 0) {
+    f--;
+  }
+  struct file *end = f;
+  while (end && end < w->files + w->n_files && strcmp(end->path, path) == 0) {
+    end++;
+  }
+
+  // A target that is as the last build left it was written by that build
+  for (struct file *own = f; own && own < end; own++) {
+    struct stamp now;
+    const struct stamp *then = &w->stamps[own->node];
+    if (!own->listed && w->g->rules[own->node] && then->exists &&
+        get_stamp(own->name, &now) && now.size == then->size &&
+        now.mtime.tv_sec == then->mtime.tv_sec &&
+        now.mtime.tv_nsec == then->mtime.tv_nsec) {
+      free(path);
+      return;
+    }
+  }
+
+  for (; f && f < end; f++) {
+    statcache_invalidate(w->s->stats, f->name);
+    mark_dirty(w, f->node);
+  }
+
+  free(path);
+}
+
+/*
+ * mark_dirty - Marks a node and everything that depends on it dirty
+ *
+ * @param w     The watch
+ * @param n     Node number
+ * */
+static void mark_dirty(struct watch *w, size_t n) {
+  w->any_dirty = true;
+  if (w->dirty[n]) {
+    return;
+  }
+
+  size_t sp = 0;
+  w->dirty[n] = true;
+  w->stack[sp++] = n;
+
+  while (sp > 0) {
+    size_t node = w->stack[--sp];
+    for (size_t e = w->g->dependent_off[node];
+         e < w->g->dependent_off[node + 1]; e++) {
+      size_t dep = w->g->dependents[e];
+      if (!w->dirty[dep]) {
+        w->dirty[dep] = true;
+        w->stack[sp++] = dep;
+      }
+    }
+  }
+}
+
+/*
+ * forget_graph - Frees the graph and its per-node state
+ *
+ * @param w     The watch
+ * */
+static void forget_graph(struct watch *w) {
+  forget_files(w);
+  graph_del(w->g);
+  free(w->dirty);
+  free(w->stack);
+  free(w->stamps);
+  w->g = NULL;
+  w->dirty = NULL;
+  w->stack = NULL;
+  w->stamps = NULL;
+}
+
+/*
+ * dir_of - Gives the directory part of a path
+ *
+ * @param path  The path
+ *
+ * @return Newly allocated directory, "." for a bare name. NULL on allocation
+ * failure.
+ * */
+static char *dir_of(const char *path) {
+  const char *slash = strrchr(path, '/');
+  if (!slash) {
+    return strdup(".");
+  }
+  if (slash == path) {
+    return strdup("/");
+  }
+  return strndup(path, slash - path);
+}
+
+/*
+ * join - Gives the path of a name inside a directory the way it is written
+ * in the makefile, a name in "." stays bare
+ *
+ * @param dir   The directory, as given by dir_of
+ * @param name  Name of the entry
+ *
+ * @return Newly allocated path, NULL on allocation failure
+ * */
+static char *join(const char *dir, const char *name) {
+  if (strcmp(dir, ".") == 0) {
+    return strdup(name);
+  }
+
+  size_t dir_len = strlen(dir);
+  size_t name_len = strlen(name);
+  bool sep = dir[dir_len - 1] != '/';
+  char *path = malloc(dir_len + sep + name_len + 1);
+  if (!path) {
+    return NULL;
+  }
+
+  memcpy(path, dir, dir_len);
+  path[dir_len] = '/';
+  memcpy(path + dir_len + sep, name, name_len + 1);
+  return path;
+}
+
+/*
+ * normalize - Gives a path without "." components and repeated or trailing
+ * slashes, so that the ways the makefile, depfiles and events write one
+ * file compare equal. ".." is kept, resolving it needs the filesystem.
+ *
+ * @param path  The path
+ *
+ * @return Newly allocated path, "." for the current directory. NULL on
+ * allocation failure.
+ * */
+static char *normalize(const char *path) {
+  char *out = malloc(strlen(path) + 2);
+  if (!out) {
+    return NULL;
+  }
+
+  size_t len = 0;
+  if (path[0] == '/') {
+    out[len++] = '/';
+  }
+  const char *p = path;
+  while (*p != '\0') {
+    while (*p == '/') {
+      p++;
+    }
+    const char *part = p;
+    while (*p != '\0' && *p != '/') {
+      p++;
+    }
+
+    size_t part_len = p - part;
+    if (part_len == 0 || (part_len == 1 && part[0] == '.')) {
+      continue;
+    }
+    if (len > 0 && out[len - 1] != '/') {
+      out[len++] = '/';
+    }
+    memcpy(out + len, part, part_len);
+    len += part_len;
+  }
+
+  if (len == 0) {
+    out[len++] = '.';
+  }
+  out[len] = '\0';
+  return out;
+}
+
+/*
+ * cmp_str - qsort comparison of strings
+ *
+ * @param a     Pointer to the first string
+ * @param b     Pointer to the second string
+ *
+ * @return Result of strcmp
+ * */
+static int cmp_str(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * cmp_file - qsort and bsearch comparison of files by path
+ *
+ * @param a     Pointer to the first struct file
+ * @param b     Pointer to the second struct file
+ *
+ * @return Result of strcmp
+ * */
+static int cmp_file(const void *a, const void *b) {
+  return strcmp(((const struct file *)a)->path, ((const struct file *)b)->path);
+}
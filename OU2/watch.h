@@ -0,0 +1,35 @@
+/**
+ * Watch mode. The goals are built once, then mmake stays running with the
+ * graph and the file metadata in memory and waits for inotify events on the
+ * directories of the graph's files. A change marks the file and everything
+ * that depends on it for checking and the goals are built again, checking
+ * only the marked targets. A change to the makefile reloads it.
+ *
+ * @file watch.h
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "build.h"
+#include <stddef.h>
+
+// Quiet period in milliseconds that ends a burst of events
+#define WATCH_QUIET_MS 100
+
+/*
+ * watch_build - Builds the goals and rebuilds them whenever a file they
+ * depend on changes, until SIGINT or SIGTERM. A failed build does not end
+ * the watch. s->mf and s->stats are replaced when the makefile is reloaded.
+ *
+ * @param s         The makefile, options and caches of this run
+ * @param path      Path of the makefile
+ * @param goals     Names of the goals, not pointing into the makefile
+ * @param n_goals   Number of goals, 0 to build the default target
+ *
+ * @return EXIT_SUCCESS if the last build succeeded
+ * */
+int watch_build(struct build_state *s, const char *path, const char **goals,
+                size_t n_goals);
+
+#endif